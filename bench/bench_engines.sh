@@ -0,0 +1,78 @@
+#!/bin/sh
+#
+# Licensed to the Apache Software Foundation (ASF) under one or more
+# contributor license agreements.  See the NOTICE file distributed with
+# this work for additional information regarding copyright ownership.
+# The ASF licenses this file to You under the Apache License, Version 2.0
+# (the "License"); you may not use this file except in compliance with
+# the License.  You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Compare the GraphicsMagick and libvips engines on the same images.
+#
+# The server must serve the same directory of images below two prefixes,
+# one for each engine, for example:
+#
+#   Alias /bench/graphicsmagick /var/www/images
+#   Alias /bench/vips /var/www/images
+#   <Location /bench>
+#     SetOutputFilter MAGICK;MAGICK_RESIZE
+#     MagickResizeColumns %{QUERY_STRING}
+#   </Location>
+#   <Location /bench/graphicsmagick>
+#     MagickEngine graphicsmagick
+#   </Location>
+#   <Location /bench/vips>
+#     MagickEngine vips
+#   </Location>
+#
+# Usage: bench_engines.sh http://localhost/bench image.jpg [image.png ...]
+#
+# Each image is requested REQUESTS times (default 20) at each of the
+# WIDTHS (default "160 640 1600") from each engine, and the mean time and
+# mean size of the responses are printed.
+
+set -e
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 base-url image [image ...]" >&2
+    exit 1
+fi
+
+base=$1
+shift
+
+requests=${REQUESTS:-20}
+widths=${WIDTHS:-"160 640 1600"}
+
+printf "%-24s %6s %-16s %10s %10s\n" image width engine "mean ms" "mean bytes"
+
+for image in "$@"; do
+    for width in $widths; do
+        for engine in graphicsmagick vips; do
+            url="$base/$engine/$image?$width"
+            i=0
+            while [ $i -lt "$requests" ]; do
+                curl -s -o /dev/null -w "%{time_total} %{size_download} %{http_code}\n" "$url"
+                i=$((i + 1))
+            done | awk -v image="$image" -v width="$width" -v engine="$engine" '
+                $3 != 200 { failed++ }
+                { time += $1; bytes += $2; n++ }
+                END {
+                    if (failed) {
+                        printf "%-24s %6s %-16s %10s\n", image, width, engine, "failed";
+                    } else {
+                        printf "%-24s %6s %-16s %10.2f %10d\n", image, width,
+                                engine, time * 1000 / n, bytes / n;
+                    }
+                }'
+        done
+    done
+done
@@ -0,0 +1,248 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Analysis of source images and pixels that needs no GraphicsMagick, kept
+ * apart from mod_magick.c so that it can be tested without httpd.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "magick_analyse.h"
+
+#define MAGICK_AUTO_FLAT 2
+#define MAGICK_AUTO_EDGE 48
+
+/*
+ * Estimate the quality a JPEG image was saved with, by comparing the
+ * luminance quantization table with the table the IJG encoder scales by
+ * quality.
+ */
+int magick_jpeg_quality(const unsigned char *in, apr_size_t len)
+{
+    static const unsigned char luminance[64] = {
+            16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55,
+            14, 13, 16, 24, 40, 57, 69, 56, 14, 17, 22, 29, 51, 87, 80, 62,
+            18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92,
+            49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103,
+            99 };
+    apr_size_t pos = 2;
+
+    if (len < 4 || in[0] != 0xFF || in[1] != 0xD8) {
+        return 0;
+    }
+
+    while (pos + 4 <= len) {
+        apr_size_t seglen, tpos;
+        unsigned char marker;
+
+        if (in[pos] != 0xFF) {
+            return 0;
+        }
+
+        /* skip fill bytes */
+        while (pos + 4 < len && in[pos + 1] == 0xFF) {
+            pos++;
+        }
+        marker = in[pos + 1];
+
+        /* markers without a length */
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            pos += 2;
+            continue;
+        }
+
+        /* the tables precede the first scan */
+        if (marker == 0xD9 || marker == 0xDA) {
+            return 0;
+        }
+
+        seglen = (in[pos + 2] << 8) | in[pos + 3];
+        if (seglen < 2 || pos + 2 + seglen > len) {
+            return 0;
+        }
+
+        /* a DQT segment holds one or more tables */
+        for (tpos = pos + 4; marker == 0xDB && tpos < pos + 2 + seglen;) {
+            int precision = in[tpos] >> 4, id = in[tpos] & 0x0F, i;
+            apr_size_t tlen = 1 + 64 * (precision ? 2 : 1);
+            unsigned long sum = 0, reference = 0, scale;
+
+            if (tpos + tlen > pos + 2 + seglen) {
+                return 0;
+            }
+
+            if (id) {
+                tpos += tlen;
+                continue;
+            }
+
+            /* entries clamped by the encoder say nothing about the scale */
+            for (i = 0; i < 64; i++) {
+                unsigned long value = precision ? (in[tpos + 1 + i * 2] << 8)
+                        | in[tpos + 2 + i * 2] : in[tpos + 1 + i];
+
+                if (value < 255) {
+                    sum += value;
+                    reference += luminance[i];
+                }
+            }
+            if (!reference) {
+                return 1;
+            }
+
+            /* the encoder scales the table by 5000 / quality below 50, and
+             * by 200 - quality * 2 above */
+            scale = (sum * 100 + reference / 2) / reference;
+            if (scale <= 100) {
+                return scale ? (int)((200 - scale + 1) / 2) : 100;
+            }
+            return scale >= 5000 ? 1 : (int)((5000 + scale / 2) / scale);
+        }
+
+        pos += seglen + 2;
+    }
+
+    return 0;
+}
+
+int magick_colors_make(magick_colors *c, unsigned long limit)
+{
+    int bits = 1;
+
+    /* keep the table at most half full */
+    while ((1UL << bits) < limit * 2) {
+        bits++;
+    }
+
+    c->table = calloc((apr_size_t)1 << bits, sizeof(apr_uint64_t));
+    c->bits = bits;
+    c->limit = limit;
+    c->count = 0;
+    c->alpha = 0;
+
+    return c->table != NULL;
+}
+
+unsigned long magick_colors_add(magick_colors *c, const unsigned char *row,
+        unsigned long columns)
+{
+    unsigned long x;
+
+    for (x = 0; x < columns && c->count <= c->limit; x++) {
+        const unsigned char *p = row + x * 4;
+        apr_uint32_t color;
+        apr_uint64_t key;
+        apr_size_t slot;
+
+        if (p[3] != 255) {
+            c->alpha = 1;
+        }
+        color = p[3] ? ((apr_uint32_t)p[0] << 24) | (p[1] << 16)
+                | (p[2] << 8) | p[3] : 0;
+
+        /* the top bit marks the slot as used */
+        key = ((apr_uint64_t)1 << 32) | color;
+        slot = (apr_uint32_t)(color * 2654435761U) >> (32 - c->bits);
+        while (c->table[slot] && c->table[slot] != key) {
+            slot = (slot + 1) & ((1UL << c->bits) - 1);
+        }
+        if (!c->table[slot]) {
+            c->table[slot] = key;
+            c->count++;
+        }
+    }
+
+    return c->count;
+}
+
+void magick_colors_free(magick_colors *c)
+{
+    free(c->table);
+    c->table = NULL;
+}
+
+int magick_colors_clear(unsigned char *row, unsigned long columns)
+{
+    unsigned long x;
+    int changed = 0;
+
+    for (x = 0; x < columns; x++) {
+        unsigned char *p = row + x * 4;
+
+        if (!p[3] && (p[0] || p[1] || p[2])) {
+            p[0] = p[1] = p[2] = 0;
+            changed = 1;
+        }
+    }
+
+    return changed;
+}
+
+void magick_content_add(magick_content_stats *stats,
+        const unsigned char *row, unsigned long columns)
+{
+    unsigned long x;
+    int last = -1;
+
+    for (x = 0; x < columns; x++) {
+        const unsigned char *p = row + x * 3;
+        int luma = (p[0] * 77 + p[1] * 150 + p[2] * 29) >> 8;
+
+        if (last >= 0) {
+            int diff = luma > last ? luma - last : last - luma;
+
+            stats->pairs++;
+            if (diff <= MAGICK_AUTO_FLAT) {
+                stats->flat++;
+            }
+            else if (diff > MAGICK_AUTO_EDGE) {
+                stats->edges++;
+            }
+        }
+        last = luma;
+    }
+}
+
+magick_content_e magick_content_choose(const magick_content_stats *stats,
+        int alpha)
+{
+    /* mostly flat, with at least a fifth of the changes sharp edges rather
+     * than gradients */
+    if (stats->pairs && stats->flat * 10 >= stats->pairs * 6
+            && stats->edges * 5 >= stats->pairs - stats->flat) {
+        return MAGICK_CONTENT_GRAPHIC;
+    }
+
+    return alpha ? MAGICK_CONTENT_PHOTO_ALPHA : MAGICK_CONTENT_PHOTO;
+}
+
+int magick_frames_overlay(const unsigned char *prev,
+        const unsigned char *next, unsigned long columns)
+{
+    unsigned long x;
+
+    for (x = 0; x < columns; x++) {
+        unsigned char alpha = next[x * 4 + 3];
+
+        if (alpha != 0xff && (alpha || prev[x * 4 + 3])) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
@@ -0,0 +1,143 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * magick_analyse.h
+ *
+ * Analysis of source images and pixels that needs no GraphicsMagick, used
+ * by mod_magick to choose how an image is encoded.
+ */
+
+#ifndef MAGICK_ANALYSE_H_
+#define MAGICK_ANALYSE_H_
+
+#include <apr.h>
+
+/**
+ * Estimate the quality a JPEG image was saved with, by comparing the
+ * luminance quantization table with the table the IJG encoder scales by
+ * quality.
+ *
+ * @param in The JPEG image
+ * @param len The length of the image
+ * @return The quality from 1 to 100, or zero if the image could not be
+ *  parsed
+ */
+int magick_jpeg_quality(const unsigned char *in, apr_size_t len);
+
+typedef struct magick_colors {
+    apr_uint64_t *table; /* open addressed table of the colors seen */
+    int bits; /* log2 of the size of the table */
+    unsigned long limit; /* stop counting beyond this many colors */
+    unsigned long count; /* colors seen, at most limit + 1 */
+    int alpha; /* has a pixel that is not fully opaque been seen */
+} magick_colors;
+
+/**
+ * Prepare to count the colors of an image, up to a limit.
+ *
+ * @param c The count, freed with magick_colors_free()
+ * @param limit The largest number of colors to count
+ * @return Non zero on success, zero if out of memory
+ */
+int magick_colors_make(magick_colors *c, unsigned long limit);
+
+/**
+ * Count the colors of a row of 8 bit RGBA pixels, including the alpha
+ * channel. Fully transparent pixels count as a single color, whatever
+ * their RGB values.
+ *
+ * @param c The count
+ * @param row The pixels
+ * @param columns The number of pixels
+ * @return The number of colors seen so far, or limit + 1 once there are
+ *  more than the limit, after which further rows need not be counted
+ */
+unsigned long magick_colors_add(magick_colors *c, const unsigned char *row,
+        unsigned long columns);
+
+/**
+ * Free the count made by magick_colors_make().
+ *
+ * @param c The count
+ */
+void magick_colors_free(magick_colors *c);
+
+/**
+ * Set the RGB values of the fully transparent pixels in a row of 8 bit RGBA
+ * pixels to black, so that they are the single color that
+ * magick_colors_add() counted them as.
+ *
+ * @param row The pixels
+ * @param columns The number of pixels
+ * @return Non zero if any pixel was changed
+ */
+int magick_colors_clear(unsigned char *row, unsigned long columns);
+
+typedef enum magick_content_e {
+    MAGICK_CONTENT_PALETTE = 1,
+    MAGICK_CONTENT_GRAPHIC,
+    MAGICK_CONTENT_PHOTO,
+    MAGICK_CONTENT_PHOTO_ALPHA
+} magick_content_e;
+
+typedef struct magick_content_stats {
+    apr_uint64_t pairs; /* neighbouring pixels compared */
+    apr_uint64_t flat; /* pairs that are flat */
+    apr_uint64_t edges; /* pairs that are sharp edges */
+} magick_content_stats;
+
+/**
+ * Add a row of 8 bit RGB pixels to the statistics of the content, counting
+ * the neighbouring pixels whose luma is flat, and those that change by a
+ * sharp edge rather than a gradient. The statistics start zeroed.
+ *
+ * @param stats The statistics
+ * @param row The pixels
+ * @param columns The number of pixels
+ */
+void magick_content_add(magick_content_stats *stats,
+        const unsigned char *row, unsigned long columns);
+
+/**
+ * Choose the content of an image with more colors than fit a palette from
+ * its statistics: graphics are mostly flat with sharp edges, anything else
+ * is a photo.
+ *
+ * @param stats The statistics
+ * @param alpha Does the image have alpha
+ * @return MAGICK_CONTENT_GRAPHIC, MAGICK_CONTENT_PHOTO or
+ *  MAGICK_CONTENT_PHOTO_ALPHA
+ */
+magick_content_e magick_content_choose(const magick_content_stats *stats,
+        int alpha);
+
+/**
+ * Can a row of a frame of an animation be drawn over the same row of the
+ * frame before it, without clearing the canvas in between, and end up as
+ * the frame? Drawing over a pixel can never make it more transparent, so
+ * every pixel must be fully opaque, or fully transparent over a pixel that
+ * was already fully transparent. Both rows are 8 bit RGBA pixels.
+ *
+ * @param prev The row of the frame before
+ * @param next The row of the frame
+ * @param columns The number of pixels
+ * @return Non zero if the row can be drawn over the row before
+ */
+int magick_frames_overlay(const unsigned char *prev,
+        const unsigned char *next, unsigned long columns);
+
+#endif /* MAGICK_ANALYSE_H_ */
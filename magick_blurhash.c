@@ -0,0 +1,178 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The BlurHash and the dominant color of a small image, kept apart from
+ * mod_magick_placeholder.c so that they can be tested without httpd.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "magick_blurhash.h"
+
+static double magick_blurhash_linear(unsigned char value)
+{
+    double v = value / 255.0;
+
+    return v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+}
+
+static int magick_blurhash_srgb(double value)
+{
+    double v = value < 0 ? 0 : value > 1 ? 1 : value;
+
+    return v <= 0.0031308 ? (int)(v * 12.92 * 255 + 0.5)
+            : (int)((1.055 * pow(v, 1 / 2.4) - 0.055) * 255 + 0.5);
+}
+
+static double magick_blurhash_sign_pow(double value, double exp)
+{
+    return value < 0 ? -pow(-value, exp) : pow(value, exp);
+}
+
+static char *magick_blurhash_base83(char *out, long value, int length)
+{
+    static const char digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+            "abcdefghijklmnopqrstuvwxyz#$%*+,-.:;=?@[]^_{|}~";
+    int i;
+
+    for (i = length; i > 0; i--) {
+        out[i - 1] = digits[value % 83];
+        value /= 83;
+    }
+
+    return out + length;
+}
+
+void magick_blurhash(char *hash, const unsigned char *rgb,
+        unsigned long width, unsigned long height, int components_x,
+        int components_y)
+{
+    double factors[MAGICK_BLURHASH_COMPONENTS_MAX
+            * MAGICK_BLURHASH_COMPONENTS_MAX][3];
+    double max = 0, scale;
+    char *h = hash;
+    unsigned long x, y;
+    int i, j, k, quantised;
+
+    for (j = 0; j < components_y; j++) {
+        for (i = 0; i < components_x; i++) {
+            double *f = factors[j * components_x + i];
+
+            f[0] = f[1] = f[2] = 0;
+            for (y = 0; y < height; y++) {
+                double cy = cos(M_PI * j * y / height);
+
+                for (x = 0; x < width; x++) {
+                    const unsigned char *px = rgb + (y * width + x) * 3;
+                    double basis = cos(M_PI * i * x / width) * cy;
+
+                    f[0] += basis * magick_blurhash_linear(px[0]);
+                    f[1] += basis * magick_blurhash_linear(px[1]);
+                    f[2] += basis * magick_blurhash_linear(px[2]);
+                }
+            }
+
+            scale = (i || j ? 2.0 : 1.0) / (width * height);
+            f[0] *= scale;
+            f[1] *= scale;
+            f[2] *= scale;
+
+            if (i || j) {
+                for (k = 0; k < 3; k++) {
+                    if (fabs(f[k]) > max) {
+                        max = fabs(f[k]);
+                    }
+                }
+            }
+        }
+    }
+
+    h = magick_blurhash_base83(h, (components_x - 1)
+            + (components_y - 1) * 9, 1);
+
+    if (components_x * components_y > 1) {
+        quantised = (int)floor(max * 166 - 0.5);
+        quantised = quantised < 0 ? 0 : quantised > 82 ? 82 : quantised;
+        max = (quantised + 1) / 166.0;
+        h = magick_blurhash_base83(h, quantised, 1);
+    }
+    else {
+        max = 1;
+        h = magick_blurhash_base83(h, 0, 1);
+    }
+
+    h = magick_blurhash_base83(h,
+            ((long)magick_blurhash_srgb(factors[0][0]) << 16)
+            | (magick_blurhash_srgb(factors[0][1]) << 8)
+            | magick_blurhash_srgb(factors[0][2]), 4);
+
+    for (k = 1; k < components_x * components_y; k++) {
+        long value = 0;
+        int c;
+
+        for (c = 0; c < 3; c++) {
+            int q = (int)floor(magick_blurhash_sign_pow(
+                    factors[k][c] / max, 0.5) * 9 + 9.5);
+
+            value = value * 19 + (q < 0 ? 0 : q > 18 ? 18 : q);
+        }
+        h = magick_blurhash_base83(h, value, 2);
+    }
+    *h = 0;
+}
+
+int magick_blurhash_color(unsigned char *color, const unsigned char *rgb,
+        unsigned long width, unsigned long height)
+{
+    unsigned long *bins = calloc(4096 * 4, sizeof(unsigned long));
+    unsigned long i, best = 0;
+
+    if (!bins) {
+        return 0;
+    }
+
+    for (i = 0; i < width * height; i++) {
+        const unsigned char *px = rgb + i * 3;
+        unsigned long *bin = bins + (((px[0] >> 4) << 8) | ((px[1] >> 4) << 4)
+                | (px[2] >> 4)) * 4;
+
+        bin[0]++;
+        bin[1] += px[0];
+        bin[2] += px[1];
+        bin[3] += px[2];
+    }
+
+    for (i = 1; i < 4096; i++) {
+        if (bins[i * 4] > bins[best * 4]) {
+            best = i;
+        }
+    }
+
+    if (!bins[best * 4]) {
+        color[0] = color[1] = color[2] = 0;
+    }
+    else {
+        color[0] = (unsigned char)(bins[best * 4 + 1] / bins[best * 4]);
+        color[1] = (unsigned char)(bins[best * 4 + 2] / bins[best * 4]);
+        color[2] = (unsigned char)(bins[best * 4 + 3] / bins[best * 4]);
+    }
+
+    free(bins);
+
+    return 1;
+}
@@ -0,0 +1,69 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * magick_blurhash.h
+ *
+ * The BlurHash and the dominant color of a small image, used by
+ * mod_magick_placeholder.
+ */
+
+#ifndef MAGICK_BLURHASH_H_
+#define MAGICK_BLURHASH_H_
+
+#include <apr.h>
+
+/**
+ * The largest number of components along each axis of a BlurHash.
+ */
+#define MAGICK_BLURHASH_COMPONENTS_MAX 9
+
+/**
+ * The length of a BlurHash with the given components, without the
+ * terminating NUL.
+ */
+#define MAGICK_BLURHASH_LEN(components_x, components_y) \
+        (4 + 2 * (components_x) * (components_y))
+
+/**
+ * Encode the pixels as a BlurHash, the average color followed by the
+ * quantized cosine components of the image in linear light.
+ *
+ * @param hash The BlurHash, MAGICK_BLURHASH_LEN() + 1 bytes long
+ * @param rgb The 8 bit RGB pixels
+ * @param width The width of the image
+ * @param height The height of the image
+ * @param components_x The horizontal components, from 1 to 9
+ * @param components_y The vertical components, from 1 to 9
+ */
+void magick_blurhash(char *hash, const unsigned char *rgb,
+        unsigned long width, unsigned long height, int components_x,
+        int components_y);
+
+/**
+ * Find the dominant color, the average of the most common of the colors
+ * reduced to four bits a channel.
+ *
+ * @param color The red, green and blue of the color
+ * @param rgb The 8 bit RGB pixels
+ * @param width The width of the image
+ * @param height The height of the image
+ * @return Non zero on success, zero if out of memory
+ */
+int magick_blurhash_color(unsigned char *color, const unsigned char *rgb,
+        unsigned long width, unsigned long height);
+
+#endif /* MAGICK_BLURHASH_H_ */
@@ -0,0 +1,659 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Fixed point separable resize of 8 bit interleaved pixels.
+ *
+ * Weights are precomputed once per axis as 14 bit fixed point values, the
+ * image is resized horizontally and then vertically, and the inner loops
+ * are dispatched at runtime to AVX2, SSE4.1 or NEON where available, with
+ * a scalar fallback.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "magick_resample.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MAGICK_RESAMPLE_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define MAGICK_RESAMPLE_NEON
+#include <arm_neon.h>
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+magick_resample_horiz_fn magick_resample_horiz4 = NULL;
+magick_resample_vert_fn magick_resample_vert = NULL;
+
+static double magick_resample_box(double x)
+{
+    return (x > -0.5 && x <= 0.5) ? 1.0 : 0.0;
+}
+
+static double magick_resample_triangle(double x)
+{
+    x = fabs(x);
+    return x < 1.0 ? 1.0 - x : 0.0;
+}
+
+static double magick_resample_hermite(double x)
+{
+    x = fabs(x);
+    return x < 1.0 ? (2.0 * x - 3.0) * x * x + 1.0 : 0.0;
+}
+
+static double magick_resample_bc(double x, double b, double c)
+{
+    x = fabs(x);
+    if (x < 1.0) {
+        return ((12.0 - 9.0 * b - 6.0 * c) * x * x * x
+                + (-18.0 + 12.0 * b + 6.0 * c) * x * x + (6.0 - 2.0 * b)) / 6.0;
+    }
+    if (x < 2.0) {
+        return ((-b - 6.0 * c) * x * x * x + (6.0 * b + 30.0 * c) * x * x
+                + (-12.0 * b - 48.0 * c) * x + (8.0 * b + 24.0 * c)) / 6.0;
+    }
+    return 0.0;
+}
+
+static double magick_resample_cubic(double x)
+{
+    return magick_resample_bc(x, 1.0, 0.0);
+}
+
+static double magick_resample_catrom(double x)
+{
+    return magick_resample_bc(x, 0.0, 0.5);
+}
+
+static double magick_resample_mitchell(double x)
+{
+    return magick_resample_bc(x, 1.0 / 3.0, 1.0 / 3.0);
+}
+
+static double magick_resample_sinc(double x)
+{
+    if (x == 0.0) {
+        return 1.0;
+    }
+    x *= M_PI;
+    return sin(x) / x;
+}
+
+static double magick_resample_lanczos(double x)
+{
+    if (x > -3.0 && x < 3.0) {
+        return magick_resample_sinc(x) * magick_resample_sinc(x / 3.0);
+    }
+    return 0.0;
+}
+
+/*
+ * Return the filter function and support for the filter type, or NULL if
+ * the filter is not supported and GraphicsMagick must do the resize.
+ */
+magick_resample_filter_fn magick_resample_filter(FilterTypes type,
+        double *support)
+{
+    switch (type) {
+    case BoxFilter:
+        *support = 0.5;
+        return magick_resample_box;
+    case TriangleFilter:
+        *support = 1.0;
+        return magick_resample_triangle;
+    case HermiteFilter:
+        *support = 1.0;
+        return magick_resample_hermite;
+    case CubicFilter:
+        *support = 2.0;
+        return magick_resample_cubic;
+    case CatromFilter:
+        *support = 2.0;
+        return magick_resample_catrom;
+    case MitchellFilter:
+        *support = 2.0;
+        return magick_resample_mitchell;
+    case LanczosFilter:
+        *support = 3.0;
+        return magick_resample_lanczos;
+    default:
+        return NULL;
+    }
+}
+
+int magick_resample_coeffs_make(magick_resample_coeffs *c,
+        unsigned long in, unsigned long out, magick_resample_filter_fn filter,
+        double filter_support, double blur)
+{
+    double scale = (double)in / out;
+    double filterscale = (scale < 1.0 ? 1.0 : scale) * blur;
+    double support = filter_support * filterscale;
+    double *w;
+    unsigned long xx;
+    int x;
+
+    c->ksize = (int)ceil(support) * 2 + 1;
+    c->bounds = malloc(out * 2 * sizeof(int));
+    c->weights = calloc(out * c->ksize, sizeof(apr_int16_t));
+    w = malloc(c->ksize * sizeof(double));
+    if (!c->bounds || !c->weights || !w) {
+        free(c->bounds);
+        free(c->weights);
+        free(w);
+        return 0;
+    }
+
+    for (xx = 0; xx < out; xx++) {
+        double center = (xx + 0.5) * scale;
+        double total = 0.0;
+        long xmin = (long)(center - support + 0.5);
+        long xmax = (long)(center + support + 0.5);
+
+        if (xmin < 0) {
+            xmin = 0;
+        }
+        if (xmax > (long)in) {
+            xmax = in;
+        }
+        xmax -= xmin;
+        if (xmax > c->ksize) {
+            xmax = c->ksize;
+        }
+
+        for (x = 0; x < xmax; x++) {
+            w[x] = filter((x + xmin - center + 0.5) / filterscale);
+            total += w[x];
+        }
+        for (x = 0; x < xmax; x++) {
+            double v = total != 0.0 ? w[x] / total : 0.0;
+            c->weights[xx * c->ksize + x] = (apr_int16_t)floor(
+                    v * (1 << MAGICK_RESAMPLE_BITS) + 0.5);
+        }
+
+        c->bounds[xx * 2] = xmin;
+        c->bounds[xx * 2 + 1] = xmax;
+    }
+
+    free(w);
+
+    return 1;
+}
+
+void magick_resample_coeffs_free(magick_resample_coeffs *c)
+{
+    free(c->bounds);
+    free(c->weights);
+}
+
+static APR_INLINE unsigned char magick_resample_clamp(apr_int32_t v)
+{
+    v >>= MAGICK_RESAMPLE_BITS;
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+void magick_resample_horiz_scalar(unsigned char *out,
+        const unsigned char *in, unsigned long columns, int channels,
+        const magick_resample_coeffs *c)
+{
+    unsigned long xx;
+    int ch, k;
+
+    for (xx = 0; xx < columns; xx++) {
+        const apr_int16_t *w = c->weights + xx * c->ksize;
+        const unsigned char *p = in + c->bounds[xx * 2] * channels;
+        int taps = c->bounds[xx * 2 + 1];
+
+        for (ch = 0; ch < channels; ch++) {
+            apr_int32_t acc = 1 << (MAGICK_RESAMPLE_BITS - 1);
+            for (k = 0; k < taps; k++) {
+                acc += p[k * channels + ch] * w[k];
+            }
+            *out++ = magick_resample_clamp(acc);
+        }
+    }
+}
+
+void magick_resample_vert_scalar(unsigned char *out,
+        const unsigned char *const *rows, const apr_int16_t *weights, int taps,
+        apr_size_t x, apr_size_t len)
+{
+    int k;
+
+    for (; x < len; x++) {
+        apr_int32_t acc = 1 << (MAGICK_RESAMPLE_BITS - 1);
+        for (k = 0; k < taps; k++) {
+            acc += rows[k][x] * weights[k];
+        }
+        out[x] = magick_resample_clamp(acc);
+    }
+}
+
+#ifdef MAGICK_RESAMPLE_X86
+__attribute__((target("sse4.1")))
+static void magick_resample_horiz4_sse41(unsigned char *out,
+        const unsigned char *in, unsigned long columns, int channels,
+        const magick_resample_coeffs *c)
+{
+    unsigned long xx;
+    int k;
+
+    /* the kernel is for four channels only */
+    (void)channels;
+
+    for (xx = 0; xx < columns; xx++) {
+        const apr_int16_t *w = c->weights + xx * c->ksize;
+        const unsigned char *p = in + c->bounds[xx * 2] * 4;
+        int taps = c->bounds[xx * 2 + 1];
+        __m128i acc = _mm_set1_epi32(1 << (MAGICK_RESAMPLE_BITS - 1));
+        apr_int32_t pix;
+
+        /* two taps at a time, interleaved as pairs of 16 bit values */
+        for (k = 0; k + 1 < taps; k += 2) {
+            __m128i pix0 = _mm_loadl_epi64((const __m128i *)(p + k * 4));
+            __m128i wk = _mm_set1_epi32((w[k] & 0xffff)
+                    | ((apr_uint32_t)w[k + 1] << 16));
+            __m128i pair = _mm_cvtepu8_epi16(_mm_shuffle_epi8(pix0,
+                    _mm_setr_epi8(0, 4, 1, 5, 2, 6, 3, 7,
+                            -1, -1, -1, -1, -1, -1, -1, -1)));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(pair, wk));
+        }
+        if (k < taps) {
+            memcpy(&pix, p + k * 4, 4);
+            acc = _mm_add_epi32(acc, _mm_mullo_epi32(
+                    _mm_cvtepu8_epi32(_mm_cvtsi32_si128(pix)),
+                    _mm_set1_epi32(w[k])));
+        }
+
+        acc = _mm_srai_epi32(acc, MAGICK_RESAMPLE_BITS);
+        acc = _mm_packus_epi16(_mm_packs_epi32(acc, acc), acc);
+        pix = _mm_cvtsi128_si32(acc);
+        memcpy(out + xx * 4, &pix, 4);
+    }
+}
+
+__attribute__((target("avx2")))
+static void magick_resample_horiz4_avx2(unsigned char *out,
+        const unsigned char *in, unsigned long columns, int channels,
+        const magick_resample_coeffs *c)
+{
+    const __m256i shuffle = _mm256_setr_epi8(0, 4, 1, 5, 2, 6, 3, 7,
+            -1, -1, -1, -1, -1, -1, -1, -1, 8, 12, 9, 13, 10, 14, 11, 15,
+            -1, -1, -1, -1, -1, -1, -1, -1);
+    unsigned long xx;
+    int k;
+
+    /* the kernel is for four channels only */
+    (void)channels;
+
+    for (xx = 0; xx < columns; xx++) {
+        const apr_int16_t *w = c->weights + xx * c->ksize;
+        const unsigned char *p = in + c->bounds[xx * 2] * 4;
+        int taps = c->bounds[xx * 2 + 1];
+        __m256i acc8 = _mm256_setzero_si256();
+        __m128i acc;
+        apr_int32_t pix;
+
+        /* four taps at a time, two pairs per lane */
+        for (k = 0; k + 3 < taps; k += 4) {
+            __m128i pix4 = _mm_loadu_si128((const __m128i *)(p + k * 4));
+            __m256i pairs = _mm256_shuffle_epi8(
+                    _mm256_broadcastsi128_si256(pix4), shuffle);
+            __m256i wk = _mm256_setr_epi32(
+                    (w[k] & 0xffff) | ((apr_uint32_t)w[k + 1] << 16),
+                    (w[k] & 0xffff) | ((apr_uint32_t)w[k + 1] << 16),
+                    (w[k] & 0xffff) | ((apr_uint32_t)w[k + 1] << 16),
+                    (w[k] & 0xffff) | ((apr_uint32_t)w[k + 1] << 16),
+                    (w[k + 2] & 0xffff) | ((apr_uint32_t)w[k + 3] << 16),
+                    (w[k + 2] & 0xffff) | ((apr_uint32_t)w[k + 3] << 16),
+                    (w[k + 2] & 0xffff) | ((apr_uint32_t)w[k + 3] << 16),
+                    (w[k + 2] & 0xffff) | ((apr_uint32_t)w[k + 3] << 16));
+            pairs = _mm256_unpacklo_epi8(pairs, _mm256_setzero_si256());
+            acc8 = _mm256_add_epi32(acc8, _mm256_madd_epi16(pairs, wk));
+        }
+        acc = _mm_add_epi32(_mm256_castsi256_si128(acc8),
+                _mm256_extracti128_si256(acc8, 1));
+        acc = _mm_add_epi32(acc, _mm_set1_epi32(1 << (MAGICK_RESAMPLE_BITS - 1)));
+        for (; k < taps; k++) {
+            memcpy(&pix, p + k * 4, 4);
+            acc = _mm_add_epi32(acc, _mm_mullo_epi32(
+                    _mm_cvtepu8_epi32(_mm_cvtsi32_si128(pix)),
+                    _mm_set1_epi32(w[k])));
+        }
+
+        acc = _mm_srai_epi32(acc, MAGICK_RESAMPLE_BITS);
+        acc = _mm_packus_epi16(_mm_packs_epi32(acc, acc), acc);
+        pix = _mm_cvtsi128_si32(acc);
+        memcpy(out + xx * 4, &pix, 4);
+    }
+}
+
+__attribute__((target("sse4.1")))
+static void magick_resample_vert_sse41(unsigned char *out,
+        const unsigned char *const *rows, const apr_int16_t *weights, int taps,
+        apr_size_t x, apr_size_t len)
+{
+    int k;
+
+    for (; x + 8 <= len; x += 8) {
+        __m128i acc0 = _mm_set1_epi32(1 << (MAGICK_RESAMPLE_BITS - 1));
+        __m128i acc1 = acc0;
+
+        for (k = 0; k < taps; k += 2) {
+            __m128i r0 = _mm_cvtepu8_epi16(
+                    _mm_loadl_epi64((const __m128i *)(rows[k] + x)));
+            __m128i r1 = k + 1 < taps ? _mm_cvtepu8_epi16(
+                    _mm_loadl_epi64((const __m128i *)(rows[k + 1] + x)))
+                    : _mm_setzero_si128();
+            __m128i wk = _mm_set1_epi32((weights[k] & 0xffff)
+                    | ((apr_uint32_t)(k + 1 < taps ? weights[k + 1] : 0) << 16));
+            acc0 = _mm_add_epi32(acc0,
+                    _mm_madd_epi16(_mm_unpacklo_epi16(r0, r1), wk));
+            acc1 = _mm_add_epi32(acc1,
+                    _mm_madd_epi16(_mm_unpackhi_epi16(r0, r1), wk));
+        }
+
+        acc0 = _mm_srai_epi32(acc0, MAGICK_RESAMPLE_BITS);
+        acc1 = _mm_srai_epi32(acc1, MAGICK_RESAMPLE_BITS);
+        acc0 = _mm_packs_epi32(acc0, acc1);
+        _mm_storel_epi64((__m128i *)(out + x), _mm_packus_epi16(acc0, acc0));
+    }
+
+    magick_resample_vert_scalar(out, rows, weights, taps, x, len);
+}
+
+__attribute__((target("avx2")))
+static void magick_resample_vert_avx2(unsigned char *out,
+        const unsigned char *const *rows, const apr_int16_t *weights, int taps,
+        apr_size_t x, apr_size_t len)
+{
+    int k;
+
+    for (; x + 16 <= len; x += 16) {
+        __m256i acc0 = _mm256_set1_epi32(1 << (MAGICK_RESAMPLE_BITS - 1));
+        __m256i acc1 = acc0;
+
+        for (k = 0; k < taps; k += 2) {
+            __m256i r0 = _mm256_cvtepu8_epi16(
+                    _mm_loadu_si128((const __m128i *)(rows[k] + x)));
+            __m256i r1 = k + 1 < taps ? _mm256_cvtepu8_epi16(
+                    _mm_loadu_si128((const __m128i *)(rows[k + 1] + x)))
+                    : _mm256_setzero_si256();
+            __m256i wk = _mm256_set1_epi32((weights[k] & 0xffff)
+                    | ((apr_uint32_t)(k + 1 < taps ? weights[k + 1] : 0) << 16));
+            acc0 = _mm256_add_epi32(acc0,
+                    _mm256_madd_epi16(_mm256_unpacklo_epi16(r0, r1), wk));
+            acc1 = _mm256_add_epi32(acc1,
+                    _mm256_madd_epi16(_mm256_unpackhi_epi16(r0, r1), wk));
+        }
+
+        acc0 = _mm256_srai_epi32(acc0, MAGICK_RESAMPLE_BITS);
+        acc1 = _mm256_srai_epi32(acc1, MAGICK_RESAMPLE_BITS);
+        acc0 = _mm256_packs_epi32(acc0, acc1);
+        acc0 = _mm256_permute4x64_epi64(_mm256_packus_epi16(acc0, acc0), 0xd8);
+        _mm_storeu_si128((__m128i *)(out + x), _mm256_castsi256_si128(acc0));
+    }
+
+    magick_resample_vert_sse41(out, rows, weights, taps, x, len);
+}
+#endif
+
+#ifdef MAGICK_RESAMPLE_NEON
+static void magick_resample_horiz4_neon(unsigned char *out,
+        const unsigned char *in, unsigned long columns, int channels,
+        const magick_resample_coeffs *c)
+{
+    unsigned long xx;
+    int k;
+
+    /* the kernel is for four channels only */
+    (void)channels;
+
+    for (xx = 0; xx < columns; xx++) {
+        const apr_int16_t *w = c->weights + xx * c->ksize;
+        const unsigned char *p = in + c->bounds[xx * 2] * 4;
+        int taps = c->bounds[xx * 2 + 1];
+        int32x4_t acc = vdupq_n_s32(1 << (MAGICK_RESAMPLE_BITS - 1));
+        apr_uint32_t pix;
+        int16x4_t s;
+
+        for (k = 0; k < taps; k++) {
+            memcpy(&pix, p + k * 4, 4);
+            s = vget_low_s16(vreinterpretq_s16_u16(
+                    vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(pix)))));
+            acc = vmlal_n_s16(acc, s, w[k]);
+        }
+
+        s = vqmovn_s32(vshrq_n_s32(acc, MAGICK_RESAMPLE_BITS));
+        pix = vget_lane_u32(vreinterpret_u32_u8(
+                vqmovun_s16(vcombine_s16(s, s))), 0);
+        memcpy(out + xx * 4, &pix, 4);
+    }
+}
+
+static void magick_resample_vert_neon(unsigned char *out,
+        const unsigned char *const *rows, const apr_int16_t *weights, int taps,
+        apr_size_t x, apr_size_t len)
+{
+    int k;
+
+    for (; x + 8 <= len; x += 8) {
+        int32x4_t acc0 = vdupq_n_s32(1 << (MAGICK_RESAMPLE_BITS - 1));
+        int32x4_t acc1 = acc0;
+
+        for (k = 0; k < taps; k++) {
+            int16x8_t r = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(rows[k] + x)));
+            acc0 = vmlal_n_s16(acc0, vget_low_s16(r), weights[k]);
+            acc1 = vmlal_n_s16(acc1, vget_high_s16(r), weights[k]);
+        }
+
+        vst1_u8(out + x, vqmovun_s16(vcombine_s16(
+                vqmovn_s32(vshrq_n_s32(acc0, MAGICK_RESAMPLE_BITS)),
+                vqmovn_s32(vshrq_n_s32(acc1, MAGICK_RESAMPLE_BITS)))));
+    }
+
+    magick_resample_vert_scalar(out, rows, weights, taps, x, len);
+}
+#endif
+
+/*
+ * Choose the fastest kernels supported by this CPU.
+ */
+void magick_resample_init(void)
+{
+    magick_resample_horiz4 = magick_resample_horiz_scalar;
+    magick_resample_vert = magick_resample_vert_scalar;
+
+#ifdef MAGICK_RESAMPLE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        magick_resample_horiz4 = magick_resample_horiz4_avx2;
+        magick_resample_vert = magick_resample_vert_avx2;
+    }
+    else if (__builtin_cpu_supports("sse4.1")) {
+        magick_resample_horiz4 = magick_resample_horiz4_sse41;
+        magick_resample_vert = magick_resample_vert_sse41;
+    }
+#endif
+#ifdef MAGICK_RESAMPLE_NEON
+    magick_resample_horiz4 = magick_resample_horiz4_neon;
+    magick_resample_vert = magick_resample_vert_neon;
+#endif
+}
+
+/*
+ * Resize the 8 bit interleaved pixels in to out, with the given number of
+ * channels.
+ */
+int magick_resample(const unsigned char *in, unsigned long in_columns,
+        unsigned long in_rows, unsigned char *out, unsigned long columns,
+        unsigned long rows, int channels, FilterTypes filter_type,
+        double blur)
+{
+    magick_resample_coeffs horiz, vert;
+    magick_resample_filter_fn filter;
+    const unsigned char **taps;
+    unsigned char *tmp;
+    double support;
+    unsigned long y;
+    int k;
+
+    filter = magick_resample_filter(filter_type, &support);
+    if (!filter) {
+        return 0;
+    }
+
+    if (!magick_resample_coeffs_make(&horiz, in_columns, columns, filter,
+            support, blur)) {
+        return 0;
+    }
+    if (!magick_resample_coeffs_make(&vert, in_rows, rows, filter,
+            support, blur)) {
+        magick_resample_coeffs_free(&horiz);
+        return 0;
+    }
+
+    tmp = malloc((apr_size_t)columns * in_rows * channels);
+    taps = malloc(vert.ksize * sizeof(unsigned char *));
+    if (!tmp || !taps) {
+        free(tmp);
+        free(taps);
+        magick_resample_coeffs_free(&horiz);
+        magick_resample_coeffs_free(&vert);
+        return 0;
+    }
+
+    /* horizontal pass */
+    for (y = 0; y < in_rows; y++) {
+        if (channels == 4) {
+            magick_resample_horiz4(tmp + y * columns * 4,
+                    in + y * in_columns * 4, columns, 4, &horiz);
+        }
+        else {
+            magick_resample_horiz_scalar(tmp + y * columns * channels,
+                    in + y * in_columns * channels, columns, channels, &horiz);
+        }
+    }
+
+    /* vertical pass */
+    for (y = 0; y < rows; y++) {
+        int ymin = vert.bounds[y * 2];
+        int n = vert.bounds[y * 2 + 1];
+
+        for (k = 0; k < n; k++) {
+            taps[k] = tmp + (ymin + k) * columns * channels;
+        }
+        magick_resample_vert(out + y * columns * channels, taps,
+                vert.weights + y * vert.ksize, n, 0, columns * channels);
+    }
+
+    free(tmp);
+    free(taps);
+    magick_resample_coeffs_free(&horiz);
+    magick_resample_coeffs_free(&vert);
+
+    return 1;
+}
+
+int magick_resample_stream_make(magick_resample_stream *s,
+        unsigned long in_columns, unsigned long in_rows, unsigned char *out,
+        unsigned long columns, unsigned long rows, FilterTypes filter_type,
+        double blur)
+{
+    magick_resample_filter_fn filter;
+    double support;
+
+    memset(s, 0, sizeof(*s));
+
+    filter = magick_resample_filter(filter_type, &support);
+    if (!filter) {
+        return 0;
+    }
+
+    s->out = out;
+    s->columns = columns;
+    s->rows = rows;
+
+    if (!magick_resample_coeffs_make(&s->horiz, in_columns, columns, filter,
+            support, blur)) {
+        return 0;
+    }
+    if (!magick_resample_coeffs_make(&s->vert, in_rows, rows, filter,
+            support, blur)) {
+        magick_resample_coeffs_free(&s->horiz);
+        return 0;
+    }
+
+    s->taps = malloc(s->vert.ksize * sizeof(unsigned char *));
+    s->window = malloc((apr_size_t)s->vert.ksize * columns * 4);
+    if (!s->taps || !s->window) {
+        free(s->taps);
+        free(s->window);
+        magick_resample_coeffs_free(&s->horiz);
+        magick_resample_coeffs_free(&s->vert);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * The row is filtered horizontally into the window, and every output row
+ * now covered by the window is filtered vertically into the output.
+ */
+void magick_resample_stream_row(magick_resample_stream *s,
+        const unsigned char *row)
+{
+    apr_size_t stride = (apr_size_t)s->columns * 4;
+
+    magick_resample_horiz4(s->window + (s->y % s->vert.ksize) * stride, row,
+            s->columns, 4, &s->horiz);
+
+    while (s->out_y < s->rows) {
+        int ymin = s->vert.bounds[s->out_y * 2];
+        int n = s->vert.bounds[s->out_y * 2 + 1];
+        int k;
+
+        if ((unsigned long)(ymin + n) > s->y + 1) {
+            break;
+        }
+
+        for (k = 0; k < n; k++) {
+            s->taps[k] = s->window + ((ymin + k) % s->vert.ksize) * stride;
+        }
+
+        magick_resample_vert(s->out + s->out_y * stride, s->taps,
+                s->vert.weights + s->out_y * s->vert.ksize, n, 0, stride);
+
+        s->out_y++;
+    }
+
+    s->y++;
+}
+
+void magick_resample_stream_free(magick_resample_stream *s)
+{
+    magick_resample_coeffs_free(&s->horiz);
+    magick_resample_coeffs_free(&s->vert);
+    free(s->taps);
+    free(s->window);
+}
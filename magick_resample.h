@@ -0,0 +1,185 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * magick_resample.h
+ *
+ * Fixed point separable resize of 8 bit interleaved pixels, used by the
+ * fast resize engine of mod_magick.
+ */
+
+#ifndef MAGICK_RESAMPLE_H_
+#define MAGICK_RESAMPLE_H_
+
+#include <apr.h>
+#include <magick/api.h>
+
+/**
+ * The number of fractional bits of the fixed point weights.
+ */
+#define MAGICK_RESAMPLE_BITS 14
+
+typedef double (*magick_resample_filter_fn)(double x);
+
+typedef struct magick_resample_coeffs {
+    int ksize; /* maximum taps per output sample */
+    int *bounds; /* first source sample and number of taps per output */
+    apr_int16_t *weights; /* ksize weights per output */
+} magick_resample_coeffs;
+
+typedef void (*magick_resample_horiz_fn)(unsigned char *out,
+        const unsigned char *in, unsigned long columns, int channels,
+        const magick_resample_coeffs *c);
+
+typedef void (*magick_resample_vert_fn)(unsigned char *out,
+        const unsigned char *const *rows, const apr_int16_t *weights, int taps,
+        apr_size_t x, apr_size_t len);
+
+/**
+ * The horizontal kernel for four channels, chosen by magick_resample_init().
+ */
+extern magick_resample_horiz_fn magick_resample_horiz4;
+
+/**
+ * The vertical kernel, chosen by magick_resample_init().
+ */
+extern magick_resample_vert_fn magick_resample_vert;
+
+/**
+ * Return the filter function and support for the filter type.
+ *
+ * @param type The GraphicsMagick filter type
+ * @param support The support of the filter, in source samples
+ * @return The filter function, or NULL if the filter is not supported
+ */
+magick_resample_filter_fn magick_resample_filter(FilterTypes type,
+        double *support);
+
+/**
+ * Calculate the fixed point weights for resizing one axis.
+ *
+ * @param c The coefficients, freed with magick_resample_coeffs_free()
+ * @param in The number of source samples
+ * @param out The number of output samples
+ * @param filter The filter function
+ * @param filter_support The support of the filter
+ * @param blur The blur factor, where 1.0 is no blur
+ * @return Non zero on success, zero if out of memory
+ */
+int magick_resample_coeffs_make(magick_resample_coeffs *c,
+        unsigned long in, unsigned long out, magick_resample_filter_fn filter,
+        double filter_support, double blur);
+
+/**
+ * Free the coefficients made by magick_resample_coeffs_make().
+ *
+ * @param c The coefficients
+ */
+void magick_resample_coeffs_free(magick_resample_coeffs *c);
+
+/**
+ * The portable horizontal kernel, for any number of channels.
+ */
+void magick_resample_horiz_scalar(unsigned char *out,
+        const unsigned char *in, unsigned long columns, int channels,
+        const magick_resample_coeffs *c);
+
+/**
+ * The portable vertical kernel.
+ */
+void magick_resample_vert_scalar(unsigned char *out,
+        const unsigned char *const *rows, const apr_int16_t *weights, int taps,
+        apr_size_t x, apr_size_t len);
+
+/**
+ * Choose the fastest kernels supported by this CPU. Must be called before
+ * any pixels are resized.
+ */
+void magick_resample_init(void);
+
+/**
+ * Resize the 8 bit interleaved pixels in to out.
+ *
+ * @param in The source pixels
+ * @param in_columns The width of the source
+ * @param in_rows The height of the source
+ * @param out The output pixels, columns by rows
+ * @param columns The width of the output
+ * @param rows The height of the output
+ * @param channels The number of channels of each pixel
+ * @param filter_type The GraphicsMagick filter type
+ * @param blur The blur factor, where 1.0 is no blur
+ * @return Non zero on success, zero if the filter is not supported or out
+ *  of memory
+ */
+int magick_resample(const unsigned char *in, unsigned long in_columns,
+        unsigned long in_rows, unsigned char *out, unsigned long columns,
+        unsigned long rows, int channels, FilterTypes filter_type,
+        double blur);
+
+typedef struct magick_resample_stream {
+    magick_resample_coeffs horiz; /* horizontal coefficients */
+    magick_resample_coeffs vert; /* vertical coefficients */
+    const unsigned char **taps; /* rows for the vertical filter */
+    unsigned char *window; /* horizontally filtered rows, ksize tall */
+    unsigned char *out; /* the output image, as RGBA */
+    unsigned long columns; /* width of the output */
+    unsigned long rows; /* height of the output */
+    unsigned long y; /* next source row */
+    unsigned long out_y; /* next output row */
+} magick_resample_stream;
+
+/**
+ * Prepare to resize 8 bit RGBA pixels one source row at a time, holding
+ * only a window of rows as tall as the vertical filter. The result is the
+ * same as that of magick_resample().
+ *
+ * @param s The stream, freed with magick_resample_stream_free()
+ * @param in_columns The width of the source
+ * @param in_rows The height of the source
+ * @param out The output pixels, columns by rows
+ * @param columns The width of the output
+ * @param rows The height of the output
+ * @param filter_type The GraphicsMagick filter type
+ * @param blur The blur factor, where 1.0 is no blur
+ * @return Non zero on success, zero if the filter is not supported or out
+ *  of memory
+ */
+int magick_resample_stream_make(magick_resample_stream *s,
+        unsigned long in_columns, unsigned long in_rows, unsigned char *out,
+        unsigned long columns, unsigned long rows, FilterTypes filter_type,
+        double blur);
+
+/**
+ * Resize the next row of the source, writing every output row that the
+ * rows seen so far complete. The output is complete once out_y reaches
+ * rows.
+ *
+ * @param s The stream
+ * @param row The source row, in_columns 8 bit RGBA pixels
+ */
+void magick_resample_stream_row(magick_resample_stream *s,
+        const unsigned char *row);
+
+/**
+ * Free the stream made by magick_resample_stream_make(). The output
+ * belongs to the caller.
+ *
+ * @param s The stream
+ */
+void magick_resample_stream_free(magick_resample_stream *s);
+
+#endif /* MAGICK_RESAMPLE_H_ */
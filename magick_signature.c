@@ -0,0 +1,83 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The data covered by default by the signature, kept apart from
+ * mod_magick.c so that it can be tested without httpd.
+ */
+
+#include <string.h>
+
+#include "magick_signature.h"
+
+/*
+ * Is the query parameter of the given length named name?
+ */
+static int magick_signature_named(const char *pair, apr_size_t len,
+        const char *name)
+{
+    const char *eq = memchr(pair, '=', len);
+    apr_size_t nlen = eq ? (apr_size_t)(eq - pair) : len;
+
+    return name && nlen == strlen(name) && !memcmp(pair, name, nlen);
+}
+
+int magick_signature_data(char *data, const char *uri, const char *name,
+        const char *expires_name)
+{
+    const char *query = strchr(uri, '?');
+    const char *pair;
+    char sep = '?';
+    int seen = 0, expires_seen = 0;
+
+    if (!query) {
+        strcpy(data, uri);
+        return 1;
+    }
+
+    memcpy(data, uri, query - uri);
+    data += query - uri;
+
+    for (pair = query + 1; *pair; ) {
+        const char *end = strchr(pair, '&');
+        apr_size_t len = end ? (apr_size_t)(end - pair) : strlen(pair);
+
+        if (magick_signature_named(pair, len, name)) {
+            if (seen++) {
+                return 0;
+            }
+        }
+        else if (magick_signature_named(pair, len, expires_name)) {
+            if (expires_seen++) {
+                return 0;
+            }
+        }
+        else if (len) {
+            *data++ = sep;
+            memcpy(data, pair, len);
+            data += len;
+            sep = '&';
+        }
+
+        pair += len;
+        if (*pair) {
+            pair++;
+        }
+    }
+    *data = 0;
+
+    return 1;
+}
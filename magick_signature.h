@@ -0,0 +1,45 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * magick_signature.h
+ *
+ * The data covered by default by the signature verified by mod_magick.
+ */
+
+#ifndef MAGICK_SIGNATURE_H_
+#define MAGICK_SIGNATURE_H_
+
+#include <apr.h>
+
+/**
+ * Copy the URI as sent by the client to data, leaving out the query
+ * parameters named as the signature and the expiry time. Each of the two
+ * parameters may appear at most once, so that no two URLs share one
+ * signature.
+ *
+ * @param data The data, as long as the URI including the terminating NUL
+ * @param uri The URI including the query string
+ * @param name The name of the signature parameter
+ * @param expires_name The name of the expiry parameter, or NULL if the
+ *  signature does not expire
+ * @return Non zero on success, zero if either parameter appears more than
+ *  once
+ */
+int magick_signature_data(char *data, const char *uri, const char *name,
+        const char *expires_name);
+
+#endif /* MAGICK_SIGNATURE_H_ */
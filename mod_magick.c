@@ -35,43 +35,429 @@
  * The MAGICK module converts a response into a magick bucket, which can be
  * transformed by specific downstream magick filters to modify the image.
  * The first filter that attempts to read the bucket will cause the output
- * image to be rendered.
+ * image to be rendered. If none of the magick filters changed the pixels or
+ * the encoding settings of the image, the original image is passed through
+ * untouched without being rendered.
+ *
+ * The source image is only pinged for its size and format when the bucket is
+ * created. Downstream magick filters add operations to the bucket rather than
+ * applying them directly, and the operations are optimised before the image
+ * is decoded: metadata is stripped first, conversions to gray are done before
+ * resizing, consecutive resizes are merged into one, and operations that
+ * change nothing are dropped. When a JPEG image is resized, the decoder is
+ * asked to scale the image down while decoding.
+ *
+ * Modules built against mod_magick.h can check AP_MAGICK_API_VERSION.
+ * Version 2 added the request to ap_bucket_magick_make() and
+ * ap_bucket_magick_create(), and defers decoding, so that the wand of a
+ * magick bucket holds no image until the bucket is first read. Filters add
+ * operations to the bucket with ap_bucket_magick_op_add() instead of
+ * changing the wand.
  *
  * The AddMagickOption allows the setting of options that affect the
  * operation of GraphicsMagick. The options accepted are those as documented
  * under the -define option in the gm tool.
  *
+ * Expressions in the magick directives that contain no variables, functions,
+ * backreferences or escapes, that is no '%', '$' or '\' characters, are
+ * parsed once when the configuration is loaded, and invalid constant values
+ * such as unknown filter types are rejected at startup. Only expressions
+ * that depend on the request are evaluated on each request.
+ *
  * The MagickMaxSize option sets the largest size the source image is allowed to
  * be. Beyond this size requests will be rejected to prevent the processing of
  * huge images.
+ *
+ * The Content-Length of the source image is removed when the bucket is
+ * created, and the Content-Length of the rendered image is set once it has
+ * been encoded, if the headers have not been sent yet.
+ *
+ * The MagickSpillThreshold option sets the size in bytes above which the
+ * rendered image is written to an unlinked temporary file, and sent from the
+ * file instead of from memory. The memory is returned as soon as the image is
+ * encoded, the image can be sent with sendfile, and the image can be set aside
+ * by mod_cache and HTTP/2 without holding on to the memory. The default is
+ * zero, which keeps the image in memory. The threshold applies to the whole
+ * encoded image.
+ *
+ * The MagickStreamThreshold option sets the number of source pixels above
+ * which an image is resized while it is decoded. Rows are taken from the
+ * decoder one at a time, filtered horizontally into a window as tall as the
+ * vertical filter, and the output rows are produced as soon as the window
+ * covers them. The memory used depends on the size of the output instead of
+ * the source. Streaming needs the first change to be a resize with a filter
+ * supported by the fast engine, and the metadata cannot follow the pixels,
+ * so the image must be stripped by MAGICK_STRIP without MagickStripKeepICC.
+ * Only PNG images that are not interlaced and PPM and PGM images are
+ * streamed, as the rows must arrive once from top to bottom. JPEG images
+ * are scaled down by the decoder instead, and anything else is decoded in
+ * full. The default is zero, which disables streaming.
+ *
+ *   MagickStreamThreshold 16000000
+ *
+ * The MagickEngine option selects the engine used to render the image. When
+ * 'vips', the image is decoded, resized, converted and encoded by libvips,
+ * which processes the image on demand in small regions instead of holding
+ * every pixel in memory. The directives of the filters keep their meaning.
+ * Anything libvips cannot express falls back to GraphicsMagick, including
+ * animations, filters other than point, triangle, cubic, catrom, mitchell
+ * and lanczos, a resize blur, MagickOption, MagickStripKeepICC, and formats
+ * other than JPEG, PNG, WEBP, TIFF and GIF. The libvips engine is only
+ * available when mod_magick is built with --with-vips, and libvips is only
+ * initialised in the child processes when some directory selects it. The
+ * script bench/bench_engines.sh compares both engines on the same images.
+ * The default is 'graphicsmagick'.
+ *
+ *   MagickEngine vips
+ *
+ * The MagickEncoderEffort option sets how hard the encoder of a format works
+ * to make the image smaller, one of 'fast', 'default' or 'best'. For PNG the
+ * effort sets the zlib level and row filter, replacing any MagickQuality, for
+ * WEBP the compression method, and for JPEG whether the Huffman tables are
+ * optimised. An optional second effort is used instead while the one minute
+ * load average of the server is above MagickEncoderLoad, trading bytes for
+ * CPU when the server is busy. The load is read once per request. The
+ * default MagickEncoderLoad is zero, which never uses the second effort.
+ *
+ *   MagickEncoderEffort PNG best fast
+ *   MagickEncoderEffort WEBP best default
+ *   MagickEncoderEffort JPEG best
+ *   MagickEncoderLoad 8
+ *
+ * The MagickPalette option enables the writing of PNG images with 256 colors
+ * or fewer as 8 bit palette images, with the alpha channel kept in the
+ * palette, instead of as truecolor. The colors are counted after the image
+ * has been resized, stopping as soon as there are too many. The
+ * MagickPaletteLossyColors option sets the number of colors up to which an
+ * image with more than 256 colors is quantized to 256 colors without
+ * dithering, losing some colors, up to a maximum of 65536. The default is
+ * zero, which never quantizes an image that does not fit. Animations, and
+ * images whose format is negotiated, are left as they are. A PNG image that
+ * no other option changes is still decoded and written again so that the
+ * palette can be applied, instead of being passed through untouched.
+ *
+ *   MagickPalette on
+ *   MagickPaletteLossyColors 1024
+ *
+ * When the MagickFormat of mod_magick_format is 'auto', the format is chosen
+ * from the content of the image after it has been resized. Images with 256
+ * colors or fewer are written as palette PNG, graphics with large flat areas
+ * and sharp edges as PNG or lossless WEBP, photographs as JPEG or WEBP, and
+ * photographs with an alpha channel as PNG or WEBP, WEBP being chosen when
+ * the client accepts it. When MagickFailureCache is configured the content of
+ * each source image is remembered for a day, so that the image is only
+ * examined once for all of its variants.
+ *
+ * If the only changes are to strip metadata and set the interlace scheme of
+ * a JPEG image, the image is transcoded losslessly from the original DCT
+ * coefficients with optimised Huffman tables, in the style of jpegtran,
+ * without decoding the pixels.
+ *
+ * The MagickSignatureSecret option enables the verification of an HMAC-SHA1
+ * signature over the transform parameters before the image is buffered, so
+ * that only URLs generated by our own pages cause images to be rendered.
+ *
+ * <Location /images>
+ *   <If "%{QUERY_STRING} =~ /^w=(\d+)&e=(\d+)&s=([0-9a-f]+)$/">
+ *     SetOutputFilter MAGICK;MAGICK_RESIZE
+ *     MagickSignatureSecret 0123456789abcdef
+ *     MagickSignatureData "%{REQUEST_URI}?w=$1"
+ *     MagickSignatureExpires $2
+ *     MagickSignature $3
+ *     MagickResizeColumns $1
+ *   </If>
+ * </Location>
+ *
+ * The MagickSignature option is an expression returning the hex encoded
+ * signature supplied by the client. The MagickSignatureData option is an
+ * expression returning the data that was signed. It defaults to the request
+ * URI and query string as sent by the client, with the query parameters
+ * named by MagickSignatureParams removed, so that every other parameter in
+ * the query string is covered. The names default to 's' for the signature
+ * and 'e' for the expiry time, and a URL that repeats either of them is
+ * invalid. If MagickSignatureExpires is set, the expression is the expiry
+ * time in seconds since the epoch, and the signed data is the data followed
+ * by a colon and the expiry time.
+ *
+ *   MagickSignatureParams sig expires
+ *
+ * The MagickSignatureFailure option controls what happens when the signature
+ * is missing, invalid or expired. When 'reject' (the default) the request is
+ * rejected with 403 Forbidden, when 'original' the original image is passed
+ * through untouched. In both cases the MAGICK_SIGNATURE environment variable
+ * is set to one of valid|missing|invalid|expired.
+ *
+ * The MagickFailureCache option enables a shared object cache in which source
+ * images that could not be read, or that exceeded MagickMaxSize, are
+ * remembered. The source is identified by the host, URI and the ETag and
+ * Last-Modified validators of the response, together with the MagickMaxSize
+ * in effect. Repeat requests for the same
+ * source are then handled immediately without buffering or decoding.
+ *
+ *   MagickFailureCache shmcb
+ *   <Location />
+ *     MagickFailureCacheTimeout 600
+ *     MagickFailureCacheFallback original
+ *   </Location>
+ *
+ * The MagickFailureCacheTimeout option sets the number of seconds a failure
+ * is remembered, defaulting to 300. The MagickFailureCacheFallback option
+ * controls the response to a cached failure, either 'error' (the default) to
+ * return the cached error, or 'original' to pass the original image through
+ * untouched.
+ *
+ * When MagickFailureCache is configured, the quality chosen to meet the
+ * MagickTargetBytes of mod_magick_quality is remembered in the same cache for
+ * a day, keyed by the source image and the size, format and target of the
+ * variant, so that later renders of the variant encode only once.
+ *
+ * The MagickWandPoolSize option sets the number of idle magick wands kept by
+ * each thread for reuse by later images, avoiding the setup of a new wand for
+ * every image. Wands are cleared before being returned to the pool. The
+ * default is 4, and 0 disables the pool. The size, hit rate and number of
+ * idle wands of each child are shown by mod_status.
+ *
+ *   MagickWandPoolSize 8
+ *
+ * Animations are coalesced so that each frame stands alone, the frames are
+ * resized, converted and for GIF quantized in parallel, and the frames are
+ * optimised again by keeping only the area that changed since the previous
+ * frame. Transparent animations in which a pixel turns transparent keep
+ * their whole frames, each drawn over a cleared canvas. The
+ * MagickFrameThreads option sets the number of threads in each child shared
+ * by all requests for processing frames. The default is 4, and 0 processes
+ * the frames one after the other.
+ *
+ *   MagickFrameThreads 8
+ *
+ * GraphicsMagick is initialised when the server starts. The
+ * MagickPreloadFormats option loads the coders of the listed formats before
+ * the children are created, so that the children share the pages and the
+ * first image handled by each child does not pay for loading the coders.
+ *
+ *   MagickPreloadFormats JPEG PNG WEBP GIF
+ *
+ * The MagickAllocator option selects the allocator used by GraphicsMagick.
+ * When 'arena', small blocks are rounded up to a size class and kept on a
+ * bounded per-thread free list for reuse by the next image, and large blocks
+ * such as pixel caches are mapped directly. A few freed mappings of up to
+ * 32MB in total are kept per thread for the next image, and the rest are
+ * returned to the system as soon as they are freed, so that the memory of
+ * long lived children stays flat.
+ * The default is 'system'. The allocator can only be enabled by a full
+ * restart, and its counters are shown by mod_status.
+ *
+ *   MagickAllocator arena
  */
 
 #include <apr.h>
+#include <apr_atomic.h>
+#include <apr_file_io.h>
+#include <apr_global_mutex.h>
 #include <apr_hash.h>
+#include <apr_lib.h>
+#include <apr_sha1.h>
 #include <apr_strings.h>
+#include <apr_thread_cond.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_pool.h>
+#include <apr_thread_proc.h>
 
 #include "httpd.h"
 #include "http_config.h"
 #include "http_log.h"
+#include "http_protocol.h"
 #include "util_filter.h"
+#include "util_mutex.h"
 #include "ap_expr.h"
+#include "ap_provider.h"
+#include "ap_socache.h"
+#include "mod_status.h"
 
 #include "mod_magick.h"
+#include "magick_analyse.h"
+#include "magick_resample.h"
+#include "magick_signature.h"
+
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+#include <math.h>
+
+#ifdef HAVE_LIBJPEG
+#include <setjmp.h>
+#include <jpeglib.h>
+#endif
+
+#ifdef HAVE_VIPS
+#include <vips/vips.h>
+#endif
 
 module AP_MODULE_DECLARE_DATA magick_module;
 
 #define DEFAULT_MAX_SIZE 10*1024*1024
 
+#define DEFAULT_FAILURE_TIMEOUT 300
+
+#define HMAC_BLOCK_SIZE 64
+
+#define DEFAULT_SIGNATURE_PARAM "s"
+#define DEFAULT_SIGNATURE_EXPIRES_PARAM "e"
+
+#define DEFAULT_WAND_POOL_SIZE 4
+
+#define DEFAULT_FRAME_THREADS 4
+
+#define MAGICK_PRESCALE_FACTOR 2
+
+#define MAGICK_DEFAULT_QUALITY 75
+
+#define MAGICK_PALETTE_COLORS 256
+#define MAGICK_PALETTE_LOSSY_MAX 65536
+
+#define MAGICK_TARGET_QUALITY_MIN 10
+#define MAGICK_TARGET_QUALITY_MAX 90
+#define MAGICK_TARGET_TRIALS 6
+
+#define MAGICK_CACHE_TIMEOUT apr_time_from_sec(86400)
+#define MAGICK_CACHE_VALUE_MAX 4096
+
+#define MAGICK_AUTO_ROWS 256
+
+#define MAGICK_ALLOC_HEADER 16
+#define MAGICK_ALLOC_MIN_SHIFT 5
+#define MAGICK_ALLOC_CLASSES 12
+#define MAGICK_ALLOC_CACHE_BYTES (256 * 1024)
+#define MAGICK_ALLOC_MAPPED 4
+#define MAGICK_ALLOC_MAPPED_BYTES (32 * 1024 * 1024)
+
+static const char * const magick_failure_id = "magick-failure-cache";
+
+static ap_socache_provider_t *failure_provider = NULL;
+static ap_socache_instance_t *failure_instance = NULL;
+static apr_global_mutex_t *failure_mutex = NULL;
+static int failure_configured = 0;
+
+static int wand_pool_size = DEFAULT_WAND_POOL_SIZE;
+
+static int frame_threads = DEFAULT_FRAME_THREADS;
+#if APR_HAS_THREADS
+static apr_thread_pool_t *frame_pool = NULL;
+#endif
+#ifdef HAVE_VIPS
+static int vips_configured = 0;
+static int vips_available = 0;
+#endif
+
+#if APR_HAS_THREADS
+static apr_threadkey_t *stream_key = NULL;
+#else
+static void *stream_current = NULL;
+#endif
+
+#if APR_HAS_THREADS
+static apr_threadkey_t *wand_pool_key = NULL;
+#else
+static struct magick_wand_pool *wand_pool = NULL;
+#endif
+
+static const char * const magick_init_key = "mod_magick-init";
+static const char * const magick_alloc_key = "mod_magick-alloc";
+static apr_array_header_t *preload_formats = NULL;
+
+static int alloc_arena = 0;
+static int alloc_installed = 0;
+#if APR_HAS_THREADS
+static apr_threadkey_t *alloc_cache_key = NULL;
+#endif
+
+static volatile apr_uint32_t alloc_cache_hits = 0;
+static volatile apr_uint32_t alloc_cache_misses = 0;
+static volatile apr_uint32_t alloc_cache_bytes = 0;
+static volatile apr_uint32_t alloc_mapped = 0;
+static volatile apr_uint32_t alloc_mapped_kbytes = 0;
+
+static volatile apr_uint32_t wand_pool_hits = 0;
+static volatile apr_uint32_t wand_pool_misses = 0;
+static volatile apr_uint32_t wand_pool_discards = 0;
+static volatile apr_uint32_t wand_pool_idle = 0;
+
+typedef enum magick_signature_failure_e {
+    MAGICK_SIGNATURE_REJECT,
+    MAGICK_SIGNATURE_ORIGINAL
+} magick_signature_failure_e;
+
+typedef enum magick_failure_fallback_e {
+    MAGICK_FAILURE_ERROR,
+    MAGICK_FAILURE_ORIGINAL
+} magick_failure_fallback_e;
+
+typedef enum magick_engine_e {
+    MAGICK_ENGINE_GRAPHICSMAGICK,
+    MAGICK_ENGINE_VIPS
+} magick_engine_e;
+
+typedef enum magick_effort_e {
+    MAGICK_EFFORT_UNSET,
+    MAGICK_EFFORT_FAST,
+    MAGICK_EFFORT_DEFAULT,
+    MAGICK_EFFORT_BEST
+} magick_effort_e;
+
+typedef enum magick_effort_format_e {
+    MAGICK_EFFORT_PNG,
+    MAGICK_EFFORT_WEBP,
+    MAGICK_EFFORT_JPEG,
+    MAGICK_EFFORT_FORMATS
+} magick_effort_format_e;
+
+typedef struct magick_effort {
+    magick_effort_e effort; /* effort, or unset */
+    magick_effort_e busy_effort; /* effort under load, or unset */
+} magick_effort;
+
 typedef struct magick_conf {
     int size_set:1; /* has the size been set */
+    int secret_set:1; /* has the signature secret been set */
+    int signature_set:1; /* has the signature been set */
+    int signature_data_set:1; /* has the signature data been set */
+    int signature_expires_set:1; /* has the signature expiry been set */
+    int signature_params_set:1; /* have the signature params been set */
+    int signature_failure_set:1; /* has the signature failure been set */
+    int failure_timeout_set:1; /* has the failure timeout been set */
+    int failure_fallback_set:1; /* has the failure fallback been set */
+    int spill_threshold_set:1; /* has the spill threshold been set */
+    int stream_threshold_set:1; /* has the stream threshold been set */
+    int engine_set:1; /* has the engine been set */
+    int encoder_load_set:1; /* has the encoder load been set */
+    int palette_set:1; /* has the palette been set */
+    int palette_lossy_set:1; /* has the lossy palette colors been set */
     apr_off_t size; /* maximum image size */
     apr_hash_t *options; /* options */
+    const char *secret; /* signature secret */
+    ap_expr_info_t *signature; /* signature supplied by the client */
+    ap_expr_info_t *signature_data; /* data covered by the signature */
+    ap_expr_info_t *signature_expires; /* signature expiry time */
+    const char *signature_param; /* query parameter of the signature */
+    const char *signature_expires_param; /* query parameter of the expiry */
+    magick_signature_failure_e signature_failure; /* action on failure */
+    apr_interval_time_t failure_timeout; /* how long to remember failures */
+    magick_failure_fallback_e failure_fallback; /* action on cached failure */
+    apr_size_t spill_threshold; /* outputs larger than this go to disk */
+    apr_uint64_t stream_threshold; /* sources with more pixels are streamed */
+    magick_engine_e engine; /* engine used to render the image */
+    magick_effort effort[MAGICK_EFFORT_FORMATS]; /* encoder effort by format */
+    double encoder_load; /* load above which the busy effort is used */
+    int palette; /* write PNG images with few colors with a palette */
+    unsigned long palette_lossy; /* colors quantized to a palette, or zero */
 } magick_conf;
 
 typedef struct magick_option {
     const char *format;  /* set to format */
     const char *key;  /* set to key */
     ap_expr_info_t *value;  /* set to value */
+    const char *constant;  /* set to value, if known at config time */
 } magick_option;
 
 typedef struct magick_do {
@@ -87,6 +473,59 @@ typedef struct magick_ctx {
     int seen_eos;
 } magick_ctx;
 
+typedef struct magick_plan {
+    apr_array_header_t *ops; /* pixel operations in the order applied */
+    int changed; /* must the image be rendered */
+    int strip; /* strip the metadata */
+    int keep_icc; /* keep the icc profile while stripping */
+    int quality_set; /* has the quality been set */
+    unsigned long quality; /* compression quality */
+    InterlaceType interlace; /* interlace scheme, if set */
+    const char *format; /* output format, if changed */
+    const apr_array_header_t *formats; /* formats to try, smallest wins */
+    apr_size_t target_bytes; /* largest encoded size, if set */
+    int quality_cap_set; /* cap the quality at the source quality */
+    int quality_cap; /* offset added to the source quality */
+    int busy; /* is the server above the encoder load */
+    int format_auto; /* choose the format from the content */
+    int format_auto_webp; /* may the format chosen be WEBP */
+    int palette; /* write PNG images with few colors with a palette */
+    unsigned long palette_colors; /* colors already counted, or zero */
+    int palette_alpha; /* did the colors counted include alpha */
+    int lossless; /* write WEBP images losslessly */
+} magick_plan;
+
+/* precedes every block handed to GraphicsMagick */
+typedef union magick_alloc_header {
+    struct {
+        apr_size_t size; /* usable size of the block */
+        int cls; /* size class, or -1 if mapped */
+    } h;
+    char pad[MAGICK_ALLOC_HEADER];
+} magick_alloc_header;
+
+typedef struct magick_alloc_cache {
+    void *free[MAGICK_ALLOC_CLASSES]; /* idle blocks per size class */
+    apr_size_t count[MAGICK_ALLOC_CLASSES]; /* number of idle blocks */
+    magick_alloc_header *mapped[MAGICK_ALLOC_MAPPED]; /* idle mappings */
+    apr_size_t mapped_bytes; /* length of the idle mappings */
+} magick_alloc_cache;
+
+typedef struct magick_wand_pool {
+    int count; /* number of idle wands */
+    MagickWand *wands[1]; /* the idle wands, wand_pool_size long */
+} magick_wand_pool;
+
+static void magick_failure_store(request_rec *r, magick_conf *conf,
+        apr_status_t status);
+static int magick_cache_key(request_rec *r, const char *name,
+        unsigned char key[APR_SHA1_DIGESTSIZE]);
+static long magick_cache_lookup(request_rec *r,
+        const unsigned char key[APR_SHA1_DIGESTSIZE]);
+static void magick_cache_store(request_rec *r,
+        const unsigned char key[APR_SHA1_DIGESTSIZE], long value);
+static void magick_bucket_destroy(void *data);
+
 
 static void *create_magick_dir_config(apr_pool_t *p, char *dummy)
 {
@@ -94,6 +533,9 @@ static void *create_magick_dir_config(apr_pool_t *p, char *dummy)
 
     new->size = DEFAULT_MAX_SIZE;
     new->options = apr_hash_make(p);
+    new->signature_param = DEFAULT_SIGNATURE_PARAM;
+    new->signature_expires_param = DEFAULT_SIGNATURE_EXPIRES_PARAM;
+    new->failure_timeout = apr_time_from_sec(DEFAULT_FAILURE_TIMEOUT);
 
     return (void *) new;
 }
@@ -103,12 +545,79 @@ static void *merge_magick_dir_config(apr_pool_t *p, void *basev, void *addv)
     magick_conf *new = (magick_conf *) apr_pcalloc(p, sizeof(magick_conf));
     magick_conf *add = (magick_conf *) addv;
     magick_conf *base = (magick_conf *) basev;
+    int i;
 
     new->size = (add->size_set == 0) ? base->size : add->size;
     new->size_set = add->size_set || base->size_set;
 
     new->options = apr_hash_overlay(p, add->options, base->options);
 
+    new->secret = (add->secret_set == 0) ? base->secret : add->secret;
+    new->secret_set = add->secret_set || base->secret_set;
+
+    new->signature = (add->signature_set == 0) ? base->signature : add->signature;
+    new->signature_set = add->signature_set || base->signature_set;
+
+    new->signature_data = (add->signature_data_set == 0) ?
+            base->signature_data : add->signature_data;
+    new->signature_data_set = add->signature_data_set || base->signature_data_set;
+
+    new->signature_expires = (add->signature_expires_set == 0) ?
+            base->signature_expires : add->signature_expires;
+    new->signature_expires_set = add->signature_expires_set
+            || base->signature_expires_set;
+
+    new->signature_param = (add->signature_params_set == 0) ?
+            base->signature_param : add->signature_param;
+    new->signature_expires_param = (add->signature_params_set == 0) ?
+            base->signature_expires_param : add->signature_expires_param;
+    new->signature_params_set = add->signature_params_set
+            || base->signature_params_set;
+
+    new->signature_failure = (add->signature_failure_set == 0) ?
+            base->signature_failure : add->signature_failure;
+    new->signature_failure_set = add->signature_failure_set
+            || base->signature_failure_set;
+
+    new->failure_timeout = (add->failure_timeout_set == 0) ?
+            base->failure_timeout : add->failure_timeout;
+    new->failure_timeout_set = add->failure_timeout_set
+            || base->failure_timeout_set;
+
+    new->failure_fallback = (add->failure_fallback_set == 0) ?
+            base->failure_fallback : add->failure_fallback;
+    new->failure_fallback_set = add->failure_fallback_set
+            || base->failure_fallback_set;
+
+    new->spill_threshold = (add->spill_threshold_set == 0) ?
+            base->spill_threshold : add->spill_threshold;
+    new->spill_threshold_set = add->spill_threshold_set
+            || base->spill_threshold_set;
+
+    new->stream_threshold = (add->stream_threshold_set == 0) ?
+            base->stream_threshold : add->stream_threshold;
+    new->stream_threshold_set = add->stream_threshold_set
+            || base->stream_threshold_set;
+
+    new->engine = (add->engine_set == 0) ? base->engine : add->engine;
+    new->engine_set = add->engine_set || base->engine_set;
+
+    for (i = 0; i < MAGICK_EFFORT_FORMATS; i++) {
+        new->effort[i] = (add->effort[i].effort == MAGICK_EFFORT_UNSET) ?
+                base->effort[i] : add->effort[i];
+    }
+
+    new->encoder_load = (add->encoder_load_set == 0) ?
+            base->encoder_load : add->encoder_load;
+    new->encoder_load_set = add->encoder_load_set || base->encoder_load_set;
+
+    new->palette = (add->palette_set == 0) ? base->palette : add->palette;
+    new->palette_set = add->palette_set || base->palette_set;
+
+    new->palette_lossy = (add->palette_lossy_set == 0) ?
+            base->palette_lossy : add->palette_lossy;
+    new->palette_lossy_set = add->palette_lossy_set || base->palette_lossy_set;
+
     return new;
 }
 
@@ -120,154 +629,3565 @@ static const char *set_magick_size(cmd_parms *cmd, void *dconf, const char *arg)
             <= 0) {
         return "MagickMaxSize must be a size in bytes, and greater than zero";
     }
-    conf->size_set = 1;
+    conf->size_set = 1;
+
+    return NULL;
+}
+
+static const char *add_magick_option(cmd_parms *cmd, void *dconf,
+        const char *key, const char *value)
+{
+    magick_conf *conf = dconf;
+    const char *expr_err = NULL;
+
+    magick_option *option = apr_palloc(cmd->pool, sizeof(magick_option));
+
+    option->key = strchr(key, ':');
+    if (!option->key) {
+        return apr_psprintf(cmd->pool, "Key '%s' needs a colon character", key);
+    }
+    option->format = apr_pstrndup(cmd->pool, key, option->key - key);
+    option->key++;
+    option->value = NULL;
+    option->constant = NULL;
+
+    if (AP_MAGICK_EXPR_IS_CONSTANT(value)) {
+        option->constant = value;
+    }
+    else {
+        option->value = ap_expr_parse_cmd(cmd, value,
+                AP_EXPR_FLAG_STRING_RESULT, &expr_err, NULL);
+
+        if (expr_err) {
+            return apr_pstrcat(cmd->temp_pool,
+                    "Cannot parse expression '", value, "': ",
+                    expr_err, NULL);
+        }
+    }
+
+    apr_hash_set(conf->options, key, APR_HASH_KEY_STRING, option);
+
+    return NULL;
+}
+
+static const char *set_magick_signature_secret(cmd_parms *cmd, void *dconf,
+        const char *arg)
+{
+    magick_conf *conf = dconf;
+
+    if (!strcasecmp(arg, "none")) {
+        conf->secret = NULL;
+    }
+    else if (!*arg) {
+        return "MagickSignatureSecret must not be empty";
+    }
+    else {
+        conf->secret = arg;
+    }
+    conf->secret_set = 1;
+
+    return NULL;
+}
+
+static const char *set_magick_signature(cmd_parms *cmd, void *dconf,
+        const char *arg)
+{
+    magick_conf *conf = dconf;
+    const char *expr_err = NULL;
+
+    conf->signature = ap_expr_parse_cmd(cmd, arg, AP_EXPR_FLAG_STRING_RESULT,
+            &expr_err, NULL);
+
+    if (expr_err) {
+        return apr_pstrcat(cmd->temp_pool,
+                "Cannot parse expression '", arg, "': ",
+                expr_err, NULL);
+    }
+
+    conf->signature_set = 1;
+
+    return NULL;
+}
+
+static const char *set_magick_signature_data(cmd_parms *cmd, void *dconf,
+        const char *arg)
+{
+    magick_conf *conf = dconf;
+    const char *expr_err = NULL;
+
+    conf->signature_data = ap_expr_parse_cmd(cmd, arg,
+            AP_EXPR_FLAG_STRING_RESULT, &expr_err, NULL);
+
+    if (expr_err) {
+        return apr_pstrcat(cmd->temp_pool,
+                "Cannot parse expression '", arg, "': ",
+                expr_err, NULL);
+    }
+
+    conf->signature_data_set = 1;
+
+    return NULL;
+}
+
+static const char *set_magick_signature_expires(cmd_parms *cmd, void *dconf,
+        const char *arg)
+{
+    magick_conf *conf = dconf;
+    const char *expr_err = NULL;
+
+    conf->signature_expires = ap_expr_parse_cmd(cmd, arg,
+            AP_EXPR_FLAG_STRING_RESULT, &expr_err, NULL);
+
+    if (expr_err) {
+        return apr_pstrcat(cmd->temp_pool,
+                "Cannot parse expression '", arg, "': ",
+                expr_err, NULL);
+    }
+
+    conf->signature_expires_set = 1;
+
+    return NULL;
+}
+
+static const char *set_magick_signature_params(cmd_parms *cmd, void *dconf,
+        const char *name, const char *expires_name)
+{
+    magick_conf *conf = dconf;
+
+    if (!*name || ap_strchr_c(name, '=') || ap_strchr_c(name, '&')
+            || (expires_name && (!*expires_name
+                    || ap_strchr_c(expires_name, '=')
+                    || ap_strchr_c(expires_name, '&')))) {
+        return "MagickSignatureParams must be one or two query parameter names";
+    }
+
+    conf->signature_param = name;
+    conf->signature_expires_param = expires_name ? expires_name
+            : DEFAULT_SIGNATURE_EXPIRES_PARAM;
+    conf->signature_params_set = 1;
+
+    return NULL;
+}
+
+static const char *set_magick_signature_failure(cmd_parms *cmd, void *dconf,
+        const char *arg)
+{
+    magick_conf *conf = dconf;
+
+    if (!strcasecmp(arg, "reject")) {
+        conf->signature_failure = MAGICK_SIGNATURE_REJECT;
+    }
+    else if (!strcasecmp(arg, "original")) {
+        conf->signature_failure = MAGICK_SIGNATURE_ORIGINAL;
+    }
+    else {
+        return "MagickSignatureFailure must be one of reject|original";
+    }
+    conf->signature_failure_set = 1;
+
+    return NULL;
+}
+
+static const char *set_magick_failure_cache(cmd_parms *cmd, void *dconf,
+        const char *arg)
+{
+    const char *errmsg = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    const char *sep, *name;
+
+    if (errmsg) {
+        return errmsg;
+    }
+
+    /* argument is of the form provider[:args] */
+    sep = ap_strchr_c(arg, ':');
+    if (sep) {
+        name = apr_pstrmemdup(cmd->pool, arg, sep - arg);
+        sep++;
+    }
+    else {
+        name = arg;
+    }
+
+    failure_provider = ap_lookup_provider(AP_SOCACHE_PROVIDER_GROUP, name,
+            AP_SOCACHE_PROVIDER_VERSION);
+    if (!failure_provider) {
+        return apr_psprintf(cmd->pool,
+                "Unknown socache provider '%s'. Maybe you need "
+                "to load the appropriate socache module "
+                "(mod_socache_%s?)", name, name);
+    }
+
+    errmsg = failure_provider->create(&failure_instance, sep, cmd->temp_pool,
+            cmd->pool);
+    if (errmsg) {
+        return apr_psprintf(cmd->pool, "MagickFailureCache: %s", errmsg);
+    }
+
+    failure_configured = 1;
+
+    return NULL;
+}
+
+static const char *set_magick_failure_timeout(cmd_parms *cmd, void *dconf,
+        const char *arg)
+{
+    magick_conf *conf = dconf;
+    apr_off_t timeout;
+
+    if (APR_SUCCESS != apr_strtoff(&timeout, arg, NULL, 10) || timeout <= 0) {
+        return "MagickFailureCacheTimeout must be a time in seconds, and greater than zero";
+    }
+    conf->failure_timeout = apr_time_from_sec(timeout);
+    conf->failure_timeout_set = 1;
+
+    return NULL;
+}
+
+static const char *set_magick_failure_fallback(cmd_parms *cmd, void *dconf,
+        const char *arg)
+{
+    magick_conf *conf = dconf;
+
+    if (!strcasecmp(arg, "error")) {
+        conf->failure_fallback = MAGICK_FAILURE_ERROR;
+    }
+    else if (!strcasecmp(arg, "original")) {
+        conf->failure_fallback = MAGICK_FAILURE_ORIGINAL;
+    }
+    else {
+        return "MagickFailureCacheFallback must be one of error|original";
+    }
+    conf->failure_fallback_set = 1;
+
+    return NULL;
+}
+
+static const char *set_magick_spill_threshold(cmd_parms *cmd, void *dconf,
+        const char *arg)
+{
+    magick_conf *conf = dconf;
+    apr_off_t threshold;
+
+    if (APR_SUCCESS != apr_strtoff(&threshold, arg, NULL, 10)
+            || threshold < 0 || (apr_uint64_t)threshold > APR_SIZE_MAX) {
+        return "MagickSpillThreshold must be a size in bytes, or zero to disable";
+    }
+    conf->spill_threshold = (apr_size_t)threshold;
+    conf->spill_threshold_set = 1;
+
+    return NULL;
+}
+
+static const char *set_magick_stream_threshold(cmd_parms *cmd, void *dconf,
+        const char *arg)
+{
+    magick_conf *conf = dconf;
+    apr_off_t threshold;
+
+    if (APR_SUCCESS != apr_strtoff(&threshold, arg, NULL, 10)
+            || threshold < 0) {
+        return "MagickStreamThreshold must be a number of pixels, or zero to disable";
+    }
+    conf->stream_threshold = (apr_uint64_t)threshold;
+    conf->stream_threshold_set = 1;
+
+    return NULL;
+}
+
+static const char *set_magick_engine(cmd_parms *cmd, void *dconf,
+        const char *arg)
+{
+    magick_conf *conf = dconf;
+
+    if (!strcasecmp(arg, "graphicsmagick")) {
+        conf->engine = MAGICK_ENGINE_GRAPHICSMAGICK;
+    }
+    else if (!strcasecmp(arg, "vips")) {
+#ifdef HAVE_VIPS
+        conf->engine = MAGICK_ENGINE_VIPS;
+        vips_configured = 1;
+#else
+        return "MagickEngine vips is not available, mod_magick was built "
+                "without libvips";
+#endif
+    }
+    else {
+        return "MagickEngine must be one of graphicsmagick|vips";
+    }
+    conf->engine_set = 1;
+
+    return NULL;
+}
+
+static int magick_effort_format(const char *format)
+{
+    if (!strcasecmp(format, "PNG")) {
+        return MAGICK_EFFORT_PNG;
+    }
+    else if (!strcasecmp(format, "WEBP")) {
+        return MAGICK_EFFORT_WEBP;
+    }
+    else if (!strcasecmp(format, "JPEG") || !strcasecmp(format, "JPG")) {
+        return MAGICK_EFFORT_JPEG;
+    }
+
+    return -1;
+}
+
+static magick_effort_e magick_effort_parse(const char *arg)
+{
+    if (!strcasecmp(arg, "fast")) {
+        return MAGICK_EFFORT_FAST;
+    }
+    else if (!strcasecmp(arg, "default")) {
+        return MAGICK_EFFORT_DEFAULT;
+    }
+    else if (!strcasecmp(arg, "best")) {
+        return MAGICK_EFFORT_BEST;
+    }
+
+    return MAGICK_EFFORT_UNSET;
+}
+
+static const char *set_magick_encoder_effort(cmd_parms *cmd, void *dconf,
+        const char *format, const char *effort, const char *busy_effort)
+{
+    magick_conf *conf = dconf;
+    int slot = magick_effort_format(format);
+
+    if (slot < 0) {
+        return "MagickEncoderEffort format must be one of PNG|WEBP|JPEG";
+    }
+
+    conf->effort[slot].effort = magick_effort_parse(effort);
+    conf->effort[slot].busy_effort = busy_effort ?
+            magick_effort_parse(busy_effort) : conf->effort[slot].effort;
+    if (conf->effort[slot].effort == MAGICK_EFFORT_UNSET
+            || conf->effort[slot].busy_effort == MAGICK_EFFORT_UNSET) {
+        conf->effort[slot].effort = MAGICK_EFFORT_UNSET;
+        return "MagickEncoderEffort effort must be one of fast|default|best";
+    }
+
+    return NULL;
+}
+
+static const char *set_magick_encoder_load(cmd_parms *cmd, void *dconf,
+        const char *arg)
+{
+    magick_conf *conf = dconf;
+    char *end;
+
+    conf->encoder_load = strtod(arg, &end);
+    if (!*arg || *end || conf->encoder_load < 0) {
+        return "MagickEncoderLoad must be a load average, zero or greater";
+    }
+    conf->encoder_load_set = 1;
+
+    return NULL;
+}
+
+static const char *set_magick_palette(cmd_parms *cmd, void *dconf, int flag)
+{
+    magick_conf *conf = dconf;
+
+    conf->palette = flag;
+    conf->palette_set = 1;
+
+    return NULL;
+}
+
+static const char *set_magick_palette_lossy(cmd_parms *cmd, void *dconf,
+        const char *arg)
+{
+    magick_conf *conf = dconf;
+    apr_off_t colors;
+
+    if (APR_SUCCESS != apr_strtoff(&colors, arg, NULL, 10) || colors < 0
+            || colors > MAGICK_PALETTE_LOSSY_MAX) {
+        return "MagickPaletteLossyColors must be a number of colors from 0 "
+                "to 65536";
+    }
+    conf->palette_lossy = (unsigned long)colors;
+    conf->palette_lossy_set = 1;
+
+    return NULL;
+}
+
+static const char *set_magick_wand_pool_size(cmd_parms *cmd, void *dconf,
+        const char *arg)
+{
+    const char *errmsg = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_off_t size;
+
+    if (errmsg) {
+        return errmsg;
+    }
+
+    if (APR_SUCCESS != apr_strtoff(&size, arg, NULL, 10) || size < 0
+            || size > 1024) {
+        return "MagickWandPoolSize must be a number of wands between 0 and 1024";
+    }
+    wand_pool_size = size;
+
+    return NULL;
+}
+
+static const char *set_magick_frame_threads(cmd_parms *cmd, void *dconf,
+        const char *arg)
+{
+    const char *errmsg = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_off_t threads;
+
+    if (errmsg) {
+        return errmsg;
+    }
+
+    if (APR_SUCCESS != apr_strtoff(&threads, arg, NULL, 10) || threads < 0
+            || threads > 256) {
+        return "MagickFrameThreads must be a number of threads between 0 and 256";
+    }
+    frame_threads = threads;
+
+    return NULL;
+}
+
+static const char *add_magick_preload_format(cmd_parms *cmd, void *dconf,
+        const char *arg)
+{
+    const char *errmsg = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (errmsg) {
+        return errmsg;
+    }
+
+    if (!preload_formats) {
+        preload_formats = apr_array_make(cmd->pool, 4, sizeof(const char *));
+    }
+    APR_ARRAY_PUSH(preload_formats, const char *) = arg;
+
+    return NULL;
+}
+
+static const char *set_magick_allocator(cmd_parms *cmd, void *dconf,
+        const char *arg)
+{
+    const char *errmsg = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (errmsg) {
+        return errmsg;
+    }
+
+    if (!strcasecmp(arg, "system")) {
+        alloc_arena = 0;
+    }
+    else if (!strcasecmp(arg, "arena")) {
+        alloc_arena = 1;
+    }
+    else {
+        return "MagickAllocator must be one of system|arena";
+    }
+
+    return NULL;
+}
+
+static const command_rec magick_cmds[] = {
+    AP_INIT_TAKE1("MagickMaxSize", set_magick_size, NULL, ACCESS_CONF,
+        "Maximum size of the image processed by the magick filter"),
+    AP_INIT_TAKE2("AddMagickOption", add_magick_option, NULL, ACCESS_CONF,
+        "Add key/value option to be used by the filter."),
+    AP_INIT_TAKE1("MagickSignatureSecret", set_magick_signature_secret, NULL, ACCESS_CONF,
+        "Secret used to verify the HMAC-SHA1 signature of the transform parameters, "
+        "or 'none' to disable verification."),
+    AP_INIT_TAKE1("MagickSignature", set_magick_signature, NULL, ACCESS_CONF,
+        "Expression returning the hex encoded signature supplied by the client."),
+    AP_INIT_TAKE1("MagickSignatureData", set_magick_signature_data, NULL, ACCESS_CONF,
+        "Expression returning the data covered by the signature. Defaults to the "
+        "request URI and query string, without the signature and expiry parameters."),
+    AP_INIT_TAKE1("MagickSignatureExpires", set_magick_signature_expires, NULL, ACCESS_CONF,
+        "Expression returning the time in seconds since the epoch that the "
+        "signature expires."),
+    AP_INIT_TAKE12("MagickSignatureParams", set_magick_signature_params, NULL, ACCESS_CONF,
+        "Names of the query parameters holding the signature and the expiry time, "
+        "left out of the default signature data. Defaults to 's' and 'e'."),
+    AP_INIT_TAKE1("MagickSignatureFailure", set_magick_signature_failure, NULL, ACCESS_CONF,
+        "Action to take when the signature is missing, invalid or expired. Must be "
+        "one of reject|original. Default is 'reject'."),
+    AP_INIT_TAKE1("MagickFailureCache", set_magick_failure_cache, NULL, RSRC_CONF,
+        "Shared object cache used to remember source images that could not be "
+        "processed, in the form provider[:args]."),
+    AP_INIT_TAKE1("MagickFailureCacheTimeout", set_magick_failure_timeout, NULL, ACCESS_CONF,
+        "Number of seconds a failed source image is remembered. Default is 300."),
+    AP_INIT_TAKE1("MagickFailureCacheFallback", set_magick_failure_fallback, NULL, ACCESS_CONF,
+        "Action to take when a source image is known to fail. Must be one of "
+        "error|original. Default is 'error'."),
+    AP_INIT_TAKE1("MagickSpillThreshold", set_magick_spill_threshold, NULL, ACCESS_CONF,
+        "Size in bytes above which the output image is written to a temporary "
+        "file instead of being kept in memory, or zero to disable. Default is "
+        "zero."),
+    AP_INIT_TAKE1("MagickStreamThreshold", set_magick_stream_threshold, NULL, ACCESS_CONF,
+        "Number of source pixels above which a stripped image is resized while "
+        "it is being decoded, or zero to disable. Default is zero."),
+    AP_INIT_TAKE1("MagickEngine", set_magick_engine, NULL, ACCESS_CONF,
+        "Engine used to render the image, falling back to GraphicsMagick for "
+        "anything the engine cannot do. Must be one of graphicsmagick|vips. "
+        "Default is 'graphicsmagick'."),
+    AP_INIT_TAKE23("MagickEncoderEffort", set_magick_encoder_effort, NULL, ACCESS_CONF,
+        "Effort of the encoder of the format, one of fast|default|best, "
+        "optionally followed by the effort used while the server is above "
+        "MagickEncoderLoad."),
+    AP_INIT_TAKE1("MagickEncoderLoad", set_magick_encoder_load, NULL, ACCESS_CONF,
+        "One minute load average above which the second MagickEncoderEffort "
+        "is used, or zero to disable. Default is zero."),
+    AP_INIT_FLAG("MagickPalette", set_magick_palette, NULL, ACCESS_CONF,
+        "Write PNG images with 256 colors or fewer as palette images. Default "
+        "is off."),
+    AP_INIT_TAKE1("MagickPaletteLossyColors", set_magick_palette_lossy, NULL, ACCESS_CONF,
+        "Number of colors up to which a PNG image is quantized to a palette of "
+        "256 colors, or zero to disable. Default is zero."),
+    AP_INIT_TAKE1("MagickWandPoolSize", set_magick_wand_pool_size, NULL, RSRC_CONF,
+        "Number of idle magick wands kept for reuse by each thread. Zero disables "
+        "the pool. Default is 4."),
+    AP_INIT_TAKE1("MagickFrameThreads", set_magick_frame_threads, NULL, RSRC_CONF,
+        "Number of threads in each child used to process the frames of "
+        "animations. Zero processes the frames one at a time. Default is 4."),
+    AP_INIT_ITERATE("MagickPreloadFormats", add_magick_preload_format, NULL, RSRC_CONF,
+        "Formats whose coders are loaded at startup, before the children are "
+        "created."),
+    AP_INIT_TAKE1("MagickAllocator", set_magick_allocator, NULL, RSRC_CONF,
+        "Allocator used by GraphicsMagick. Must be one of system|arena. Default "
+        "is 'system'."), { NULL },
+};
+
+/*
+ * Strip APPn and COM segments from a JPEG image, keeping the JFIF and Adobe
+ * segments needed to decode the image, and optionally the ICC profile.
+ * Returns the length of the stripped image, or zero if the image could not
+ * be parsed.
+ */
+static apr_size_t magick_strip_jpeg(const unsigned char *in, apr_size_t len,
+        unsigned char *out, int keep_icc)
+{
+    apr_size_t pos = 2, olen = 2;
+
+    if (len < 4 || in[0] != 0xFF || in[1] != 0xD8) {
+        return 0;
+    }
+    memcpy(out, in, 2);
+
+    while (pos + 2 <= len) {
+        apr_size_t seglen;
+        unsigned char marker;
+        int keep = 1;
+
+        if (in[pos] != 0xFF) {
+            return 0;
+        }
+
+        /* skip fill bytes */
+        while (pos + 2 < len && in[pos + 1] == 0xFF) {
+            pos++;
+        }
+        marker = in[pos + 1];
+
+        /* markers without a length */
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            memcpy(out + olen, in + pos, 2);
+            olen += 2;
+            pos += 2;
+            continue;
+        }
+
+        /* end of image without any scan, give up */
+        if (marker == 0xD9 || pos + 4 > len) {
+            return 0;
+        }
+
+        seglen = (in[pos + 2] << 8) | in[pos + 3];
+        if (seglen < 2 || pos + 2 + seglen > len) {
+            return 0;
+        }
+
+        /* start of scan, the rest of the image is kept as is */
+        if (marker == 0xDA) {
+            memcpy(out + olen, in + pos, len - pos);
+            return olen + len - pos;
+        }
+
+        if (marker == 0xFE) {
+            keep = 0;
+        }
+        else if (marker == 0xE2) {
+            keep = keep_icc && seglen >= 14
+                    && !memcmp(in + pos + 4, "ICC_PROFILE", 12);
+        }
+        else if (marker >= 0xE1 && marker <= 0xEF && marker != 0xEE) {
+            keep = 0;
+        }
+
+        if (keep) {
+            memcpy(out + olen, in + pos, seglen + 2);
+            olen += seglen + 2;
+        }
+        pos += seglen + 2;
+    }
+
+    return 0;
+}
+
+/*
+ * Strip ancillary chunks from a PNG image, keeping the chunks that affect
+ * how the image is rendered, and optionally the ICC profile. Returns the
+ * length of the stripped image, or zero if the image could not be parsed.
+ */
+static apr_size_t magick_strip_png(const unsigned char *in, apr_size_t len,
+        unsigned char *out, int keep_icc)
+{
+    static const unsigned char signature[8] = {
+            0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    static const char * const kept[] = {
+            "tRNS", "gAMA", "cHRM", "sRGB", "sBIT", "pHYs", "cICP",
+            "acTL", "fcTL", "fdAT", NULL };
+    apr_size_t pos = 8, olen = 8;
+
+    if (len < 8 || memcmp(in, signature, 8)) {
+        return 0;
+    }
+    memcpy(out, in, 8);
+
+    while (pos + 12 <= len) {
+        apr_size_t chunklen;
+        const char *type = (const char *)in + pos + 4;
+        int keep;
+
+        chunklen = ((apr_size_t)in[pos] << 24) | (in[pos + 1] << 16)
+                | (in[pos + 2] << 8) | in[pos + 3];
+        if (chunklen > len - pos - 12) {
+            return 0;
+        }
+
+        /* critical chunks have an upper case first letter */
+        keep = !(type[0] & 0x20);
+        if (!keep) {
+            const char * const *k;
+
+            if (keep_icc && !memcmp(type, "iCCP", 4)) {
+                keep = 1;
+            }
+            for (k = kept; !keep && *k; k++) {
+                keep = !memcmp(type, *k, 4);
+            }
+        }
+
+        if (keep) {
+            memcpy(out + olen, in + pos, chunklen + 12);
+            olen += chunklen + 12;
+        }
+        pos += chunklen + 12;
+
+        if (!memcmp(type, "IEND", 4)) {
+            return olen;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Strip the metadata from the original source without decoding it, where
+ * the source format allows. Returns NULL if the source could not be
+ * stripped.
+ */
+static char *magick_strip_source(ap_bucket_magick *m, int keep_icc,
+        apr_size_t *len)
+{
+    unsigned char *out = MagickMalloc(m->source_len);
+
+    if (!out) {
+        return NULL;
+    }
+
+    *len = magick_strip_jpeg(m->source, m->source_len, out, keep_icc);
+    if (!*len) {
+        *len = magick_strip_png(m->source, m->source_len, out, keep_icc);
+    }
+    if (!*len) {
+        MagickFree(out);
+        return NULL;
+    }
+
+    return (char *)out;
+}
+
+#ifdef HAVE_LIBJPEG
+
+typedef struct magick_jpeg_error {
+    struct jpeg_error_mgr pub;
+    jmp_buf jmp;
+} magick_jpeg_error;
+
+/* written by the library after setjmp(), and so kept out of the locals */
+typedef struct magick_jpeg_dest {
+    unsigned char *out;
+    unsigned long outlen;
+} magick_jpeg_dest;
+
+static void magick_jpeg_error_exit(j_common_ptr cinfo)
+{
+    magick_jpeg_error *err = (magick_jpeg_error *) cinfo->err;
+
+    longjmp(err->jmp, 1);
+}
+
+static void magick_jpeg_output_message(j_common_ptr cinfo)
+{
+    /* warnings are not fatal, keep quiet */
+}
+
+/*
+ * Losslessly transcode a JPEG image from the original DCT coefficients,
+ * applying the interlace scheme, optimising the Huffman tables and
+ * stripping metadata if asked. Returns NULL if the source is not a JPEG
+ * image or could not be transcoded.
+ */
+static char *magick_transcode_jpeg(ap_bucket_magick *m, int strip,
+        int keep_icc, InterlaceType interlace, apr_size_t *len)
+{
+    struct jpeg_decompress_struct src;
+    struct jpeg_compress_struct dst;
+    magick_jpeg_error jerr;
+    jvirt_barray_ptr *coefficients;
+    jpeg_saved_marker_ptr marker;
+    magick_jpeg_dest *dest;
+    char *base;
+    int i;
+
+    if (m->source_len < 4 || m->source[0] != 0xFF || m->source[1] != 0xD8) {
+        return NULL;
+    }
+
+    dest = apr_pcalloc(m->r->pool, sizeof(magick_jpeg_dest));
+
+    src.err = jpeg_std_error(&jerr.pub);
+    dst.err = &jerr.pub;
+    jerr.pub.error_exit = magick_jpeg_error_exit;
+    jerr.pub.output_message = magick_jpeg_output_message;
+
+    jpeg_create_decompress(&src);
+    jpeg_create_compress(&dst);
+
+    if (setjmp(jerr.jmp)) {
+        jpeg_destroy_compress(&dst);
+        jpeg_destroy_decompress(&src);
+        if (dest->out) {
+            free(dest->out);
+        }
+        return NULL;
+    }
+
+    jpeg_mem_src(&src, (unsigned char *) m->source, m->source_len);
+    jpeg_save_markers(&src, JPEG_COM, 0xFFFF);
+    for (i = 0; i < 16; i++) {
+        jpeg_save_markers(&src, JPEG_APP0 + i, 0xFFFF);
+    }
+    jpeg_read_header(&src, TRUE);
+
+    coefficients = jpeg_read_coefficients(&src);
+
+    jpeg_copy_critical_parameters(&src, &dst);
+    dst.optimize_coding = TRUE;
+    if (interlace != NoInterlace) {
+        jpeg_simple_progression(&dst);
+    }
+
+    jpeg_mem_dest(&dst, &dest->out, &dest->outlen);
+    jpeg_write_coefficients(&dst, coefficients);
+
+    for (marker = src.marker_list; marker; marker = marker->next) {
+
+        /* written for us by the library */
+        if (dst.write_JFIF_header && marker->marker == JPEG_APP0
+                && marker->data_length >= 5
+                && !memcmp(marker->data, "JFIF", 5)) {
+            continue;
+        }
+        if (dst.write_Adobe_marker && marker->marker == JPEG_APP0 + 14
+                && marker->data_length >= 5
+                && !memcmp(marker->data, "Adobe", 5)) {
+            continue;
+        }
+
+        if (strip) {
+            if (marker->marker == JPEG_COM) {
+                continue;
+            }
+            if (marker->marker == JPEG_APP0 + 2) {
+                if (!keep_icc || marker->data_length < 12
+                        || memcmp(marker->data, "ICC_PROFILE", 12)) {
+                    continue;
+                }
+            }
+            else if (marker->marker > JPEG_APP0
+                    && marker->marker != JPEG_APP0 + 14) {
+                continue;
+            }
+        }
+
+        jpeg_write_marker(&dst, marker->marker, marker->data,
+                marker->data_length);
+    }
+
+    jpeg_finish_compress(&dst);
+    jpeg_finish_decompress(&src);
+
+    jpeg_destroy_compress(&dst);
+    jpeg_destroy_decompress(&src);
+
+    /* hand over the result in memory we can release */
+    base = MagickMalloc(dest->outlen);
+    if (base) {
+        memcpy(base, dest->out, dest->outlen);
+        *len = dest->outlen;
+    }
+    free(dest->out);
+
+    return base;
+}
+
+#endif
+
+/*
+ * Allocator installed into GraphicsMagick when MagickAllocator is 'arena'.
+ *
+ * Small blocks are rounded up to a power of two size class, and freed
+ * blocks are kept on a bounded per-thread free list for reuse by the next
+ * image, so that repeated decode and resize cycles reuse the same blocks
+ * instead of fragmenting the heap. Large blocks such as pixel caches are
+ * mapped directly. A few freed mappings are kept per thread for the next
+ * block of a similar size, as the same sizes recur from one image to the
+ * next, and the rest are returned to the system as soon as they are freed.
+ */
+static magick_alloc_cache *magick_alloc_cache_get(void)
+{
+    magick_alloc_cache *cache = NULL;
+
+#if APR_HAS_THREADS
+    if (!alloc_arena || !alloc_cache_key
+            || apr_threadkey_private_get((void **)&cache, alloc_cache_key)
+                    != APR_SUCCESS) {
+        return NULL;
+    }
+
+    if (!cache) {
+        cache = calloc(1, sizeof(magick_alloc_cache));
+        if (cache && apr_threadkey_private_set(cache, alloc_cache_key)
+                != APR_SUCCESS) {
+            free(cache);
+            return NULL;
+        }
+    }
+#endif
+
+    return cache;
+}
+
+static void magick_alloc_cache_destroy(void *data)
+{
+    magick_alloc_cache *cache = data;
+    int cls;
+#ifndef WIN32
+    int i;
+#endif
+
+    if (cache) {
+        for (cls = 0; cls < MAGICK_ALLOC_CLASSES; cls++) {
+            while (cache->free[cls]) {
+                void *block = cache->free[cls];
+                cache->free[cls] = *(void **)block;
+                apr_atomic_sub32(&alloc_cache_bytes,
+                        1 << (cls + MAGICK_ALLOC_MIN_SHIFT));
+                free((char *)block - MAGICK_ALLOC_HEADER);
+            }
+        }
+#ifndef WIN32
+        for (i = 0; i < MAGICK_ALLOC_MAPPED; i++) {
+            magick_alloc_header *header = cache->mapped[i];
+            if (header) {
+                apr_size_t len = header->h.size + MAGICK_ALLOC_HEADER;
+                apr_atomic_sub32(&alloc_cache_bytes, len);
+                apr_atomic_dec32(&alloc_mapped);
+                apr_atomic_sub32(&alloc_mapped_kbytes, len >> 10);
+                munmap(header, len);
+            }
+        }
+#endif
+        free(cache);
+    }
+}
+
+static void *magick_alloc_malloc(size_t size)
+{
+    magick_alloc_header *header;
+    apr_size_t len;
+    int cls = 0;
+
+    if (!size) {
+        size = 1;
+    }
+
+    len = size + MAGICK_ALLOC_HEADER;
+
+#ifndef WIN32
+    if (len > (1 << (MAGICK_ALLOC_CLASSES - 1 + MAGICK_ALLOC_MIN_SHIFT))) {
+        magick_alloc_cache *cache = magick_alloc_cache_get();
+        void *map;
+        int i, best = -1;
+
+        len = APR_ALIGN(len, 4096);
+
+        /* reuse the smallest idle mapping that fits without waste */
+        for (i = 0; cache && i < MAGICK_ALLOC_MAPPED; i++) {
+            magick_alloc_header *idle = cache->mapped[i];
+            apr_size_t idle_len;
+
+            if (!idle) {
+                continue;
+            }
+            idle_len = idle->h.size + MAGICK_ALLOC_HEADER;
+            if (idle_len >= len && idle_len / 2 <= len && (best < 0
+                    || idle_len < cache->mapped[best]->h.size
+                            + MAGICK_ALLOC_HEADER)) {
+                best = i;
+            }
+        }
+        if (best >= 0) {
+            header = cache->mapped[best];
+            cache->mapped[best] = NULL;
+            cache->mapped_bytes -= header->h.size + MAGICK_ALLOC_HEADER;
+            apr_atomic_sub32(&alloc_cache_bytes,
+                    header->h.size + MAGICK_ALLOC_HEADER);
+            apr_atomic_inc32(&alloc_cache_hits);
+            return (char *)header + MAGICK_ALLOC_HEADER;
+        }
+        if (cache) {
+            apr_atomic_inc32(&alloc_cache_misses);
+        }
+
+        map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            return NULL;
+        }
+        apr_atomic_inc32(&alloc_mapped);
+        apr_atomic_add32(&alloc_mapped_kbytes, len >> 10);
+
+        header = map;
+        header->h.size = len - MAGICK_ALLOC_HEADER;
+        header->h.cls = -1;
+
+        return (char *)header + MAGICK_ALLOC_HEADER;
+    }
+#endif
+
+    while (len > ((apr_size_t)1 << (cls + MAGICK_ALLOC_MIN_SHIFT))
+            && cls < MAGICK_ALLOC_CLASSES - 1) {
+        cls++;
+    }
+
+    if (len <= ((apr_size_t)1 << (cls + MAGICK_ALLOC_MIN_SHIFT))) {
+        magick_alloc_cache *cache = magick_alloc_cache_get();
+
+        if (cache && cache->free[cls]) {
+            void *block = cache->free[cls];
+            cache->free[cls] = *(void **)block;
+            cache->count[cls]--;
+            apr_atomic_sub32(&alloc_cache_bytes,
+                    1 << (cls + MAGICK_ALLOC_MIN_SHIFT));
+            apr_atomic_inc32(&alloc_cache_hits);
+            return block;
+        }
+        if (cache) {
+            apr_atomic_inc32(&alloc_cache_misses);
+        }
+        len = (apr_size_t)1 << (cls + MAGICK_ALLOC_MIN_SHIFT);
+    }
+    else {
+        cls = -2;
+    }
+
+    header = malloc(len);
+    if (!header) {
+        return NULL;
+    }
+    header->h.size = len - MAGICK_ALLOC_HEADER;
+    header->h.cls = cls;
+
+    return (char *)header + MAGICK_ALLOC_HEADER;
+}
+
+static void magick_alloc_free(void *ptr)
+{
+    magick_alloc_header *header;
+
+    if (!ptr) {
+        return;
+    }
+
+    header = (magick_alloc_header *)((char *)ptr - MAGICK_ALLOC_HEADER);
+
+#ifndef WIN32
+    if (header->h.cls == -1) {
+        magick_alloc_cache *cache = magick_alloc_cache_get();
+        apr_size_t len = header->h.size + MAGICK_ALLOC_HEADER;
+        int i;
+
+        for (i = 0; cache && i < MAGICK_ALLOC_MAPPED; i++) {
+            if (!cache->mapped[i]
+                    && cache->mapped_bytes + len <= MAGICK_ALLOC_MAPPED_BYTES) {
+                cache->mapped[i] = header;
+                cache->mapped_bytes += len;
+                apr_atomic_add32(&alloc_cache_bytes, len);
+                return;
+            }
+        }
+
+        apr_atomic_dec32(&alloc_mapped);
+        apr_atomic_sub32(&alloc_mapped_kbytes, len >> 10);
+        munmap(header, len);
+        return;
+    }
+#endif
+
+    if (header->h.cls >= 0) {
+        magick_alloc_cache *cache = magick_alloc_cache_get();
+        apr_size_t block = (apr_size_t)1 << (header->h.cls
+                + MAGICK_ALLOC_MIN_SHIFT);
+
+        if (cache && cache->count[header->h.cls] * block
+                < MAGICK_ALLOC_CACHE_BYTES) {
+            *(void **)ptr = cache->free[header->h.cls];
+            cache->free[header->h.cls] = ptr;
+            cache->count[header->h.cls]++;
+            apr_atomic_add32(&alloc_cache_bytes, block);
+            return;
+        }
+    }
+
+    free(header);
+}
+
+static void *magick_alloc_realloc(void *ptr, size_t size)
+{
+    magick_alloc_header *header;
+    void *block;
+
+    if (!ptr) {
+        return magick_alloc_malloc(size);
+    }
+    if (!size) {
+        magick_alloc_free(ptr);
+        return NULL;
+    }
+
+    header = (magick_alloc_header *)((char *)ptr - MAGICK_ALLOC_HEADER);
+    if (size <= header->h.size) {
+        return ptr;
+    }
+
+    block = magick_alloc_malloc(size);
+    if (block) {
+        memcpy(block, ptr, header->h.size);
+        magick_alloc_free(ptr);
+    }
+
+    return block;
+}
+
+/*
+ * Each thread keeps a small pool of cleared wands, so that the setup of a
+ * wand is not repeated for every image. A wand may be released by a thread
+ * other than the one that acquired it, in which case it joins the pool of
+ * the releasing thread.
+ */
+static magick_wand_pool *magick_wand_pool_get(void)
+{
+    magick_wand_pool *pool = NULL;
+
+    if (!wand_pool_size) {
+        return NULL;
+    }
+
+#if APR_HAS_THREADS
+    if (!wand_pool_key
+            || apr_threadkey_private_get((void **)&pool, wand_pool_key)
+                    != APR_SUCCESS) {
+        return NULL;
+    }
+#else
+    pool = wand_pool;
+#endif
+
+    if (!pool) {
+        pool = calloc(1, sizeof(magick_wand_pool)
+                + (wand_pool_size - 1) * sizeof(MagickWand *));
+        if (!pool) {
+            return NULL;
+        }
+#if APR_HAS_THREADS
+        if (apr_threadkey_private_set(pool, wand_pool_key) != APR_SUCCESS) {
+            free(pool);
+            return NULL;
+        }
+#else
+        wand_pool = pool;
+#endif
+    }
+
+    return pool;
+}
+
+static void magick_wand_pool_destroy(void *data)
+{
+    magick_wand_pool *pool = data;
+
+    if (pool) {
+        while (pool->count) {
+            DestroyMagickWand(pool->wands[--pool->count]);
+            apr_atomic_dec32(&wand_pool_idle);
+        }
+        free(pool);
+    }
+}
+
+static MagickWand *magick_wand_acquire(void)
+{
+    magick_wand_pool *pool = magick_wand_pool_get();
+
+    if (pool && pool->count) {
+        apr_atomic_inc32(&wand_pool_hits);
+        apr_atomic_dec32(&wand_pool_idle);
+        return pool->wands[--pool->count];
+    }
+
+    apr_atomic_inc32(&wand_pool_misses);
+    return NewMagickWand();
+}
+
+static void magick_wand_release(MagickWand *wand)
+{
+    magick_wand_pool *pool = magick_wand_pool_get();
+
+    if (pool && pool->count < wand_pool_size) {
+        ClearMagickWand(wand);
+        pool->wands[pool->count++] = wand;
+        apr_atomic_inc32(&wand_pool_idle);
+    }
+    else {
+        apr_atomic_inc32(&wand_pool_discards);
+        DestroyMagickWand(wand);
+    }
+}
+
+/*
+ * Strip the metadata from the wand, keeping the ICC profile if asked.
+ */
+static unsigned int magick_strip_wand(MagickWand *wand, int keep_icc)
+{
+    unsigned char *icc = NULL;
+    unsigned long icc_len = 0;
+    unsigned int rv;
+
+    if (keep_icc) {
+        icc = MagickGetImageProfile(wand, "ICC", &icc_len);
+    }
+
+    rv = MagickStripImage(wand);
+
+    if (icc) {
+        if (rv && icc_len) {
+            rv = MagickSetImageProfile(wand, "ICC", icc, icc_len);
+        }
+        MagickRelinquishMemory(icc);
+    }
+
+    return rv;
+}
+
+/*
+ * Choose the format for the content of the image, and set the content type
+ * to match. Once the headers are sent the format can no longer change, and
+ * the source format is kept.
+ */
+static void magick_format_content(ap_bucket_magick *m, magick_plan *plan,
+        magick_content_e content)
+{
+    request_rec *r = m->r;
+    const char *format;
+    char *mime;
+
+    plan->format_auto = 0;
+
+    if (r->sent_bodyct) {
+        return;
+    }
+
+    switch (content) {
+    case MAGICK_CONTENT_PALETTE:
+        format = "PNG";
+        plan->palette = 1;
+        break;
+    case MAGICK_CONTENT_GRAPHIC:
+        format = plan->format_auto_webp ? "WEBP" : "PNG";
+        plan->lossless = plan->format_auto_webp;
+        break;
+    case MAGICK_CONTENT_PHOTO:
+        format = plan->format_auto_webp ? "WEBP" : "JPEG";
+        break;
+    case MAGICK_CONTENT_PHOTO_ALPHA:
+        format = plan->format_auto_webp ? "WEBP" : "PNG";
+        break;
+    default:
+        return;
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+            "mod_magick: chose format %s for content %d of '%s'", format,
+            content, r->uri);
+
+    if (m->source_format && !strcasecmp(format, m->source_format)) {
+        plan->format = NULL;
+    }
+    else {
+        plan->format = format;
+    }
+
+    mime = MagickToMime(format);
+    ap_set_content_type(r, apr_pstrdup(r->pool, mime));
+    MagickRelinquishMemory(mime);
+}
+
+/*
+ * Optimise the operations added to the bucket into a plan.
+ *
+ * Metadata is stripped first so that no work is wasted on it, conversions
+ * to gray are done before the first resize so that the resize has less
+ * work to do, consecutive resizes are merged into one resize from the
+ * larger image, and operations that change nothing are dropped. Encoding
+ * settings are applied once after all pixel operations, last one wins.
+ */
+static void magick_plan_ops(ap_bucket_magick *m, magick_plan *plan)
+{
+    magick_conf *conf = ap_get_module_config(m->r->per_dir_config,
+            &magick_module);
+    ap_magick_op *last_resize = NULL;
+    unsigned long columns = m->source_columns;
+    unsigned long rows = m->source_rows;
+    ColorspaceType colorspace = m->source_colorspace;
+    const char *output;
+    int i, gray = -1, palette;
+
+    memset(plan, 0, sizeof(*plan));
+    plan->ops = apr_array_make(m->r->pool, m->ops->nelts,
+            sizeof(ap_magick_op *));
+    plan->interlace = UndefinedInterlace;
+
+    /* a conversion to gray after the last resize is done before it */
+    for (i = m->ops->nelts; i > 0;) {
+        ap_magick_op *op = &APR_ARRAY_IDX(m->ops, --i, ap_magick_op);
+
+        if (op->type == AP_MAGICK_OP_COLORSPACE) {
+            if (op->u.colorspace == GRAYColorspace) {
+                gray = i;
+            }
+            break;
+        }
+    }
+
+    for (i = 0; i < m->ops->nelts; i++) {
+        ap_magick_op *op = &APR_ARRAY_IDX(m->ops, i, ap_magick_op);
+
+        switch (op->type) {
+        case AP_MAGICK_OP_RESIZE: {
+            if (gray >= 0 && colorspace != GRAYColorspace) {
+                ap_magick_op *g = &APR_ARRAY_IDX(m->ops, gray, ap_magick_op);
+                APR_ARRAY_PUSH(plan->ops, ap_magick_op *) = g;
+                colorspace = GRAYColorspace;
+                last_resize = NULL;
+            }
+            if (last_resize) {
+                /* merge with the previous resize */
+                last_resize->u.resize = op->u.resize;
+            }
+            else {
+                last_resize = apr_pmemdup(m->r->pool, op, sizeof(*op));
+                APR_ARRAY_PUSH(plan->ops, ap_magick_op *) = last_resize;
+            }
+            columns = op->u.resize.columns;
+            rows = op->u.resize.rows;
+            break;
+        }
+        case AP_MAGICK_OP_STRIP: {
+            plan->strip = 1;
+            plan->keep_icc = op->u.strip.keep_icc;
+            break;
+        }
+        case AP_MAGICK_OP_COLORSPACE: {
+            if (op->u.colorspace != colorspace) {
+                APR_ARRAY_PUSH(plan->ops, ap_magick_op *) = op;
+                colorspace = op->u.colorspace;
+                last_resize = NULL;
+            }
+            break;
+        }
+        case AP_MAGICK_OP_QUALITY: {
+            plan->quality = op->u.quality;
+            plan->quality_set = 1;
+            break;
+        }
+        case AP_MAGICK_OP_INTERLACE: {
+            plan->interlace = op->u.interlace;
+            break;
+        }
+        case AP_MAGICK_OP_FORMAT: {
+            if (m->source_format && !strcasecmp(op->u.format, m->source_format)) {
+                plan->format = NULL;
+            }
+            else {
+                plan->format = op->u.format;
+            }
+            plan->formats = NULL;
+            plan->format_auto = 0;
+            break;
+        }
+        case AP_MAGICK_OP_FORMAT_SMALLEST: {
+            plan->formats = op->u.formats;
+            break;
+        }
+        case AP_MAGICK_OP_TARGET_BYTES: {
+            plan->target_bytes = op->u.target_bytes;
+            break;
+        }
+        case AP_MAGICK_OP_QUALITY_CAP: {
+            plan->quality_cap = op->u.quality_cap;
+            plan->quality_cap_set = 1;
+            break;
+        }
+        case AP_MAGICK_OP_FORMAT_AUTO: {
+            plan->format = NULL;
+            plan->formats = NULL;
+            plan->format_auto = 1;
+            plan->format_auto_webp = op->u.format_auto.webp;
+            break;
+        }
+        }
+    }
+
+    /* the content of the source may already be known */
+    if (plan->format_auto) {
+        unsigned char key[APR_SHA1_DIGESTSIZE];
+        long content;
+
+        if (magick_cache_key(m->r, "content", key)
+                && (content = magick_cache_lookup(m->r, key)) > 0) {
+            magick_format_content(m, plan, (magick_content_e) content);
+        }
+    }
+
+    /* the load is read once, and holds for every encode of the request */
+    if (conf->encoder_load > 0) {
+        ap_loadavg_t load;
+
+        ap_get_loadavg(&load);
+        plan->busy = load.loadavg > conf->encoder_load;
+    }
+
+    /* never encode above the quality the source was saved with */
+    if (plan->quality_set && plan->quality_cap_set && m->source_format
+            && !strcasecmp(m->source_format, "JPEG")) {
+        int estimate = magick_jpeg_quality(m->source, m->source_len);
+        long cap = (long)estimate + plan->quality_cap;
+
+        if (estimate && cap < (long)plan->quality) {
+            ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, m->r,
+                    "mod_magick: source quality estimated at %d, quality "
+                    "capped from %lu to %ld", estimate, plan->quality,
+                    cap < 1 ? 1 : cap);
+            plan->quality = cap < 1 ? 1 : cap;
+        }
+    }
+
+    /* drop resizes that end up where they started */
+    if (last_resize && plan->ops->nelts == 1
+            && columns == m->source_columns && rows == m->source_rows) {
+        apr_array_clear(plan->ops);
+    }
+
+    /* a single PNG may still be written with a palette */
+    output = plan->format ? plan->format : m->source_format;
+    palette = conf->palette && !plan->formats && m->source_frames <= 1
+            && output && !strcasecmp(output, "PNG");
+
+    plan->changed = plan->ops->nelts || plan->quality_set || plan->format
+            || plan->formats || plan->format_auto || plan->palette || palette
+            || (plan->target_bytes && m->source_len > plan->target_bytes);
+}
+
+static void magick_log_exception(request_rec *r, MagickWand *wand,
+        const char *func)
+{
+    char *description;
+    ExceptionType severity;
+
+    description = MagickGetException(wand, &severity);
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_EGENERAL, r,
+            "%s: %s (severity %d)", func, description, severity);
+    MagickRelinquishMemory(description);
+}
+
+/*
+ * Reduce the image in the wand by an integer factor with a box filter, so
+ * that the image is left between two and three times the target size. The
+ * filtered resize that follows then only touches the pixels that matter.
+ * Reductions of less than twice the prescale factor are left alone.
+ */
+static apr_status_t magick_resize_prescale(MagickWand *wand, ap_magick_op *op,
+        const char **func)
+{
+    unsigned long columns = MagickGetImageWidth(wand);
+    unsigned long rows = MagickGetImageHeight(wand);
+    unsigned long factor;
+
+    if (!op->u.resize.columns || !op->u.resize.rows) {
+        return APR_SUCCESS;
+    }
+
+    factor = columns / op->u.resize.columns;
+    if (rows / op->u.resize.rows < factor) {
+        factor = rows / op->u.resize.rows;
+    }
+    factor /= MAGICK_PRESCALE_FACTOR;
+
+    if (factor < 2) {
+        return APR_SUCCESS;
+    }
+
+    if (!MagickScaleImage(wand, (columns + factor - 1) / factor,
+            (rows + factor - 1) / factor)) {
+        *func = "MagickScaleImage";
+        return APR_EGENERAL;
+    }
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Resize the image in the wand with the fixed point engine. Returns
+ * APR_ENOTIMPL if the image or filter is not supported, in which case the
+ * image is untouched and GraphicsMagick must do the resize.
+ */
+static apr_status_t magick_resize_fast(MagickWand *wand, ap_magick_op *op,
+        const char **func)
+{
+    unsigned long columns = MagickGetImageWidth(wand);
+    unsigned long rows = MagickGetImageHeight(wand);
+    ColorspaceType colorspace = MagickGetImageColorspace(wand);
+    const char *map;
+    unsigned char *in, *out;
+    double support;
+    int channels;
+
+    if (MagickGetNumberImages(wand) != 1 || MagickGetImageDepth(wand) > 8
+            || (colorspace != RGBColorspace && colorspace != sRGBColorspace)
+            || !magick_resample_filter(op->u.resize.filter_type, &support)
+            || !columns || !rows) {
+        return APR_ENOTIMPL;
+    }
+
+    if (MagickGetImageMatte(wand)) {
+        map = "RGBA";
+        channels = 4;
+    }
+    else {
+        map = "RGB";
+        channels = 3;
+    }
+
+    in = malloc((apr_size_t)columns * rows * channels);
+    out = malloc((apr_size_t)op->u.resize.columns * op->u.resize.rows
+            * channels);
+    if (!in || !out) {
+        free(in);
+        free(out);
+        return APR_ENOMEM;
+    }
+
+    if (!MagickGetImagePixels(wand, 0, 0, columns, rows, map, CharPixel, in)
+            || !magick_resample(in, columns, rows, out, op->u.resize.columns,
+                    op->u.resize.rows, channels, op->u.resize.filter_type,
+                    op->u.resize.blur)) {
+        free(in);
+        free(out);
+        return APR_ENOTIMPL;
+    }
+    free(in);
+
+    /* sampling is the cheapest way to get a canvas of the right size,
+     * every pixel is then replaced */
+    if (!MagickSampleImage(wand, op->u.resize.columns, op->u.resize.rows)
+            || !MagickSetImagePixels(wand, 0, 0, op->u.resize.columns,
+                    op->u.resize.rows, map, CharPixel, out)) {
+        *func = "MagickSetImagePixels";
+        free(out);
+        return APR_EGENERAL;
+    }
+    free(out);
+
+    return APR_SUCCESS;
+}
+
+/*
+ * The state of a resize made while the source is being decoded. The
+ * GraphicsMagick stream handler has no user data, so the state belonging to
+ * the current thread is found through a thread key.
+ */
+typedef struct magick_stream_ctx {
+    magick_resample_stream resample; /* the resize, row by row */
+    unsigned char *row; /* the decoded row, as RGBA */
+    unsigned char *out; /* the output image, as RGBA */
+    unsigned long in_columns;
+    unsigned long in_rows;
+    int failed; /* the source cannot be streamed */
+} magick_stream_ctx;
+
+static magick_stream_ctx *magick_stream_get(void)
+{
+#if APR_HAS_THREADS
+    void *ctx = NULL;
+
+    if (stream_key) {
+        apr_threadkey_private_get(&ctx, stream_key);
+    }
+    return ctx;
+#else
+    return stream_current;
+#endif
+}
+
+static apr_status_t magick_stream_set(magick_stream_ctx *ctx)
+{
+#if APR_HAS_THREADS
+    if (!stream_key) {
+        return APR_ENOTIMPL;
+    }
+    return apr_threadkey_private_set(ctx, stream_key);
+#else
+    stream_current = ctx;
+    return APR_SUCCESS;
+#endif
+}
+
+/*
+ * Called by the decoder with each row of the source, which is converted to
+ * RGBA and passed to the resize.
+ */
+static unsigned int magick_stream_row(const Image *image, const void *pixels,
+        const size_t columns)
+{
+    magick_stream_ctx *ctx = magick_stream_get();
+    const PixelPacket *p = pixels;
+    unsigned long x;
+
+    if (!ctx || ctx->failed) {
+        return MagickFail;
+    }
+
+    /* rows beyond the first frame are not wanted */
+    if (ctx->resample.y >= ctx->in_rows) {
+        return MagickPass;
+    }
+
+    if (image->columns != ctx->in_columns || image->rows != ctx->in_rows
+            || columns != ctx->in_columns
+            || (image->colorspace != RGBColorspace
+                    && image->colorspace != sRGBColorspace)) {
+        ctx->failed = 1;
+        return MagickFail;
+    }
+
+    for (x = 0; x < columns; x++) {
+        ctx->row[x * 4] = ScaleQuantumToChar(p[x].red);
+        ctx->row[x * 4 + 1] = ScaleQuantumToChar(p[x].green);
+        ctx->row[x * 4 + 2] = ScaleQuantumToChar(p[x].blue);
+        ctx->row[x * 4 + 3] = image->matte ?
+                255 - ScaleQuantumToChar(p[x].opacity) : 255;
+    }
+
+    magick_resample_stream_row(&ctx->resample, ctx->row);
+
+    return MagickPass;
+}
+
+static void magick_stream_free(magick_stream_ctx *ctx)
+{
+    magick_resample_stream_free(&ctx->resample);
+    free(ctx->row);
+    free(ctx->out);
+}
+
+/*
+ * The stream handler is given no row index, and so only sources decoded
+ * once from top to bottom can be streamed. Bottom up BMP images, interlaced
+ * PNG and GIF images, and anything not known to be decoded in order are
+ * decoded in full. JPEG images are already scaled down by the decoder.
+ */
+static int magick_stream_supported(ap_bucket_magick *m)
+{
+    const unsigned char *s = (const unsigned char *)m->source;
+
+    if (!m->source_format) {
+        return 0;
+    }
+
+    /* the interlace method is the last byte of the IHDR chunk */
+    if (!strcasecmp(m->source_format, "PNG")) {
+        return m->source_len > 28 && !memcmp(s, "\x89PNG\r\n\x1a\n", 8)
+                && !memcmp(s + 12, "IHDR", 4) && s[28] == 0;
+    }
+
+    return !strcasecmp(m->source_format, "PPM")
+            || !strcasecmp(m->source_format, "PGM")
+            || !strcasecmp(m->source_format, "PNM");
+}
+
+/*
+ * Resize the source image while it is being decoded, leaving the result in
+ * the wand of the bucket. Only the output image and a window of rows as tall
+ * as the vertical filter are held in memory. Returns APR_ENOTIMPL if the
+ * source cannot be streamed, in which case the wand is untouched and the
+ * source must be decoded in full.
+ */
+static apr_status_t magick_resize_stream(ap_bucket_magick *m, ap_magick_op *op)
+{
+    request_rec *r = m->r;
+    magick_stream_ctx ctx;
+    ExceptionInfo exception;
+    ImageInfo *info;
+    Image *image;
+    const char *map = "RGBA";
+    unsigned long columns = op->u.resize.columns;
+    unsigned long rows = op->u.resize.rows;
+    double support;
+
+    if (!magick_resample_filter(op->u.resize.filter_type, &support)
+            || !magick_stream_supported(m)
+            || !m->source_columns || !m->source_rows
+            || !op->u.resize.columns || !op->u.resize.rows) {
+        return APR_ENOTIMPL;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.in_columns = m->source_columns;
+    ctx.in_rows = m->source_rows;
+
+    ctx.row = malloc((apr_size_t)ctx.in_columns * 4);
+    ctx.out = malloc((apr_size_t)columns * rows * 4);
+    if (!ctx.row || !ctx.out || !magick_resample_stream_make(&ctx.resample,
+            ctx.in_columns, ctx.in_rows, ctx.out, columns, rows,
+            op->u.resize.filter_type, op->u.resize.blur)) {
+        free(ctx.row);
+        free(ctx.out);
+        return APR_ENOMEM;
+    }
+
+    if (magick_stream_set(&ctx) != APR_SUCCESS) {
+        magick_stream_free(&ctx);
+        return APR_ENOTIMPL;
+    }
+
+    info = CloneImageInfo(NULL);
+    apr_snprintf(info->filename, MaxTextExtent, "%s:", m->source_format);
+    info->blob = m->source;
+    info->length = m->source_len;
+
+    GetExceptionInfo(&exception);
+    image = ReadStream(info, magick_stream_row, &exception);
+
+    magick_stream_set(NULL);
+
+    /* the blob belongs to the bucket */
+    info->blob = NULL;
+    info->length = 0;
+    DestroyImageInfo(info);
+
+    if (ctx.failed || ctx.resample.out_y != rows) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                "mod_magick: could not stream %s image of %lux%lu, decoding "
+                "in full: %s", m->source_format, ctx.in_columns, ctx.in_rows,
+                exception.reason ? exception.reason : "unsupported image");
+        if (image) {
+            DestroyImage(image);
+        }
+        DestroyExceptionInfo(&exception);
+        magick_stream_free(&ctx);
+        return APR_ENOTIMPL;
+    }
+
+    /* drop the alpha channel if the source had none */
+    if (image && !image->matte) {
+        apr_size_t i, len = (apr_size_t)columns * rows;
+
+        for (i = 0; i < len; i++) {
+            ctx.out[i * 3] = ctx.out[i * 4];
+            ctx.out[i * 3 + 1] = ctx.out[i * 4 + 1];
+            ctx.out[i * 3 + 2] = ctx.out[i * 4 + 2];
+        }
+        map = "RGB";
+    }
+    if (image) {
+        DestroyImage(image);
+    }
+    DestroyExceptionInfo(&exception);
+
+    ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+            "mod_magick: streamed %s image of %lux%lu to %lux%lu",
+            m->source_format, ctx.in_columns, ctx.in_rows, columns, rows);
+
+    /* read a canvas of the right size, every pixel is then replaced */
+    if (!MagickSetSize(m->wand, columns, rows)
+            || !MagickReadImage(m->wand, map[3] ? "xc:none" : "xc:white")
+            || !MagickSetImagePixels(m->wand, 0, 0, columns, rows,
+                    map, CharPixel, ctx.out)
+            || !MagickSetImageFormat(m->wand, m->source_format)) {
+        magick_log_exception(r, m->wand, "MagickSetImagePixels");
+        magick_stream_free(&ctx);
+        return APR_EGENERAL;
+    }
+
+    magick_stream_free(&ctx);
+
+    return APR_SUCCESS;
+}
+
+#ifdef HAVE_VIPS
+static int magick_vips_kernel(FilterTypes filter_type)
+{
+    switch (filter_type) {
+    case PointFilter:
+        return VIPS_KERNEL_NEAREST;
+    case TriangleFilter:
+        return VIPS_KERNEL_LINEAR;
+    case CubicFilter:
+    case CatromFilter:
+        return VIPS_KERNEL_CUBIC;
+    case MitchellFilter:
+        return VIPS_KERNEL_MITCHELL;
+    case LanczosFilter:
+        return VIPS_KERNEL_LANCZOS3;
+    default:
+        return -1;
+    }
+}
+
+static VipsInterpretation magick_vips_interpretation(ColorspaceType colorspace)
+{
+    switch (colorspace) {
+    case RGBColorspace:
+    case sRGBColorspace:
+        return VIPS_INTERPRETATION_sRGB;
+    case GRAYColorspace:
+        return VIPS_INTERPRETATION_B_W;
+    case CMYKColorspace:
+        return VIPS_INTERPRETATION_CMYK;
+    case XYZColorspace:
+        return VIPS_INTERPRETATION_XYZ;
+    case LABColorspace:
+        return VIPS_INTERPRETATION_LAB;
+    default:
+        return VIPS_INTERPRETATION_ERROR;
+    }
+}
+
+/*
+ * Return the suffix libvips uses to choose the saver for the format, and
+ * whether the saver understands the quality and interlace options.
+ */
+static const char *magick_vips_suffix(const char *format, int *quality,
+        int *interlace)
+{
+    *quality = 0;
+    *interlace = 0;
+
+    if (!strcasecmp(format, "JPEG") || !strcasecmp(format, "JPG")) {
+        *quality = 1;
+        *interlace = 1;
+        return ".jpg";
+    }
+    else if (!strcasecmp(format, "PNG")) {
+        *interlace = 1;
+        return ".png";
+    }
+    else if (!strcasecmp(format, "WEBP")) {
+        *quality = 1;
+        return ".webp";
+    }
+    else if (!strcasecmp(format, "TIFF") || !strcasecmp(format, "TIF")) {
+        *quality = 1;
+        return ".tif";
+    }
+    else if (!strcasecmp(format, "GIF")) {
+        return ".gif";
+    }
+
+    return NULL;
+}
+
+static void magick_vips_unref(VipsImage **image, VipsImage *next)
+{
+    g_object_unref(*image);
+    *image = next;
+}
+
+/*
+ * Decode the source, apply the plan, and encode the result with libvips.
+ * Returns APR_ENOTIMPL if the plan cannot be expressed in libvips, or if
+ * libvips fails, in which case GraphicsMagick must render the image.
+ */
+static apr_status_t magick_render_vips(apr_bucket *b, magick_plan *plan)
+{
+    ap_bucket_magick *m = b->data;
+    request_rec *r = m->r;
+    magick_conf *conf = ap_get_module_config(r->per_dir_config,
+            &magick_module);
+    const char *format = plan->format ? plan->format : m->source_format;
+    const char *suffix, *fail = NULL;
+    VipsImage *image, *next;
+    void *buf = NULL;
+    size_t len = 0;
+    int quality, interlace, i;
+
+    /* options are set on the wand, and only GraphicsMagick understands them */
+    if (!vips_available || !format || apr_hash_count(conf->options)
+            || (plan->strip && plan->keep_icc) || plan->formats
+            || plan->target_bytes || plan->format_auto || plan->palette
+            || plan->lossless) {
+        return APR_ENOTIMPL;
+    }
+
+    /* encoder efforts and palettes are only understood by GraphicsMagick */
+    i = magick_effort_format(format);
+    if ((i >= 0 && conf->effort[i].effort != MAGICK_EFFORT_UNSET)
+            || (conf->palette && i == MAGICK_EFFORT_PNG)) {
+        return APR_ENOTIMPL;
+    }
+
+    suffix = magick_vips_suffix(format, &quality, &interlace);
+    if (!suffix || (plan->quality_set && !quality)
+            || (plan->interlace > NoInterlace && !interlace)) {
+        return APR_ENOTIMPL;
+    }
+
+    for (i = 0; i < plan->ops->nelts; i++) {
+        ap_magick_op *op = APR_ARRAY_IDX(plan->ops, i, ap_magick_op *);
+
+        if (op->type == AP_MAGICK_OP_RESIZE
+                && (op->u.resize.blur != 1.0 || !op->u.resize.columns
+                        || !op->u.resize.rows
+                        || magick_vips_kernel(op->u.resize.filter_type) < 0)) {
+            return APR_ENOTIMPL;
+        }
+        if (op->type == AP_MAGICK_OP_COLORSPACE
+                && magick_vips_interpretation(op->u.colorspace)
+                        == VIPS_INTERPRETATION_ERROR) {
+            return APR_ENOTIMPL;
+        }
+    }
+
+    image = vips_image_new_from_buffer(m->source, m->source_len, "",
+            "access", VIPS_ACCESS_SEQUENTIAL, NULL);
+    if (!image) {
+        fail = "vips_image_new_from_buffer";
+        goto failed;
+    }
+
+    /* all frames of animations are handled by GraphicsMagick */
+    if (vips_image_get_n_pages(image) > 1) {
+        g_object_unref(image);
+        return APR_ENOTIMPL;
+    }
+
+    for (i = 0; i < plan->ops->nelts; i++) {
+        ap_magick_op *op = APR_ARRAY_IDX(plan->ops, i, ap_magick_op *);
+
+        switch (op->type) {
+        case AP_MAGICK_OP_RESIZE: {
+            double hscale = (double)op->u.resize.columns
+                    / vips_image_get_width(image);
+            double vscale = (double)op->u.resize.rows
+                    / vips_image_get_height(image);
+
+            if (vips_resize(image, &next, hscale, "vscale", vscale, "kernel",
+                    magick_vips_kernel(op->u.resize.filter_type), NULL)) {
+                fail = "vips_resize";
+                goto failed;
+            }
+            magick_vips_unref(&image, next);
+
+            if ((unsigned long)vips_image_get_width(image)
+                            != op->u.resize.columns
+                    || (unsigned long)vips_image_get_height(image)
+                            != op->u.resize.rows) {
+                fail = "vips_resize";
+                goto failed;
+            }
+            break;
+        }
+        case AP_MAGICK_OP_COLORSPACE: {
+            if (vips_colourspace(image, &next,
+                    magick_vips_interpretation(op->u.colorspace), NULL)) {
+                fail = "vips_colourspace";
+                goto failed;
+            }
+            magick_vips_unref(&image, next);
+            break;
+        }
+        default: {
+            break;
+        }
+        }
+    }
+
+    suffix = apr_psprintf(r->pool, "%s[%s%s%s]", suffix,
+            plan->quality_set ? apr_psprintf(r->pool, "Q=%lu,",
+                    plan->quality) : "",
+            plan->strip ? "strip," : "",
+            plan->interlace > NoInterlace ? "interlace," : "");
+
+    if (vips_image_write_to_buffer(image, suffix, &buf, &len, NULL)) {
+        fail = "vips_image_write_to_buffer";
+        goto failed;
+    }
+    g_object_unref(image);
+
+    /* the bucket releases the image with MagickRelinquishMemory */
+    m->base = MagickMalloc(len);
+    if (!m->base) {
+        g_free(buf);
+        return APR_ENOMEM;
+    }
+    memcpy(m->base, buf, len);
+    b->length = len;
+    g_free(buf);
+
+    ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+            "mod_magick: rendered %s image with libvips as %s",
+            m->source_format, suffix);
+
+    return APR_SUCCESS;
+
+failed:
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+            "mod_magick: %s failed, rendering with GraphicsMagick: %s",
+            fail, vips_error_buffer());
+    vips_error_clear();
+    if (image) {
+        g_object_unref(image);
+    }
+
+    return APR_ENOTIMPL;
+}
+#endif
+
+/*
+ * Apply the pixel operations of the plan from the given operation onwards
+ * to the current image of the wand. Nothing is logged, as this may be run
+ * on a worker thread, instead the name of the function that failed is
+ * returned so that the exception can be logged against the request.
+ */
+static apr_status_t magick_apply_ops(MagickWand *wand, magick_plan *plan,
+        int from, const char **func)
+{
+    int i;
+
+    for (i = from; i < plan->ops->nelts; i++) {
+        ap_magick_op *op = APR_ARRAY_IDX(plan->ops, i, ap_magick_op *);
+
+        switch (op->type) {
+        case AP_MAGICK_OP_RESIZE: {
+            if (op->u.resize.strategy == AP_MAGICK_RESIZE_STRATEGY_AUTO) {
+                apr_status_t rv = magick_resize_prescale(wand, op, func);
+
+                if (rv != APR_SUCCESS) {
+                    return rv;
+                }
+            }
+            if (op->u.resize.engine == AP_MAGICK_RESIZE_ENGINE_FAST) {
+                apr_status_t rv = magick_resize_fast(wand, op, func);
+
+                if (rv == APR_SUCCESS) {
+                    break;
+                }
+                else if (rv != APR_ENOTIMPL) {
+                    return rv;
+                }
+            }
+            if (!MagickResizeImage(wand, op->u.resize.columns,
+                    op->u.resize.rows, op->u.resize.filter_type,
+                    op->u.resize.blur)) {
+                *func = "MagickResizeImage";
+                return APR_EGENERAL;
+            }
+            break;
+        }
+        case AP_MAGICK_OP_COLORSPACE: {
+            if (!MagickSetImageColorspace(wand, op->u.colorspace)) {
+                *func = "MagickSetImageColorspace";
+                return APR_EGENERAL;
+            }
+            break;
+        }
+        default: {
+            break;
+        }
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+typedef struct magick_frames {
+    magick_plan *plan; /* the plan to apply to each frame */
+    int from; /* the first operation to apply */
+    int quantize; /* reduce each frame to a palette */
+    int pending; /* frames not yet done */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+#endif
+} magick_frames;
+
+typedef struct magick_frame {
+    magick_frames *frames; /* the frames this frame belongs to */
+    MagickWand *wand; /* the frame, coalesced */
+    const char *func; /* the function that failed, if any */
+    apr_status_t rv;
+} magick_frame;
+
+static void *APR_THREAD_FUNC magick_frame_run(apr_thread_t *thd, void *data)
+{
+    magick_frame *frame = data;
+    magick_frames *frames = frame->frames;
+
+    frame->rv = magick_apply_ops(frame->wand, frames->plan, frames->from,
+            &frame->func);
+
+    if (frame->rv == APR_SUCCESS && frames->quantize
+            && !MagickQuantizeImage(frame->wand, 256, RGBColorspace, 0, 1, 0)) {
+        frame->func = "MagickQuantizeImage";
+        frame->rv = APR_EGENERAL;
+    }
+
+#if APR_HAS_THREADS
+    if (frames->mutex) {
+        apr_thread_mutex_lock(frames->mutex);
+        if (!--frames->pending) {
+            apr_thread_cond_signal(frames->cond);
+        }
+        apr_thread_mutex_unlock(frames->mutex);
+        return NULL;
+    }
+#endif
+
+    frames->pending--;
+
+    return NULL;
+}
+
+/*
+ * Can each frame be drawn over the frame before it without clearing the
+ * canvas in between? Not if a pixel turns from opaque to transparent, which
+ * a difference frame cannot draw. Returns zero if the pixels could not be
+ * read.
+ */
+static int magick_frames_overlaid(magick_frame *frame, unsigned long count)
+{
+    unsigned long columns = MagickGetImageWidth(frame[0].wand);
+    unsigned long rows = MagickGetImageHeight(frame[0].wand);
+    unsigned char *prev, *next;
+    unsigned long i, y;
+    int overlaid = 1;
+
+    prev = malloc((apr_size_t)columns * 4);
+    next = malloc((apr_size_t)columns * 4);
+    if (!prev || !next) {
+        free(prev);
+        free(next);
+        return 0;
+    }
+
+    for (i = 1; i < count && overlaid; i++) {
+        if (MagickGetImageWidth(frame[i].wand) != columns
+                || MagickGetImageHeight(frame[i].wand) != rows) {
+            overlaid = 0;
+            break;
+        }
+
+        for (y = 0; y < rows && overlaid; y++) {
+            overlaid = MagickGetImagePixels(frame[i - 1].wand, 0, y, columns,
+                    1, "RGBA", CharPixel, prev)
+                    && MagickGetImagePixels(frame[i].wand, 0, y, columns, 1,
+                            "RGBA", CharPixel, next)
+                    && magick_frames_overlay(prev, next, columns);
+        }
+    }
+
+    free(prev);
+    free(next);
+
+    return overlaid;
+}
+
+/*
+ * Apply the plan to every frame of an animation. The animation is coalesced
+ * so that each frame stands alone, the frames are resized and quantized in
+ * parallel on the frame thread pool, and the frames are optimised again by
+ * keeping only the area that differs from the previous frame. Transparent
+ * animations in which a pixel turns transparent cannot be optimised this
+ * way, and their whole frames are written, each clearing the canvas.
+ */
+static apr_status_t magick_apply_frames(apr_bucket *b, magick_plan *plan,
+        int from)
+{
+    ap_bucket_magick *m = b->data;
+    request_rec *r = m->r;
+    const char *format = plan->format ? plan->format : m->source_format;
+    magick_frames frames = { 0 };
+    magick_frame *frame;
+    MagickWand *coalesced, *optimised;
+    apr_status_t rv = APR_SUCCESS;
+    unsigned long count, i;
+
+    coalesced = MagickCoalesceImages(m->wand);
+    if (!coalesced) {
+        magick_log_exception(r, m->wand, "MagickCoalesceImages");
+        return APR_EGENERAL;
+    }
+
+    count = MagickGetNumberImages(coalesced);
+    frame = apr_pcalloc(r->pool, count * sizeof(magick_frame));
+
+    frames.plan = plan;
+    frames.from = from;
+    frames.quantize = format && !strcasecmp(format, "GIF");
+    frames.pending = count;
+
+    for (i = 0; i < count; i++) {
+        frame[i].frames = &frames;
+        if (!MagickSetImageIndex(coalesced, i)
+                || !(frame[i].wand = MagickGetImage(coalesced))) {
+            magick_log_exception(r, coalesced, "MagickGetImage");
+            rv = APR_EGENERAL;
+            break;
+        }
+    }
+    DestroyMagickWand(coalesced);
+
+    if (rv == APR_SUCCESS) {
+#if APR_HAS_THREADS
+        if (frame_pool && count > 1
+                && apr_thread_mutex_create(&frames.mutex,
+                        APR_THREAD_MUTEX_DEFAULT, r->pool) == APR_SUCCESS
+                && apr_thread_cond_create(&frames.cond, r->pool)
+                        == APR_SUCCESS) {
+
+            for (i = 0; i < count; i++) {
+                if (apr_thread_pool_push(frame_pool, magick_frame_run,
+                        &frame[i], APR_THREAD_TASK_PRIORITY_NORMAL, &frames)
+                        != APR_SUCCESS) {
+                    magick_frame_run(NULL, &frame[i]);
+                }
+            }
+
+            apr_thread_mutex_lock(frames.mutex);
+            while (frames.pending) {
+                apr_thread_cond_wait(frames.cond, frames.mutex);
+            }
+            apr_thread_mutex_unlock(frames.mutex);
+        }
+        else
+#endif
+        {
+#if APR_HAS_THREADS
+            frames.mutex = NULL;
+#endif
+            for (i = 0; i < count; i++) {
+                magick_frame_run(NULL, &frame[i]);
+            }
+        }
+
+        for (i = 0; i < count; i++) {
+            if (frame[i].rv != APR_SUCCESS) {
+                if (frame[i].func) {
+                    magick_log_exception(r, frame[i].wand, frame[i].func);
+                }
+                rv = frame[i].rv;
+                break;
+            }
+        }
+    }
+
+    /* replace the frames of the wand, keeping the options set on it */
+    if (rv == APR_SUCCESS) {
+        MagickWand *wand = NewMagickWand();
+        DisposeType dispose = NoneDispose;
+
+        ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+                "mod_magick: applied %d operations to %lu frames",
+                plan->ops->nelts - from, count);
+
+        for (i = 0; i < count; i++) {
+            MagickAddImage(wand, frame[i].wand);
+        }
+
+        if (m->source_matte && !magick_frames_overlaid(frame, count)) {
+            ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+                    "mod_magick: pixels turn transparent, frames not "
+                    "optimised");
+            /* the whole frames are written as they are */
+            optimised = wand;
+            wand = NULL;
+            dispose = BackgroundDispose;
+        }
+        else {
+            optimised = MagickDeconstructImages(wand);
+        }
+
+        if (!optimised) {
+            magick_log_exception(r, wand, "MagickDeconstructImages");
+            rv = APR_EGENERAL;
+        }
+        else {
+            /* each difference frame is drawn over the one before it, and
+             * the canvas must not be cleared or restored in between, while
+             * each whole frame is drawn over a cleared canvas */
+            for (i = 0; i < MagickGetNumberImages(optimised); i++) {
+                if (!MagickSetImageIndex(optimised, i)
+                        || !MagickSetImageDispose(optimised, dispose)) {
+                    magick_log_exception(r, optimised, "MagickSetImageDispose");
+                    rv = APR_EGENERAL;
+                    break;
+                }
+            }
+
+            while (rv == APR_SUCCESS && MagickGetNumberImages(m->wand)
+                    && MagickSetImageIndex(m->wand, 0)
+                    && MagickRemoveImage(m->wand));
+            if (rv == APR_SUCCESS && !MagickAddImage(m->wand, optimised)) {
+                magick_log_exception(r, m->wand, "MagickAddImage");
+                rv = APR_EGENERAL;
+            }
+            DestroyMagickWand(optimised);
+        }
+        if (wand) {
+            DestroyMagickWand(wand);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (frame[i].wand) {
+            DestroyMagickWand(frame[i].wand);
+        }
+    }
+
+    return rv;
+}
+
+/*
+ * Set the encoder effort configured for the format on the wand. PNG has no
+ * effort of its own, the compression quality sets the zlib level and row
+ * filter instead, so the quality of the plan is put back for other formats.
+ */
+static apr_status_t magick_encoder_effort(MagickWand *wand,
+        magick_conf *conf, magick_plan *plan, const char *format,
+        const char **func)
+{
+    int slot = magick_effort_format(format);
+    magick_effort_e effort;
+
+    if (slot != MAGICK_EFFORT_PNG
+            && conf->effort[MAGICK_EFFORT_PNG].effort != MAGICK_EFFORT_UNSET
+            && !MagickSetCompressionQuality(wand, plan->quality_set ?
+                    plan->quality : MAGICK_DEFAULT_QUALITY)) {
+        *func = "MagickSetCompressionQuality";
+        return APR_EGENERAL;
+    }
+
+    if (slot < 0 || conf->effort[slot].effort == MAGICK_EFFORT_UNSET) {
+        return APR_SUCCESS;
+    }
+
+    effort = plan->busy ? conf->effort[slot].busy_effort
+            : conf->effort[slot].effort;
+
+    switch (slot) {
+    case MAGICK_EFFORT_PNG: {
+        /* zlib level in the tens, row filter in the units */
+        if (!MagickSetCompressionQuality(wand,
+                effort == MAGICK_EFFORT_FAST ? 10 :
+                effort == MAGICK_EFFORT_BEST ? 95 : 75)) {
+            *func = "MagickSetCompressionQuality";
+            return APR_EGENERAL;
+        }
+        break;
+    }
+    case MAGICK_EFFORT_WEBP: {
+        if (!MagickSetImageOption(wand, "webp", "method",
+                effort == MAGICK_EFFORT_FAST ? "1" :
+                effort == MAGICK_EFFORT_BEST ? "6" : "4")) {
+            *func = "MagickSetImageOption";
+            return APR_EGENERAL;
+        }
+        break;
+    }
+    case MAGICK_EFFORT_JPEG: {
+        if (!MagickSetImageOption(wand, "jpeg", "optimize-coding",
+                effort == MAGICK_EFFORT_FAST ? "false" : "true")) {
+            *func = "MagickSetImageOption";
+            return APR_EGENERAL;
+        }
+        break;
+    }
+    }
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Count the colors of the image, including the alpha channel, stopping once
+ * there are more than the limit. Fully transparent pixels count as a single
+ * color. Returns the number of colors, or limit + 1 if there are more, or
+ * zero if the pixels could not be read.
+ */
+static unsigned long magick_palette_count(MagickWand *wand,
+        unsigned long limit, int *alpha)
+{
+    unsigned long columns = MagickGetImageWidth(wand);
+    unsigned long rows = MagickGetImageHeight(wand);
+    unsigned long count = 0, y;
+    magick_colors colors;
+    unsigned char *row;
+
+    *alpha = 0;
+
+    row = malloc((apr_size_t)columns * 4);
+    if (!row || !magick_colors_make(&colors, limit)) {
+        free(row);
+        return 0;
+    }
+
+    for (y = 0; y < rows && count <= limit; y++) {
+
+        if (!MagickGetImagePixels(wand, 0, y, columns, 1, "RGBA", CharPixel,
+                row)) {
+            count = 0;
+            break;
+        }
+
+        count = magick_colors_add(&colors, row, columns);
+    }
+
+    *alpha = colors.alpha;
+
+    magick_colors_free(&colors);
+    free(row);
+
+    return count;
+}
+
+/*
+ * Set the hidden color of fully transparent pixels to black, so that they
+ * are a single color to the quantizer just as they are to
+ * magick_palette_count(). Only the rows that change are written back.
+ * Returns zero if the pixels could not be read or written.
+ */
+static unsigned int magick_palette_clear(MagickWand *wand)
+{
+    unsigned long columns = MagickGetImageWidth(wand);
+    unsigned long rows = MagickGetImageHeight(wand);
+    unsigned long y;
+    unsigned char *row;
+    unsigned int rv = 1;
+
+    row = malloc((apr_size_t)columns * 4);
+    if (!row) {
+        return 0;
+    }
+
+    for (y = 0; y < rows && rv; y++) {
+
+        if (!MagickGetImagePixels(wand, 0, y, columns, 1, "RGBA", CharPixel,
+                row)) {
+            rv = 0;
+            break;
+        }
+
+        if (magick_colors_clear(row, columns)
+                && !MagickSetImagePixels(wand, 0, y, columns, 1, "RGBA",
+                        CharPixel, row)) {
+            rv = 0;
+        }
+    }
+
+    free(row);
+
+    return rv;
+}
+
+/*
+ * Reduce a PNG image with few colors to a palette, so that it is written as
+ * an 8 bit palette image. Images with more colors than fit in a palette, up
+ * to the lossy limit, are quantized to a palette. Images with too many colors
+ * are left as they are. The colors are counted here unless they were
+ * already counted into the plan, and fit a palette.
+ */
+static apr_status_t magick_palette(request_rec *r, magick_conf *conf,
+        magick_plan *plan, MagickWand *wand, const char **func)
+{
+    unsigned long limit = conf->palette_lossy > MAGICK_PALETTE_COLORS ?
+            conf->palette_lossy : MAGICK_PALETTE_COLORS;
+    unsigned long count;
+    int alpha;
+
+    if (plan->palette_colors && plan->palette_colors <= MAGICK_PALETTE_COLORS) {
+        count = plan->palette_colors;
+        alpha = plan->palette_alpha;
+    }
+    else {
+        count = magick_palette_count(wand, limit, &alpha);
+    }
+    if (!count || count > limit) {
+        ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+                "mod_magick: more than %lu colors, palette not used", limit);
+        return APR_SUCCESS;
+    }
+
+    if (alpha && !magick_palette_clear(wand)) {
+        *func = "MagickSetImagePixels";
+        return APR_EGENERAL;
+    }
+
+    /* a full depth tree keeps every color when they all fit */
+    if (!MagickQuantizeImage(wand, count < MAGICK_PALETTE_COLORS ? count
+            : MAGICK_PALETTE_COLORS, RGBColorspace,
+            count > MAGICK_PALETTE_COLORS ? 0 : 8, 0, 0)) {
+        *func = "MagickQuantizeImage";
+        return APR_EGENERAL;
+    }
+
+    if (!MagickSetImageType(wand, alpha ? PaletteMatteType : PaletteType)) {
+        *func = "MagickSetImageType";
+        return APR_EGENERAL;
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+            "mod_magick: %s %lu colors to a palette%s",
+            count > MAGICK_PALETTE_COLORS ? "quantized" : "reduced", count,
+            alpha ? " with alpha" : "");
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Classify the content of the image from cheap statistics: the presence of
+ * alpha, the number of colors up to a palette, and across a sample of rows
+ * the share of neighbouring pixels that are flat, and the share of the
+ * changes between them that are sharp edges rather than gradients. The
+ * colors counted are returned, so that a palette need not count them again.
+ */
+static magick_content_e magick_content_classify(request_rec *r,
+        MagickWand *wand, unsigned long *colors, int *alpha)
+{
+    unsigned long columns = MagickGetImageWidth(wand);
+    unsigned long rows = MagickGetImageHeight(wand);
+    unsigned long step = rows > MAGICK_AUTO_ROWS ? rows / MAGICK_AUTO_ROWS : 1;
+    magick_content_stats stats;
+    unsigned long y;
+    unsigned char *row;
+
+    *colors = magick_palette_count(wand, MAGICK_PALETTE_COLORS, alpha);
+    if (*colors && *colors <= MAGICK_PALETTE_COLORS) {
+        return MAGICK_CONTENT_PALETTE;
+    }
+
+    row = malloc((apr_size_t)columns * 3);
+    if (!row) {
+        return *alpha ? MAGICK_CONTENT_PHOTO_ALPHA : MAGICK_CONTENT_PHOTO;
+    }
+
+    memset(&stats, 0, sizeof(stats));
+
+    for (y = 0; y < rows; y += step) {
+
+        if (!MagickGetImagePixels(wand, 0, y, columns, 1, "RGB", CharPixel,
+                row)) {
+            break;
+        }
+
+        magick_content_add(&stats, row, columns);
+    }
+
+    free(row);
+
+    ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+            "mod_magick: content has %s alpha, more than %d colors, %"
+            APR_UINT64_T_FMT " of %" APR_UINT64_T_FMT " pairs flat and %"
+            APR_UINT64_T_FMT " edges", *alpha ? "an" : "no",
+            MAGICK_PALETTE_COLORS, stats.flat, stats.pairs, stats.edges);
+
+    return magick_content_choose(&stats, *alpha);
+}
+
+/*
+ * Choose the format from the content of the rendered image, and remember
+ * the content of the source for later renders.
+ */
+static void magick_format_auto(apr_bucket *b, magick_plan *plan)
+{
+    ap_bucket_magick *m = b->data;
+    unsigned char key[APR_SHA1_DIGESTSIZE];
+    magick_content_e content;
+
+    /* animations keep their format */
+    if (MagickGetNumberImages(m->wand) != 1) {
+        plan->format_auto = 0;
+        return;
+    }
+
+    content = magick_content_classify(m->r, m->wand, &plan->palette_colors,
+            &plan->palette_alpha);
+
+    if (magick_cache_key(m->r, "content", key)) {
+        magick_cache_store(m->r, key, content);
+    }
+
+    magick_format_content(m, plan, content);
+}
+
+/*
+ * Encode the image in each of the candidate formats, and keep the smallest,
+ * setting the content type to match. Formats that fail to encode are
+ * skipped.
+ */
+static apr_status_t magick_write_smallest(apr_bucket *b, magick_plan *plan)
+{
+    ap_bucket_magick *m = b->data;
+    request_rec *r = m->r;
+    magick_conf *conf = ap_get_module_config(r->per_dir_config,
+            &magick_module);
+    const char *best = NULL;
+    char *mime;
+    int i;
+
+    for (i = 0; i < plan->formats->nelts; i++) {
+        const char *format = APR_ARRAY_IDX(plan->formats, i, const char *);
+        const char *func = NULL;
+        unsigned char *blob;
+        size_t len;
+
+        if (magick_encoder_effort(m->wand, conf, plan, format, &func)
+                != APR_SUCCESS) {
+            magick_log_exception(r, m->wand, func);
+            continue;
+        }
+
+        if (!MagickSetImageFormat(m->wand, format)
+                || !(blob = MagickWriteImageBlob(m->wand, &len))) {
+            magick_log_exception(r, m->wand, "MagickWriteImageBlob");
+            continue;
+        }
+
+        ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+                "mod_magick: encoded %s as %" APR_SIZE_T_FMT " bytes",
+                format, (apr_size_t)len);
+
+        if (!best || len < b->length) {
+            if (m->base) {
+                MagickRelinquishMemory(m->base);
+            }
+            m->base = (char *)blob;
+            b->length = len;
+            best = format;
+        }
+        else {
+            MagickRelinquishMemory(blob);
+        }
+    }
+
+    if (!best) {
+        return APR_EGENERAL;
+    }
+
+    mime = MagickToMime(best);
+    ap_set_content_type(r, apr_pstrdup(r->pool, mime));
+    MagickRelinquishMemory(mime);
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Is the quality of the format a trade of fidelity against size?
+ */
+static int magick_target_lossy(const char *format)
+{
+    return !strcasecmp(format, "JPEG") || !strcasecmp(format, "JPG")
+            || !strcasecmp(format, "WEBP") || !strcasecmp(format, "JP2");
+}
+
+/*
+ * Predict the quality at which the image encodes within the target. A
+ * typical photograph encodes in about two bits per pixel at quality 75, and
+ * the size roughly doubles for every fifteen steps of quality.
+ */
+static long magick_target_predict(apr_size_t target, unsigned long columns,
+        unsigned long rows, long lo, long hi)
+{
+    double bpp = (double)target * 8 / ((double)columns * rows);
+    long quality = (long)(75 + 15 * log(bpp / 2) / log(2));
+
+    return quality < lo ? lo : quality > hi ? hi : quality;
+}
+
+/*
+ * Search for the highest quality at which the image encodes within the
+ * target, starting from the cached or predicted quality and halving the
+ * range after each trial encode. If no trial fits, the smallest encode is
+ * kept.
+ */
+static apr_status_t magick_write_target(apr_bucket *b, magick_plan *plan,
+        const char *format)
+{
+    ap_bucket_magick *m = b->data;
+    request_rec *r = m->r;
+    unsigned char key[APR_SHA1_DIGESTSIZE];
+    unsigned char *best = NULL, *smallest = NULL;
+    size_t best_len = 0, smallest_len = 0;
+    unsigned long columns = MagickGetImageWidth(m->wand);
+    unsigned long rows = MagickGetImageHeight(m->wand);
+    long lo = MAGICK_TARGET_QUALITY_MIN, hi, quality, best_quality = -1;
+    int keyed, cached = 0, trials;
+
+    hi = plan->quality_set ? (long)plan->quality : MAGICK_TARGET_QUALITY_MAX;
+    if (hi < lo) {
+        lo = hi;
+    }
+
+    keyed = magick_cache_key(r, apr_psprintf(r->pool, "target:%s:%lux%lu:%"
+            APR_SIZE_T_FMT ":%ld", format, columns, rows, plan->target_bytes,
+            hi), key);
+
+    quality = keyed ? magick_cache_lookup(r, key) : -1;
+    if (quality >= lo && quality <= hi) {
+        cached = 1;
+    }
+    else if (columns && rows) {
+        quality = magick_target_predict(plan->target_bytes, columns, rows,
+                lo, hi);
+    }
+    else {
+        quality = hi;
+    }
+
+    for (trials = 0; trials < MAGICK_TARGET_TRIALS && lo <= hi; trials++) {
+        unsigned char *blob;
+        size_t len;
+
+        if (!MagickSetCompressionQuality(m->wand, quality)
+                || !(blob = MagickWriteImageBlob(m->wand, &len))) {
+            magick_log_exception(r, m->wand, "MagickWriteImageBlob");
+            if (best) {
+                MagickRelinquishMemory(best);
+            }
+            if (smallest) {
+                MagickRelinquishMemory(smallest);
+            }
+            return APR_EGENERAL;
+        }
+
+        ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+                "mod_magick: encoded %s at quality %ld as %" APR_SIZE_T_FMT
+                " bytes, target %" APR_SIZE_T_FMT, format, quality,
+                (apr_size_t)len, plan->target_bytes);
+
+        if (len <= plan->target_bytes) {
+            if (best) {
+                MagickRelinquishMemory(best);
+            }
+            best = blob;
+            best_len = len;
+            best_quality = quality;
+            lo = quality + 1;
+
+            /* a cached quality that still fits ends the search */
+            if (cached) {
+                break;
+            }
+        }
+        else {
+            if (!smallest || len < smallest_len) {
+                if (smallest) {
+                    MagickRelinquishMemory(smallest);
+                }
+                smallest = blob;
+                smallest_len = len;
+            }
+            else {
+                MagickRelinquishMemory(blob);
+            }
+            hi = quality - 1;
+        }
+
+        cached = 0;
+        quality = lo + (hi - lo) / 2;
+    }
+
+    if (best) {
+        if (smallest) {
+            MagickRelinquishMemory(smallest);
+        }
+        m->base = (char *)best;
+        b->length = best_len;
+
+        if (keyed) {
+            magick_cache_store(r, key, best_quality);
+        }
+    }
+    else {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                "mod_magick: could not encode %s within %" APR_SIZE_T_FMT
+                " bytes after %d trials, sending %" APR_SIZE_T_FMT " bytes",
+                format, plan->target_bytes, trials, (apr_size_t)smallest_len);
+        m->base = (char *)smallest;
+        b->length = smallest_len;
+    }
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Decode the source, apply the plan, and encode the result.
+ */
+static apr_status_t magick_render(apr_bucket *b, magick_plan *plan)
+{
+    ap_bucket_magick *m = b->data;
+    request_rec *r = m->r;
+    magick_conf *conf = ap_get_module_config(r->per_dir_config,
+            &magick_module);
+    int i = 0;
+
+#ifdef HAVE_VIPS
+    if (conf->engine == MAGICK_ENGINE_VIPS) {
+        apr_status_t rv = magick_render_vips(b, plan);
+
+        if (rv != APR_ENOTIMPL) {
+            return rv;
+        }
+    }
+#endif
+
+    /* resize huge images while decoding, if nothing needs the metadata */
+    if (conf->stream_threshold && plan->ops->nelts
+            && plan->strip && !plan->keep_icc
+            && (apr_uint64_t)m->source_columns * m->source_rows
+                    > conf->stream_threshold) {
+        ap_magick_op *op = APR_ARRAY_IDX(plan->ops, 0, ap_magick_op *);
+
+        if (op->type == AP_MAGICK_OP_RESIZE) {
+            apr_status_t rv = magick_resize_stream(m, op);
+
+            if (rv == APR_SUCCESS) {
+                i = 1;
+            }
+            else if (rv != APR_ENOTIMPL) {
+                return rv;
+            }
+        }
+    }
+
+    /* let the decoder scale down JPEG images while decoding */
+    if (!i && plan->ops->nelts && m->source_format
+            && !strcasecmp(m->source_format, "JPEG")) {
+        ap_magick_op *op = APR_ARRAY_IDX(plan->ops, 0, ap_magick_op *);
+
+        if (op->type == AP_MAGICK_OP_RESIZE) {
+            MagickSetSize(m->wand, op->u.resize.columns, op->u.resize.rows);
+        }
+    }
+
+    if (!i && !MagickReadImageBlob(m->wand, m->source, m->source_len)) {
+        magick_log_exception(r, m->wand, "MagickReadImageBlob");
+        magick_failure_store(r, conf, APR_EGENERAL);
+
+        return APR_EGENERAL;
+    }
+
+    if (plan->strip && !magick_strip_wand(m->wand, plan->keep_icc)) {
+        magick_log_exception(r, m->wand, "MagickStripImage");
+        return APR_EGENERAL;
+    }
+
+    if (i < plan->ops->nelts && MagickGetNumberImages(m->wand) > 1) {
+        apr_status_t rv = magick_apply_frames(b, plan, i);
+
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+    }
+    else if (i < plan->ops->nelts) {
+        const char *func = NULL;
+        apr_status_t rv = magick_apply_ops(m->wand, plan, i, &func);
+
+        if (rv != APR_SUCCESS) {
+            if (func) {
+                magick_log_exception(r, m->wand, func);
+            }
+            return rv;
+        }
+    }
+
+    if (plan->format_auto) {
+        magick_format_auto(b, plan);
+    }
+
+    if (plan->lossless
+            && !MagickSetImageOption(m->wand, "webp", "lossless", "true")) {
+        magick_log_exception(r, m->wand, "MagickSetImageOption");
+        return APR_EGENERAL;
+    }
+
+    if (plan->quality_set
+            && !MagickSetCompressionQuality(m->wand, plan->quality)) {
+        magick_log_exception(r, m->wand, "MagickSetCompressionQuality");
+        return APR_EGENERAL;
+    }
+
+    if (plan->interlace != UndefinedInterlace
+            && !MagickSetInterlaceScheme(m->wand, plan->interlace)) {
+        magick_log_exception(r, m->wand, "MagickSetInterlaceScheme");
+        return APR_EGENERAL;
+    }
+
+    if (plan->format && !MagickSetImageFormat(m->wand, plan->format)) {
+        magick_log_exception(r, m->wand, "MagickSetImageFormat");
+        return APR_EGENERAL;
+    }
+
+    /* the winner can only be chosen while the headers are unsent */
+    if (plan->formats && !r->sent_bodyct) {
+        return magick_write_smallest(b, plan);
+    }
+
+    if ((conf->palette || plan->palette) && !plan->formats
+            && MagickGetNumberImages(m->wand) == 1) {
+        const char *format = plan->format ? plan->format : m->source_format;
+        const char *func = NULL;
+
+        if (format && !strcasecmp(format, "PNG")
+                && magick_palette(r, conf, plan, m->wand, &func)
+                        != APR_SUCCESS) {
+            magick_log_exception(r, m->wand, func);
+            return APR_EGENERAL;
+        }
+    }
+
+    if (plan->format || m->source_format) {
+        const char *func = NULL;
+
+        if (magick_encoder_effort(m->wand, conf, plan,
+                plan->format ? plan->format : m->source_format, &func)
+                != APR_SUCCESS) {
+            magick_log_exception(r, m->wand, func);
+            return APR_EGENERAL;
+        }
+    }
+
+    if (plan->target_bytes && !plan->formats) {
+        const char *format = plan->format ? plan->format : m->source_format;
+
+        if (format && magick_target_lossy(format)) {
+            return magick_write_target(b, plan, format);
+        }
+    }
+
+    m->base = (char *)MagickWriteImageBlob(m->wand, &b->length);
+    if (!m->base) {
+        magick_log_exception(r, m->wand, "MagickWriteImageBlob");
+        return APR_EGENERAL;
+    }
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Write the rendered image to an unlinked temporary file, so that the
+ * memory can be returned straight away and the image sent with sendfile.
+ */
+static apr_status_t magick_spill(request_rec *r, const char *data,
+        apr_size_t len, apr_file_t **fd)
+{
+    const char *tmpdir;
+    char *template;
+    apr_int32_t flags = APR_FOPEN_CREATE | APR_FOPEN_READ | APR_FOPEN_WRITE
+            | APR_FOPEN_EXCL | APR_FOPEN_BINARY | APR_FOPEN_SENDFILE_ENABLED;
+    apr_status_t rv;
+
+    rv = apr_temp_dir_get(&tmpdir, r->pool);
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r,
+                "MagickSpillThreshold: could not find a temporary directory");
+        return rv;
+    }
+
+    template = apr_pstrcat(r->pool, tmpdir, "/magick.XXXXXX", NULL);
+
+#ifdef WIN32
+    flags |= APR_FOPEN_DELONCLOSE;
+#endif
+
+    rv = apr_file_mktemp(fd, template, flags, r->pool);
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r,
+                "MagickSpillThreshold: could not create temporary file '%s'",
+                template);
+        return rv;
+    }
+
+#ifndef WIN32
+    /* unlink now, the file goes away when the last descriptor is closed */
+    apr_file_remove(template, r->pool);
+#endif
+
+    rv = apr_file_write_full(*fd, data, len, NULL);
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r,
+                "MagickSpillThreshold: could not write temporary file '%s'",
+                template);
+        apr_file_close(*fd);
+        return rv;
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t magick_bucket_read(apr_bucket *b, const char **str,
+                                       apr_size_t *len, apr_read_type_e block)
+{
+    ap_bucket_magick *m = b->data;
+
+    if (m->wand) {
+        magick_conf *conf = ap_get_module_config(m->r->per_dir_config,
+                &magick_module);
+        magick_plan plan;
+
+        magick_plan_ops(m, &plan);
+
+        if (!plan.changed && (plan.strip
+                || plan.interlace != UndefinedInterlace)) {
+            /* only metadata or interlacing to change, try do it without
+             * rendering */
+            if (plan.interlace == UndefinedInterlace) {
+                m->base = magick_strip_source(m, plan.keep_icc, &b->length);
+            }
+#ifdef HAVE_LIBJPEG
+            else {
+                m->base = magick_transcode_jpeg(m, plan.strip, plan.keep_icc,
+                        plan.interlace, &b->length);
+            }
+#endif
+            if (!m->base) {
+                plan.changed = 1;
+            }
+        }
+
+        if (m->base) {
+            /* already transcoded */
+        }
+        else if (plan.changed) {
+            apr_status_t rv = magick_render(b, &plan);
+
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+        }
+        else {
+            /* nothing changed, pass the original through untouched */
+            m->base = (char *)m->source;
+            b->length = m->source_len;
+            m->source = NULL;
+        }
+        m->alloc_len = b->length;
+        magick_wand_release(m->wand);
+        m->wand = NULL;
+
+        /* the length of the rendered image, if not too late to send it */
+        if (!m->r->sent_bodyct) {
+            ap_set_content_length(m->r, b->length);
+        }
+
+        if (m->source) {
+            MagickFree(m->source);
+            m->source = NULL;
+        }
+
+        /* morph into a magick heap bucket from now on */
+        b->type = &ap_bucket_type_magick_heap;
+
+        /* large enough to spill to disk? */
+        if (conf->spill_threshold && b->length > conf->spill_threshold
+                && m->refcount.refcount == 1 && !b->start) {
+            request_rec *r = m->r;
+            apr_size_t length = b->length;
+            apr_file_t *fd;
+
+            if (magick_spill(r, m->base, length, &fd) == APR_SUCCESS) {
+
+                /* release the memory, and morph into a file bucket */
+                magick_bucket_destroy(m);
+                apr_bucket_file_make(b, fd, 0, length, r->pool);
+
+                return apr_bucket_read(b, str, len, block);
+            }
+        }
+    }
+
+    *str = m->base + b->start;
+    *len = b->length;
+    return APR_SUCCESS;
+}
+
+static void magick_bucket_destroy(void *data)
+{
+    ap_bucket_magick *m = data;
+
+    if (apr_bucket_shared_destroy(m)) {
+
+        if (m->wand) {
+            magick_wand_release(m->wand);
+            m->wand = NULL;
+        }
+
+        if (m->source) {
+            MagickFree(m->source);
+            m->source = NULL;
+        }
+
+        if (m->base) {
+            MagickRelinquishMemory((void *)m->base);
+            m->base = NULL;
+        }
+
+        apr_bucket_free(m);
+    }
+}
+
+AP_DECLARE_DATA const apr_bucket_type_t ap_bucket_type_magick = {
+    "MAGICK", 5, APR_BUCKET_DATA,
+    magick_bucket_destroy,
+    magick_bucket_read,
+    apr_bucket_setaside_noop, /* don't need to setaside thanks to the cleanup*/
+    apr_bucket_shared_split,
+    apr_bucket_shared_copy
+};
+
+AP_DECLARE_DATA const apr_bucket_type_t ap_bucket_type_magick_heap = {
+    "MAGICK_HEAP", 5, APR_BUCKET_DATA,
+    magick_bucket_destroy,
+    magick_bucket_read,
+    apr_bucket_setaside_noop, /* don't need to setaside thanks to the cleanup*/
+    apr_bucket_shared_split,
+    apr_bucket_shared_copy
+};
+
+AP_DECLARE(apr_bucket *) ap_bucket_magick_make(apr_bucket *b, request_rec *r)
+{
+    ap_bucket_magick *m;
+
+    m = apr_bucket_alloc(sizeof(*m), b->list);
+
+    m->base = NULL;
+
+    b = apr_bucket_shared_make(b, m, 0, -1);
+    b->type = &ap_bucket_type_magick;
+
+    /* pre-initialize heap bucket member */
+    m->alloc_len = 0;
+    m->base      = NULL;
+
+    m->r = r;
+    m->source = NULL;
+    m->source_len = 0;
+    m->source_format = NULL;
+    m->source_columns = 0;
+    m->source_rows = 0;
+    m->source_colorspace = UndefinedColorspace;
+    m->columns = 0;
+    m->rows = 0;
+    m->ops = apr_array_make(r->pool, 4, sizeof(ap_magick_op));
+    m->source_frames = 0;
+    m->source_matte = 0;
+    m->source_orientation = UndefinedOrientation;
+
+    m->wand = magick_wand_acquire();
+
+    return b;
+}
+
+AP_DECLARE(apr_bucket *) ap_bucket_magick_create(apr_bucket_alloc_t *list,
+        request_rec *r)
+{
+    apr_bucket *b = apr_bucket_alloc(sizeof(*b), list);
+
+    APR_BUCKET_INIT(b);
+    b->free = apr_bucket_free;
+    b->list = list;
+    return ap_bucket_magick_make(b, r);
+}
+
+AP_DECLARE(ap_magick_op *) ap_bucket_magick_op_add(apr_bucket *b,
+        ap_magick_op_e type)
+{
+    ap_bucket_magick *m = b->data;
+    ap_magick_op *op = apr_array_push(m->ops);
+
+    memset(op, 0, sizeof(*op));
+    op->type = type;
+
+    return op;
+}
+
+static int magick_set_option(void *ctx, const void *key, apr_ssize_t klen, const void *val)
+{
+    magick_do *mdo = ctx;
+    const magick_option *option = val;
+
+    const char *err = NULL;
+    const char *str;
+
+    if (option->constant) {
+        MagickSetImageOption(mdo->wand, option->format, option->key,
+                option->constant);
+        return 1;
+    }
+
+    str = ap_expr_str_exec(mdo->r, option->value, &err);
+    if (err) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, mdo->r,
+                        "Failure while evaluating the option value expression for '%s', "
+                        "option ignored: %s", mdo->r->uri, err);
+    }
+    else {
+        MagickSetImageOption(mdo->wand, option->format, option->key, str);
+    }
+
+    return 1;
+}
+
+static void magick_hmac_sha1(const char *secret, const char *data,
+        unsigned char digest[APR_SHA1_DIGESTSIZE])
+{
+    apr_sha1_ctx_t sha1;
+    unsigned char key[HMAC_BLOCK_SIZE];
+    unsigned char pad[HMAC_BLOCK_SIZE];
+    apr_size_t len = strlen(secret);
+    int i;
+
+    memset(key, 0, sizeof(key));
+    if (len > HMAC_BLOCK_SIZE) {
+        apr_sha1_init(&sha1);
+        apr_sha1_update(&sha1, secret, len);
+        apr_sha1_final(key, &sha1);
+    }
+    else {
+        memcpy(key, secret, len);
+    }
+
+    for (i = 0; i < HMAC_BLOCK_SIZE; i++) {
+        pad[i] = key[i] ^ 0x36;
+    }
+    apr_sha1_init(&sha1);
+    apr_sha1_update_binary(&sha1, pad, HMAC_BLOCK_SIZE);
+    apr_sha1_update(&sha1, data, strlen(data));
+    apr_sha1_final(digest, &sha1);
+
+    for (i = 0; i < HMAC_BLOCK_SIZE; i++) {
+        pad[i] = key[i] ^ 0x5c;
+    }
+    apr_sha1_init(&sha1);
+    apr_sha1_update_binary(&sha1, pad, HMAC_BLOCK_SIZE);
+    apr_sha1_update_binary(&sha1, digest, APR_SHA1_DIGESTSIZE);
+    apr_sha1_final(digest, &sha1);
+}
+
+/*
+ * The data signed by default, the URI as sent by the client including the
+ * query string, with the parameters named as the signature and the expiry
+ * time removed, so that every other parameter is covered. Returns NULL if
+ * either parameter is repeated.
+ */
+static const char *magick_signature_default(request_rec *r,
+        magick_conf *conf)
+{
+    char *data = apr_palloc(r->pool, strlen(r->unparsed_uri) + 1);
+
+    if (!magick_signature_data(data, r->unparsed_uri, conf->signature_param,
+            conf->signature_expires ? conf->signature_expires_param : NULL)) {
+        return NULL;
+    }
+
+    return data;
+}
+
+/*
+ * Verify the signature over the transform parameters, returning one of
+ * valid|missing|invalid|expired.
+ */
+static const char *magick_verify_signature(request_rec *r, magick_conf *conf)
+{
+    unsigned char digest[APR_SHA1_DIGESTSIZE];
+    char hex[APR_SHA1_DIGESTSIZE * 2 + 1];
+    const char *err = NULL, *signature, *data, *expires = NULL;
+    unsigned char diff = 0;
+    int i;
+
+    if (!conf->signature) {
+        return "missing";
+    }
+
+    signature = ap_expr_str_exec(r, conf->signature, &err);
+    if (err) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                "Failure while evaluating the signature expression for '%s', "
+                "signature missing: %s", r->uri, err);
+        return "missing";
+    }
+    else if (!signature || !*signature) {
+        return "missing";
+    }
+
+    if (conf->signature_expires) {
+        apr_int64_t expiry;
+
+        expires = ap_expr_str_exec(r, conf->signature_expires, &err);
+        if (err) {
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
+                    "Failure while evaluating the signature expires expression for '%s', "
+                    "signature invalid: %s", r->uri, err);
+            return "invalid";
+        }
+
+        errno = 0;
+        expiry = apr_atoi64(expires);
+        if (errno == ERANGE || expiry <= 0) {
+            return "invalid";
+        }
+    }
+
+    if (conf->signature_data) {
+        data = ap_expr_str_exec(r, conf->signature_data, &err);
+        if (err) {
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
+                    "Failure while evaluating the signature data expression for '%s', "
+                    "signature invalid: %s", r->uri, err);
+            return "invalid";
+        }
+    }
+    else {
+        data = magick_signature_default(r, conf);
+        if (!data) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                    "The signature or expiry parameter of '%s' is repeated, "
+                    "signature invalid", r->uri);
+            return "invalid";
+        }
+    }
+
+    if (expires) {
+        data = apr_pstrcat(r->pool, data, ":", expires, NULL);
+    }
+
+    magick_hmac_sha1(conf->secret, data, digest);
+    ap_bin2hex(digest, APR_SHA1_DIGESTSIZE, hex);
+
+    if (strlen(signature) != APR_SHA1_DIGESTSIZE * 2) {
+        return "invalid";
+    }
+
+    /* compare in constant time */
+    for (i = 0; i < APR_SHA1_DIGESTSIZE * 2; i++) {
+        diff |= hex[i] ^ apr_tolower(signature[i]);
+    }
+    if (diff) {
+        return "invalid";
+    }
+
+    if (expires && apr_atoi64(expires) < apr_time_sec(r->request_time)) {
+        return "expired";
+    }
+
+    return "valid";
+}
+
+/*
+ * Calculate the key identifying the source image, based on the host, the
+ * URI and the validators of the response. Returns zero if the response has
+ * no validators, in which case we cannot tell one version of the source
+ * from the next.
+ */
+static int magick_source_key(request_rec *r,
+        unsigned char key[APR_SHA1_DIGESTSIZE])
+{
+    apr_sha1_ctx_t sha1;
+    const char *etag = apr_table_get(r->headers_out, "ETag");
+    const char *lastmod = apr_table_get(r->headers_out, "Last-Modified");
+
+    if (!etag && !lastmod) {
+        return 0;
+    }
+
+    apr_sha1_init(&sha1);
+    if (r->hostname) {
+        apr_sha1_update(&sha1, r->hostname, strlen(r->hostname) + 1);
+    }
+    apr_sha1_update(&sha1, r->uri, strlen(r->uri) + 1);
+    if (etag) {
+        apr_sha1_update(&sha1, etag, strlen(etag) + 1);
+    }
+    if (lastmod) {
+        apr_sha1_update(&sha1, lastmod, strlen(lastmod) + 1);
+    }
+    apr_sha1_final(key, &sha1);
+
+    return 1;
+}
+
+/*
+ * Calculate the key under which a failure of the source image is
+ * remembered. A source too large for MagickMaxSize in one location may be
+ * fine in another, so the limit in effect is part of the key.
+ */
+static int magick_failure_key(request_rec *r, magick_conf *conf,
+        unsigned char key[APR_SHA1_DIGESTSIZE])
+{
+    apr_sha1_ctx_t sha1;
+    unsigned char source[APR_SHA1_DIGESTSIZE];
+    const char *size;
+
+    if (!magick_source_key(r, source)) {
+        return 0;
+    }
 
-    return NULL;
+    size = apr_off_t_toa(r->pool, conf->size);
+
+    apr_sha1_init(&sha1);
+    apr_sha1_update_binary(&sha1, source, APR_SHA1_DIGESTSIZE);
+    apr_sha1_update(&sha1, size, strlen(size) + 1);
+    apr_sha1_final(key, &sha1);
+
+    return 1;
 }
 
-static const char *add_magick_option(cmd_parms *cmd, void *dconf,
-        const char *key, const char *value)
+/*
+ * Look up the source image in the failure cache, returning the status of
+ * the original failure, or APR_SUCCESS if the source is not known to fail.
+ */
+static apr_status_t magick_failure_lookup(request_rec *r, magick_conf *conf)
 {
-    magick_conf *conf = dconf;
-    const char *expr_err = NULL;
+    unsigned char key[APR_SHA1_DIGESTSIZE];
+    unsigned char val[32];
+    unsigned int vallen = sizeof(val) - 1;
+    apr_status_t rv;
 
-    magick_option *option = apr_palloc(cmd->pool, sizeof(magick_option));
-
-    option->key = strchr(key, ':');
-    if (!option->key) {
-        return apr_psprintf(cmd->pool, "Key '%s' needs a colon character", key);
+    if (!failure_instance || !magick_failure_key(r, conf, key)) {
+        return APR_SUCCESS;
     }
-    option->format = apr_pstrndup(cmd->pool, key, option->key - key);
-    option->key++;
-     option->value = ap_expr_parse_cmd(cmd, value, AP_EXPR_FLAG_STRING_RESULT,
-            &expr_err, NULL);
 
-    if (expr_err) {
-        return apr_pstrcat(cmd->temp_pool,
-                "Cannot parse expression '", value, "': ",
-                expr_err, NULL);
+    if (failure_mutex) {
+        apr_global_mutex_lock(failure_mutex);
+    }
+    rv = failure_provider->retrieve(failure_instance, r->server, key,
+            APR_SHA1_DIGESTSIZE, val, &vallen, r->pool);
+    if (failure_mutex) {
+        apr_global_mutex_unlock(failure_mutex);
     }
 
-    apr_hash_set(conf->options, key, APR_HASH_KEY_STRING, option);
+    if (rv != APR_SUCCESS || !vallen) {
+        return APR_SUCCESS;
+    }
+    val[vallen] = 0;
 
-    return NULL;
+    return (apr_status_t) apr_atoi64((const char *) val);
 }
 
-static const command_rec magick_cmds[] = {
-    AP_INIT_TAKE1("MagickMaxSize", set_magick_size, NULL, ACCESS_CONF,
-        "Maximum size of the image processed by the magick filter"),
-    AP_INIT_TAKE2("AddMagickOption", add_magick_option, NULL, ACCESS_CONF,
-        "Add key/value option to be used by the filter."), { NULL },
-};
-
-static apr_status_t magick_bucket_read(apr_bucket *b, const char **str,
-                                       apr_size_t *len, apr_read_type_e block)
+/*
+ * Remember that the source image failed with the given status.
+ */
+static void magick_failure_store(request_rec *r, magick_conf *conf,
+        apr_status_t status)
 {
-    ap_bucket_magick *m = b->data;
+    unsigned char key[APR_SHA1_DIGESTSIZE];
+    char *val;
+    apr_status_t rv;
 
-    if (m->wand) {
-        m->base = (char *)MagickWriteImageBlob(m->wand,
-                &b->length);
-        m->alloc_len = b->length;
-        DestroyMagickWand(m->wand);
-        m->wand = NULL;
+    if (!failure_instance || !magick_failure_key(r, conf, key)) {
+        return;
+    }
 
-        /* morph into a magick heap bucket from now on */
-        b->type = &ap_bucket_type_magick_heap;
+    val = apr_itoa(r->pool, status);
+
+    if (failure_mutex) {
+        apr_global_mutex_lock(failure_mutex);
+    }
+    rv = failure_provider->store(failure_instance, r->server, key,
+            APR_SHA1_DIGESTSIZE, r->request_time + conf->failure_timeout,
+            (unsigned char *) val, strlen(val), r->pool);
+    if (failure_mutex) {
+        apr_global_mutex_unlock(failure_mutex);
     }
 
-    *str = m->base + b->start;
-    *len = b->length;
-    return APR_SUCCESS;
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r,
+                "Could not remember failure of '%s' in the failure cache",
+                r->uri);
+    }
 }
 
-static void magick_bucket_destroy(void *data)
+/*
+ * Calculate the key identifying something remembered about the source image,
+ * based on the key of the source and a name, such as the variant of the
+ * source a quality was chosen for. Returns zero if there is no cache, or the
+ * source has no key.
+ */
+static int magick_cache_key(request_rec *r, const char *name,
+        unsigned char key[APR_SHA1_DIGESTSIZE])
 {
-    ap_bucket_magick *m = data;
+    apr_sha1_ctx_t sha1;
+    unsigned char source[APR_SHA1_DIGESTSIZE];
 
-    if (apr_bucket_shared_destroy(m)) {
+    if (!failure_instance || !magick_source_key(r, source)) {
+        return 0;
+    }
 
-        if (m->wand) {
-            DestroyMagickWand(m->wand);
-            m->wand = NULL;
-        }
+    apr_sha1_init(&sha1);
+    apr_sha1_update_binary(&sha1, source, APR_SHA1_DIGESTSIZE);
+    apr_sha1_update(&sha1, name, strlen(name));
+    apr_sha1_final(key, &sha1);
 
-        if (m->base) {
-            MagickRelinquishMemory((void *)m->base);
-            m->base = NULL;
-        }
+    return 1;
+}
 
-        apr_bucket_free(m);
+/*
+ * Look up a value remembered while rendering, such as the quality chosen
+ * for a variant.
+ */
+static apr_status_t magick_cache_get(request_rec *r,
+        const unsigned char key[APR_SHA1_DIGESTSIZE], const char **val)
+{
+    unsigned char *buf = apr_palloc(r->pool, MAGICK_CACHE_VALUE_MAX + 1);
+    unsigned int buflen = MAGICK_CACHE_VALUE_MAX;
+    apr_status_t rv;
+
+    if (failure_mutex) {
+        apr_global_mutex_lock(failure_mutex);
+    }
+    rv = failure_provider->retrieve(failure_instance, r->server, key,
+            APR_SHA1_DIGESTSIZE, buf, &buflen, r->pool);
+    if (failure_mutex) {
+        apr_global_mutex_unlock(failure_mutex);
     }
-}
 
-AP_DECLARE_DATA const apr_bucket_type_t ap_bucket_type_magick = {
-    "MAGICK", 5, APR_BUCKET_DATA,
-    magick_bucket_destroy,
-    magick_bucket_read,
-    apr_bucket_setaside_noop, /* don't need to setaside thanks to the cleanup*/
-    apr_bucket_shared_split,
-    apr_bucket_shared_copy
-};
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+    buf[buflen] = 0;
+    *val = (const char *) buf;
 
-AP_DECLARE_DATA const apr_bucket_type_t ap_bucket_type_magick_heap = {
-    "MAGICK_HEAP", 5, APR_BUCKET_DATA,
-    magick_bucket_destroy,
-    magick_bucket_read,
-    apr_bucket_setaside_noop, /* don't need to setaside thanks to the cleanup*/
-    apr_bucket_shared_split,
-    apr_bucket_shared_copy
-};
+    return APR_SUCCESS;
+}
 
-AP_DECLARE(apr_bucket *) ap_bucket_magick_make(apr_bucket *b)
+/*
+ * Remember a value for later renders.
+ */
+static apr_status_t magick_cache_set(request_rec *r,
+        const unsigned char key[APR_SHA1_DIGESTSIZE], const char *val)
 {
-    ap_bucket_magick *m;
+    apr_status_t rv;
 
-    m = apr_bucket_alloc(sizeof(*m), b->list);
+    if (failure_mutex) {
+        apr_global_mutex_lock(failure_mutex);
+    }
+    rv = failure_provider->store(failure_instance, r->server, key,
+            APR_SHA1_DIGESTSIZE, r->request_time + MAGICK_CACHE_TIMEOUT,
+            (unsigned char *) val, strlen(val), r->pool);
+    if (failure_mutex) {
+        apr_global_mutex_unlock(failure_mutex);
+    }
 
-    m->base = NULL;
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r,
+                "Could not remember the rendering of '%s' in the failure cache",
+                r->uri);
+    }
 
-    b = apr_bucket_shared_make(b, m, 0, -1);
-    b->type = &ap_bucket_type_magick;
+    return rv;
+}
 
-    /* pre-initialize heap bucket member */
-    m->alloc_len = 0;
-    m->base      = NULL;
+/*
+ * Look up a number remembered while rendering, returning -1 if unknown.
+ */
+static long magick_cache_lookup(request_rec *r,
+        const unsigned char key[APR_SHA1_DIGESTSIZE])
+{
+    const char *val;
 
-    m->wand = NewMagickWand();
+    if (magick_cache_get(r, key, &val) != APR_SUCCESS || !*val) {
+        return -1;
+    }
 
-    return b;
+    return (long) apr_atoi64(val);
 }
 
-AP_DECLARE(apr_bucket *) ap_bucket_magick_create(apr_bucket_alloc_t *list)
+/*
+ * Remember a number for later renders.
+ */
+static void magick_cache_store(request_rec *r,
+        const unsigned char key[APR_SHA1_DIGESTSIZE], long value)
 {
-    apr_bucket *b = apr_bucket_alloc(sizeof(*b), list);
-
-    APR_BUCKET_INIT(b);
-    b->free = apr_bucket_free;
-    b->list = list;
-    return ap_bucket_magick_make(b);
+    magick_cache_set(r, key, apr_ltoa(r->pool, value));
 }
 
-static int magick_set_option(void *ctx, const void *key, apr_ssize_t klen, const void *val)
+AP_DECLARE(apr_status_t) ap_magick_cache_get(request_rec *r, const char *name,
+        const char **val)
 {
-    magick_do *mdo = ctx;
-    const magick_option *option = val;
+    unsigned char key[APR_SHA1_DIGESTSIZE];
 
-    const char *err = NULL;
-    const char *str;
+    if (!magick_cache_key(r, name, key)) {
+        return APR_ENOTIMPL;
+    }
 
-    str = ap_expr_str_exec(mdo->r, option->value, &err);
-    if (err) {
-        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, mdo->r,
-                        "Failure while evaluating the option value expression for '%s', "
-                        "option ignored: %s", mdo->r->uri, err);
+    return magick_cache_get(r, key, val);
+}
+
+AP_DECLARE(apr_status_t) ap_magick_cache_set(request_rec *r, const char *name,
+        const char *val)
+{
+    unsigned char key[APR_SHA1_DIGESTSIZE];
+
+    if (!magick_cache_key(r, name, key)) {
+        return APR_ENOTIMPL;
     }
-    else {
-        MagickSetImageOption(mdo->wand, option->format, option->key, str);
+
+    if (strlen(val) > MAGICK_CACHE_VALUE_MAX) {
+        return APR_EINVAL;
     }
 
-    return 1;
+    return magick_cache_set(r, key, val);
 }
 
 static apr_status_t magick_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
@@ -279,6 +4199,7 @@ static apr_status_t magick_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
 
     apr_status_t rv = APR_SUCCESS;
     apr_size_t size;
+    apr_bucket *e;
 
     /* Do nothing if asked to filter nothing. */
     if (APR_BRIGADE_EMPTY(bb)) {
@@ -287,6 +4208,60 @@ static apr_status_t magick_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
 
     /* first time in? create a context */
     if (!ctx) {
+
+        /* verify the signature before we buffer anything */
+        if (conf->secret) {
+            const char *result = magick_verify_signature(r, conf);
+
+            apr_table_setn(r->subprocess_env, "MAGICK_SIGNATURE", result);
+
+            if (strcmp(result, "valid")) {
+
+                ap_remove_output_filter(f);
+
+                if (conf->signature_failure == MAGICK_SIGNATURE_ORIGINAL) {
+                    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                            "Signature for '%s' %s, passing original image",
+                            r->uri, result);
+                    return ap_pass_brigade(f->next, bb);
+                }
+
+                ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r,
+                        "Signature for '%s' %s, rejecting request",
+                        r->uri, result);
+
+                apr_brigade_cleanup(bb);
+                e = ap_bucket_error_create(HTTP_FORBIDDEN, NULL, r->pool,
+                        f->c->bucket_alloc);
+                APR_BRIGADE_INSERT_TAIL(bb, e);
+                e = apr_bucket_eos_create(f->c->bucket_alloc);
+                APR_BRIGADE_INSERT_TAIL(bb, e);
+                return ap_pass_brigade(f->next, bb);
+            }
+        }
+
+        /* source known to fail? */
+        if (failure_instance && r->status == HTTP_OK) {
+            apr_status_t failed = magick_failure_lookup(r, conf);
+
+            if (failed != APR_SUCCESS) {
+
+                ap_remove_output_filter(f);
+
+                if (conf->failure_fallback == MAGICK_FAILURE_ORIGINAL) {
+                    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, failed, r,
+                            "Image '%s' previously failed, passing original image",
+                            r->uri);
+                    return ap_pass_brigade(f->next, bb);
+                }
+
+                ap_log_rerror(APLOG_MARK, APLOG_ERR, failed, r,
+                        "Image '%s' previously failed, aborting request.",
+                        r->uri);
+                return failed;
+            }
+        }
+
         ctx = f->ctx = apr_pcalloc(r->pool, sizeof(*ctx));
         ctx->bb = apr_brigade_create(r->pool, f->c->bucket_alloc);
         ctx->mbb = apr_brigade_create(r->pool, f->c->bucket_alloc);
@@ -294,7 +4269,6 @@ static apr_status_t magick_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
 
     while (APR_SUCCESS == rv && !APR_BRIGADE_EMPTY(bb)) {
         const char *data;
-        apr_bucket *e;
 
         e = APR_BRIGADE_FIRST(bb);
 
@@ -333,6 +4307,7 @@ static apr_status_t magick_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
                 ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_ENOSPC, r,
                         "Response is too large (>%" APR_OFF_T_FMT
                         "), aborting request.", conf->size);
+                magick_failure_store(r, conf, APR_ENOSPC);
                 return APR_ENOSPC;
             }
 
@@ -352,12 +4327,18 @@ static apr_status_t magick_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
         if (ctx->seen_bytes) {
 
             unsigned char *data;
-            apr_bucket *e;
             ap_bucket_magick *m;
+            MagickWand *ping;
+            char *format;
             magick_do mdo;
 
+            /* the length of the source no longer applies, the length of
+             * the rendered image is set when the image is read downstream.
+             */
+            apr_table_unset(r->headers_out, "Content-Length");
+
             /* insert wand bucket */
-            e = ap_bucket_magick_create(r->connection->bucket_alloc);
+            e = ap_bucket_magick_create(r->connection->bucket_alloc, r);
             APR_BRIGADE_INSERT_HEAD(bb, e);
 
             m = e->data;
@@ -374,20 +4355,45 @@ static apr_status_t magick_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
 
             apr_hash_do(magick_set_option, &mdo, conf->options);
 
-            if (!MagickReadImageBlob(m->wand, data, ctx->seen_bytes)) {
+            /* ping the image for its properties, decoding is deferred
+             * until we know what the operations need.
+             */
+            ping = magick_wand_acquire();
+
+            if (!MagickPingImageBlob(ping, data, ctx->seen_bytes)) {
                 char *description;
                 ExceptionType severity;
 
-                description = MagickGetException(m->wand, &severity);
+                description = MagickGetException(ping, &severity);
                 ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_EGENERAL, r,
-                        "MagickReadImageBlob: %s (severity %d)", description,
+                        "MagickPingImageBlob: %s (severity %d)", description,
                         severity);
                 MagickRelinquishMemory(description);
 
+                magick_failure_store(r, conf, APR_EGENERAL);
+
+                magick_wand_release(ping);
                 MagickFree(data);
                 return APR_EGENERAL;
             }
-            MagickFree(data);
+
+            format = MagickGetImageFormat(ping);
+            if (format) {
+                m->source_format = apr_pstrdup(r->pool, format);
+                MagickRelinquishMemory(format);
+            }
+            m->columns = m->source_columns = MagickGetImageWidth(ping);
+            m->rows = m->source_rows = MagickGetImageHeight(ping);
+            m->source_colorspace = MagickGetImageColorspace(ping);
+            m->source_frames = MagickGetNumberImages(ping);
+            m->source_matte = MagickGetImageMatte(ping);
+            m->source_orientation = MagickGetImageOrientation(ping);
+
+            magick_wand_release(ping);
+
+            /* keep the original until the bucket is read */
+            m->source = data;
+            m->source_len = ctx->seen_bytes;
 
         }
 
@@ -400,10 +4406,309 @@ static apr_status_t magick_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
 
 }
 
+static int magick_pre_config(apr_pool_t *pconf, apr_pool_t *plog,
+        apr_pool_t *ptemp)
+{
+    apr_status_t rv = ap_mutex_register(pconf, magick_failure_id, NULL,
+            APR_LOCK_DEFAULT, 0);
+    if (rv != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_CRIT, rv, plog,
+                "failed to register %s mutex", magick_failure_id);
+        return 500;
+    }
+
+    failure_provider = NULL;
+    failure_instance = NULL;
+    failure_mutex = NULL;
+    failure_configured = 0;
+
+    wand_pool_size = DEFAULT_WAND_POOL_SIZE;
+    frame_threads = DEFAULT_FRAME_THREADS;
+    preload_formats = NULL;
+    alloc_arena = 0;
+#ifdef HAVE_VIPS
+    vips_configured = 0;
+#endif
+
+    return OK;
+}
+
+static apr_status_t magick_failure_remove_lock(void *data)
+{
+    if (failure_mutex) {
+        apr_global_mutex_destroy(failure_mutex);
+        failure_mutex = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t magick_failure_destroy_cache(void *data)
+{
+    if (failure_instance) {
+        failure_provider->destroy(failure_instance, (server_rec *) data);
+        failure_instance = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+/*
+ * Initialise GraphicsMagick once per process, so that the first image
+ * handled by each child does not pay for the setup of the library.
+ *
+ * The library outlives our module across restarts, so the state is kept
+ * in the process pool. Once installed, the allocator must be installed
+ * again each time the module is loaded, as the module may have moved,
+ * and blocks from the previous generation may still be in use.
+ */
+static void magick_initialize(server_rec *s)
+{
+    apr_pool_t *pool = s->process->pool;
+    void *installed = NULL, *initialized = NULL;
+
+    apr_pool_userdata_get(&installed, magick_alloc_key, pool);
+    apr_pool_userdata_get(&initialized, magick_init_key, pool);
+
+    if (installed || (alloc_arena && !initialized)) {
+        MagickAllocFunctions(magick_alloc_free, magick_alloc_malloc,
+                magick_alloc_realloc);
+        if (!installed) {
+            apr_pool_userdata_set((void *)1, magick_alloc_key,
+                    apr_pool_cleanup_null, pool);
+        }
+        alloc_installed = 1;
+    }
+    else if (alloc_arena && !alloc_installed) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                "MagickAllocator: the arena allocator can only be enabled "
+                "by a full restart of the server");
+        alloc_arena = 0;
+    }
+
+    if (!initialized) {
+        InitializeMagick(NULL);
+        apr_pool_userdata_set((void *)1, magick_init_key,
+                apr_pool_cleanup_null, pool);
+    }
+}
+
+#ifdef HAVE_VIPS
+/*
+ * Initialise libvips in the child, as glib and libvips cannot be used
+ * across a fork, and only when MagickEngine vips is configured somewhere.
+ */
+static void magick_vips_initialize(server_rec *s)
+{
+    if (!vips_configured) {
+        return;
+    }
+
+    if (VIPS_INIT("mod_magick")) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                "MagickEngine: libvips could not be initialised, images will "
+                "be rendered with GraphicsMagick: %s", vips_error_buffer());
+        vips_error_clear();
+    }
+    else {
+        /* every image is different, caching the operations only costs memory */
+        vips_cache_set_max(0);
+        vips_available = 1;
+    }
+}
+#endif
+
+/*
+ * Load the coders of the given formats, so that the pages are shared by
+ * the children after the fork.
+ */
+static void magick_preload_formats(server_rec *s)
+{
+    ExceptionInfo exception;
+    int i;
+
+    if (!preload_formats) {
+        return;
+    }
+
+    for (i = 0; i < preload_formats->nelts; i++) {
+        const char *format = APR_ARRAY_IDX(preload_formats, i, const char *);
+        const MagickInfo *info;
+
+        GetExceptionInfo(&exception);
+        info = GetMagickInfo(format, &exception);
+        if (!info) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                    "MagickPreloadFormats: format '%s' could not be loaded: %s",
+                    format, exception.reason ? exception.reason : "unknown format");
+        }
+        DestroyExceptionInfo(&exception);
+    }
+}
+
+static int magick_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+        apr_pool_t *ptemp, server_rec *s)
+{
+    struct ap_socache_hints hints = { APR_SHA1_DIGESTSIZE, 8,
+            apr_time_from_sec(DEFAULT_FAILURE_TIMEOUT) };
+    apr_status_t rv;
+
+    magick_initialize(s);
+    magick_preload_formats(s);
+    magick_resample_init();
+
+    if (!failure_configured) {
+        return OK;
+    }
+
+    if (failure_provider->flags & AP_SOCACHE_FLAG_NOTMPSAFE) {
+        rv = ap_global_mutex_create(&failure_mutex, NULL, magick_failure_id,
+                NULL, s, pconf, 0);
+        if (rv != APR_SUCCESS) {
+            ap_log_perror(APLOG_MARK, APLOG_CRIT, rv, plog,
+                    "failed to create %s mutex", magick_failure_id);
+            return 500;
+        }
+        apr_pool_cleanup_register(pconf, NULL, magick_failure_remove_lock,
+                apr_pool_cleanup_null);
+    }
+
+    rv = failure_provider->init(failure_instance, magick_failure_id, &hints,
+            s, pconf);
+    if (rv != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_CRIT, rv, plog,
+                "failed to initialise %s cache", magick_failure_id);
+        return 500;
+    }
+    apr_pool_cleanup_register(pconf, (void *) s, magick_failure_destroy_cache,
+            apr_pool_cleanup_null);
+
+    return OK;
+}
+
+static void magick_child_init(apr_pool_t *p, server_rec *s)
+{
+    apr_status_t rv;
+
+    /* already done before the fork, unless this platform does not fork */
+    magick_initialize(s);
+
+#ifdef HAVE_VIPS
+    magick_vips_initialize(s);
+#endif
+
+#if APR_HAS_THREADS
+    if (alloc_arena) {
+        rv = apr_threadkey_private_create(&alloc_cache_key,
+                magick_alloc_cache_destroy, p);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                    "failed to create the magick allocator cache, blocks "
+                    "will not be reused");
+            alloc_cache_key = NULL;
+        }
+    }
+
+    if (frame_threads) {
+        rv = apr_thread_pool_create(&frame_pool, 0, frame_threads, p);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                    "failed to create the magick frame thread pool, frames "
+                    "will be processed one at a time");
+            frame_pool = NULL;
+        }
+    }
+
+    rv = apr_threadkey_private_create(&stream_key, NULL, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                "failed to create the magick stream key, images will not "
+                "be streamed");
+        stream_key = NULL;
+    }
+
+    rv = apr_threadkey_private_create(&wand_pool_key,
+            magick_wand_pool_destroy, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                "failed to create the magick wand pool, wands will not "
+                "be reused");
+        wand_pool_key = NULL;
+    }
+#endif
+
+    if (!failure_mutex) {
+        return;
+    }
+
+    rv = apr_global_mutex_child_init(&failure_mutex,
+            apr_global_mutex_lockfile(failure_mutex), p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                "failed to initialise mutex in child_init");
+    }
+}
+
+static int magick_status_hook(request_rec *r, int flags)
+{
+    apr_uint32_t hits = apr_atomic_read32(&wand_pool_hits);
+    apr_uint32_t misses = apr_atomic_read32(&wand_pool_misses);
+    apr_uint32_t discards = apr_atomic_read32(&wand_pool_discards);
+    apr_uint32_t idle = apr_atomic_read32(&wand_pool_idle);
+
+    if (flags & AP_STATUS_SHORT) {
+        ap_rprintf(r, "MagickWandPoolSize: %d\n", wand_pool_size);
+        ap_rprintf(r, "MagickWandPoolIdle: %u\n", idle);
+        ap_rprintf(r, "MagickWandPoolHits: %u\n", hits);
+        ap_rprintf(r, "MagickWandPoolMisses: %u\n", misses);
+        ap_rprintf(r, "MagickWandPoolDiscards: %u\n", discards);
+        if (alloc_arena) {
+            ap_rprintf(r, "MagickAllocCacheHits: %u\n",
+                    apr_atomic_read32(&alloc_cache_hits));
+            ap_rprintf(r, "MagickAllocCacheMisses: %u\n",
+                    apr_atomic_read32(&alloc_cache_misses));
+            ap_rprintf(r, "MagickAllocCacheBytes: %u\n",
+                    apr_atomic_read32(&alloc_cache_bytes));
+            ap_rprintf(r, "MagickAllocMapped: %u\n",
+                    apr_atomic_read32(&alloc_mapped));
+            ap_rprintf(r, "MagickAllocMappedKBytes: %u\n",
+                    apr_atomic_read32(&alloc_mapped_kbytes));
+        }
+    }
+    else {
+        ap_rputs("<hr>\n<h1>Magick wand pool (this child)</h1>\n<dl>\n", r);
+        ap_rprintf(r, "<dt>Pool size per thread: %d</dt>\n", wand_pool_size);
+        ap_rprintf(r, "<dt>Idle wands: %u</dt>\n", idle);
+        ap_rprintf(r, "<dt>Hits: %u, misses: %u, hit rate: %.1f%%</dt>\n",
+                hits, misses,
+                (hits + misses) ? 100.0 * hits / (hits + misses) : 0.0);
+        ap_rprintf(r, "<dt>Discards: %u</dt>\n", discards);
+        ap_rputs("</dl>\n", r);
+        if (alloc_arena) {
+            ap_rputs("<h1>Magick allocator (this child)</h1>\n<dl>\n", r);
+            ap_rprintf(r, "<dt>Cache hits: %u, misses: %u</dt>\n",
+                    apr_atomic_read32(&alloc_cache_hits),
+                    apr_atomic_read32(&alloc_cache_misses));
+            ap_rprintf(r, "<dt>Idle cached bytes: %u</dt>\n",
+                    apr_atomic_read32(&alloc_cache_bytes));
+            ap_rprintf(r, "<dt>Mapped blocks: %u, mapped kbytes: %u</dt>\n",
+                    apr_atomic_read32(&alloc_mapped),
+                    apr_atomic_read32(&alloc_mapped_kbytes));
+            ap_rputs("</dl>\n", r);
+        }
+    }
+
+    return OK;
+}
+
 static void register_hooks(apr_pool_t *p)
 {
     ap_register_output_filter("MAGICK", magick_out_filter, NULL,
             AP_FTYPE_CONTENT_SET);
+
+    ap_hook_pre_config(magick_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_post_config(magick_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(magick_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+    APR_OPTIONAL_HOOK(ap, status_hook, magick_status_hook, NULL, NULL,
+            APR_HOOK_MIDDLE);
 }
 
 AP_DECLARE_MODULE(magick) =
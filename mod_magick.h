@@ -25,8 +25,22 @@
 #define MOD_MAGICK_H_
 
 #include <apr_buckets.h>
+#include <apr_tables.h>
 #include <wand/wand_api.h>
 
+#include "httpd.h"
+#include "ap_expr.h"
+
+/**
+ * The version of the interface declared here, raised whenever a change
+ * breaks modules built against an earlier version. Version 2 added the
+ * request to ap_bucket_magick_make() and ap_bucket_magick_create(), and
+ * added operations to the MAGICK bucket in place of changing its wand
+ * directly. Decoding is deferred, so the wand of a MAGICK bucket holds no
+ * image until the bucket is first read.
+ */
+#define AP_MAGICK_API_VERSION 2
+
 /**
  * The MAGICK bucket type.  This bucket represents a magick wand. If this bucket
  * is still available when the pool is cleared, the data is copied on to the heap
@@ -55,23 +69,179 @@ AP_DECLARE_DATA extern const apr_bucket_type_t ap_bucket_type_magick_heap;
 #define AP_BUCKET_IS_MAGICK_HEAP(e)    ((e)->type == &ap_bucket_type_magick_heap)
 
 /**
- * Make the bucket passed in a Magick (MAGICK) bucket
- * @param b The bucket to make into an EOR bucket
- * @param wand The wand to destroy when this bucket is destroyed
+ * The operations that can be added to a MAGICK bucket.
+ */
+typedef enum ap_magick_op_e {
+    /** Resize the image */
+    AP_MAGICK_OP_RESIZE,
+    /** Strip the metadata from the image */
+    AP_MAGICK_OP_STRIP,
+    /** Set the colorspace of the image */
+    AP_MAGICK_OP_COLORSPACE,
+    /** Set the compression quality of the image */
+    AP_MAGICK_OP_QUALITY,
+    /** Set the interlace scheme of the image */
+    AP_MAGICK_OP_INTERLACE,
+    /** Set the format of the image */
+    AP_MAGICK_OP_FORMAT,
+    /** Encode the image in each of the formats, keeping the smallest */
+    AP_MAGICK_OP_FORMAT_SMALLEST,
+    /** Search for the highest quality that encodes within a size */
+    AP_MAGICK_OP_TARGET_BYTES,
+    /** Cap the quality at the estimated quality of a JPEG source */
+    AP_MAGICK_OP_QUALITY_CAP,
+    /** Choose the format from the content of the image */
+    AP_MAGICK_OP_FORMAT_AUTO
+} ap_magick_op_e;
+
+/**
+ * The engines that can be used to resize an image.
+ */
+typedef enum ap_magick_resize_engine_e {
+    /** Resize with GraphicsMagick */
+    AP_MAGICK_RESIZE_ENGINE_MAGICK,
+    /** Resize 8 bit RGB and RGBA images with the fixed point engine,
+     * falling back to GraphicsMagick for anything else */
+    AP_MAGICK_RESIZE_ENGINE_FAST
+} ap_magick_resize_engine_e;
+
+/**
+ * The strategies that can be used to resize an image.
+ */
+typedef enum ap_magick_resize_strategy_e {
+    /** Resize with the filter in a single pass */
+    AP_MAGICK_RESIZE_STRATEGY_DIRECT,
+    /** For large reductions, box reduce by an integer factor to between two
+     * and three times the target size before resizing with the filter */
+    AP_MAGICK_RESIZE_STRATEGY_AUTO
+} ap_magick_resize_strategy_e;
+
+/** @see ap_magick_op */
+typedef struct ap_magick_op ap_magick_op;
+/**
+ * An operation added to a MAGICK bucket by a filter. Operations are not
+ * applied straight away, but are optimised and applied together when the
+ * bucket is first read.
+ */
+struct ap_magick_op {
+    /** The type of the operation */
+    ap_magick_op_e type;
+    /** The parameters of the operation */
+    union {
+        /** AP_MAGICK_OP_RESIZE */
+        struct {
+            /** The columns to resize to */
+            unsigned long columns;
+            /** The rows to resize to */
+            unsigned long rows;
+            /** The filter to resize with */
+            FilterTypes filter_type;
+            /** The blur to resize with */
+            double blur;
+            /** The engine to resize with */
+            ap_magick_resize_engine_e engine;
+            /** The strategy to resize with */
+            ap_magick_resize_strategy_e strategy;
+        } resize;
+        /** AP_MAGICK_OP_STRIP */
+        struct {
+            /** Keep the ICC profile */
+            int keep_icc;
+        } strip;
+        /** AP_MAGICK_OP_COLORSPACE */
+        ColorspaceType colorspace;
+        /** AP_MAGICK_OP_QUALITY */
+        unsigned long quality;
+        /** AP_MAGICK_OP_INTERLACE */
+        InterlaceType interlace;
+        /** AP_MAGICK_OP_FORMAT */
+        const char *format;
+        /** AP_MAGICK_OP_FORMAT_SMALLEST, an array of const char * */
+        const apr_array_header_t *formats;
+        /** AP_MAGICK_OP_TARGET_BYTES */
+        apr_size_t target_bytes;
+        /** AP_MAGICK_OP_QUALITY_CAP, the offset added to the estimate */
+        int quality_cap;
+        /** AP_MAGICK_OP_FORMAT_AUTO */
+        struct {
+            /** The client accepts WEBP */
+            int webp;
+        } format_auto;
+    } u;
+};
+
+/**
+ * Make the bucket passed in a Magick (MAGICK) bucket. The request was added
+ * in AP_MAGICK_API_VERSION 2.
+ * @param b The bucket to make into a MAGICK bucket
+ * @param r The request the image belongs to
  * @return The new bucket, or NULL if allocation failed
  */
-AP_DECLARE(apr_bucket *) ap_bucket_magick_make(apr_bucket *b);
+AP_DECLARE(apr_bucket *) ap_bucket_magick_make(apr_bucket *b, request_rec *r);
 
 /**
  * Create a bucket referring to a Magick Wand (MAGICK). This bucket
  * holds a pointer to the wand, so that the request can be
  * destroyed right after all of the output has been sent to the client.
+ * The request was added in AP_MAGICK_API_VERSION 2.
  *
  * @param list The freelist from which this bucket should be allocated
- * @param wand The wand to destroy when this bucket is destroyed
+ * @param r The request the image belongs to
  * @return The new bucket, or NULL if allocation failed
  */
-AP_DECLARE(apr_bucket *) ap_bucket_magick_create(apr_bucket_alloc_t *list);
+AP_DECLARE(apr_bucket *) ap_bucket_magick_create(apr_bucket_alloc_t *list,
+        request_rec *r);
+
+/**
+ * Add an operation to a MAGICK bucket, to be applied when the bucket is
+ * first read. The caller fills in the parameters of the operation.
+ *
+ * @param b The MAGICK bucket
+ * @param type The type of operation
+ * @return The operation to fill in
+ */
+AP_DECLARE(ap_magick_op *) ap_bucket_magick_op_add(apr_bucket *b,
+        ap_magick_op_e type);
+
+/**
+ * Determine if the argument of a directive taking a string expression is
+ * constant, containing no variables, functions, backreferences or escapes,
+ * so that the argument can be parsed once at config time instead of being
+ * evaluated on every request.
+ * @param arg The argument of the directive
+ * @return true or false
+ */
+#define AP_MAGICK_EXPR_IS_CONSTANT(arg) (!strpbrk((arg), "%$\\"))
+
+/**
+ * Look up a value remembered for the source image of the request in the
+ * shared object cache configured with MagickFailureCache. The source is
+ * identified by the host, the URI and the validators of the response.
+ *
+ * @param r The request
+ * @param name The name of the value, unique among the values remembered
+ *  for a source
+ * @param val The value, allocated from the request pool
+ * @return APR_SUCCESS if found, APR_ENOTIMPL if there is no cache or the
+ *  response has no validators, or the error from the cache
+ */
+AP_DECLARE(apr_status_t) ap_magick_cache_get(request_rec *r, const char *name,
+        const char **val);
+
+/**
+ * Remember a value for the source image of the request in the shared object
+ * cache configured with MagickFailureCache, for a day.
+ *
+ * @param r The request
+ * @param name The name of the value, unique among the values remembered
+ *  for a source
+ * @param val The value, at most 4096 bytes long
+ * @return APR_SUCCESS if remembered, APR_ENOTIMPL if there is no cache or
+ *  the response has no validators, APR_EINVAL if the value is too long, or
+ *  the error from the cache
+ */
+AP_DECLARE(apr_status_t) ap_magick_cache_set(request_rec *r, const char *name,
+        const char *val);
 
 /** @see apr_bucket_pool */
 typedef struct ap_bucket_magick ap_bucket_magick;
@@ -91,8 +261,41 @@ struct ap_bucket_magick {
      * the start and length of the apr_bucket accordingly.
      * This will be NULL after the pool gets cleaned up.
      */
-    /** The magick wand wrapped by this bucket. */
+    /** The magick wand wrapped by this bucket. Since AP_MAGICK_API_VERSION
+     * 2 the wand holds no image until the bucket is first read, and then
+     * only if the operations require the source to be decoded. Filters
+     * add operations with ap_bucket_magick_op_add() instead.
+     */
     MagickWand *wand;
+    /** The request the image belongs to. */
+    request_rec *r;
+    /** The original source image, kept until the bucket is read. The
+     * source is only decoded if the operations require it, otherwise it is
+     * passed through untouched or transcoded without decoding.
+     */
+    unsigned char *source;
+    /** The length of the original source image. */
+    apr_size_t source_len;
+    /** The format of the original source image. */
+    const char *source_format;
+    /** The columns of the original source image. */
+    unsigned long source_columns;
+    /** The rows of the original source image. */
+    unsigned long source_rows;
+    /** The colorspace of the original source image. */
+    ColorspaceType source_colorspace;
+    /** The columns of the image after the operations so far. */
+    unsigned long columns;
+    /** The rows of the image after the operations so far. */
+    unsigned long rows;
+    /** The operations to apply when the bucket is first read. */
+    apr_array_header_t *ops;
+    /** The number of frames of the original source image. */
+    unsigned long source_frames;
+    /** Does the original source image have an alpha channel. */
+    int source_matte;
+    /** The orientation of the original source image. */
+    OrientationType source_orientation;
 };
 
 #endif /* MOD_MAGICK_H_ */
@@ -56,6 +56,7 @@ module AP_MODULE_DECLARE_DATA magick_colorspace_module;
 typedef struct magick_conf {
     int colorspace_set:1; /* have the colorspace been set */
     ap_expr_info_t *colorspace;  /* resize to colorspace */
+    ColorspaceType colorspace_type; /* colorspace, if constant */
 } magick_conf;
 
 static void *create_magick_dir_config(apr_pool_t *p, char *dummy)
@@ -72,38 +73,13 @@ static void *merge_magick_dir_config(apr_pool_t *p, void *basev, void *addv)
     magick_conf *base = (magick_conf *) basev;
 
     new->colorspace = (add->colorspace_set == 0) ? base->colorspace : add->colorspace;
+    new->colorspace_type = (add->colorspace_set == 0) ?
+            base->colorspace_type : add->colorspace_type;
     new->colorspace_set = add->colorspace_set || base->colorspace_set;
 
     return new;
 }
 
-static const char *set_magick_colorspace(cmd_parms *cmd, void *dconf, const char *arg)
-{
-    magick_conf *conf = dconf;
-    const char *expr_err = NULL;
-
-    conf->colorspace = ap_expr_parse_cmd(cmd, arg, AP_EXPR_FLAG_STRING_RESULT,
-            &expr_err, NULL);
-
-    if (expr_err) {
-        return apr_pstrcat(cmd->temp_pool,
-                "Cannot parse expression '", arg, "': ",
-                expr_err, NULL);
-    }
-
-    conf->colorspace_set = 1;
-
-    return NULL;
-}
-
-static const command_rec magick_cmds[] = {
-    AP_INIT_TAKE1("MagickColorspace", set_magick_colorspace, NULL, ACCESS_CONF | OR_ALL,
-        "Set the colorspace type used to render the image. Must be one of "
-        "cmyk|gray|hsl|hwb|ohta|rgb|srgb|transparent|xyz|ycbcr|ycc|yiq|ypbpr|yuv. "
-    	"Default is 'srgb'."
-        ), { NULL },
-};
-
 static ColorspaceType magick_parse_colorspace_type(const char *colorspace)
 {
 
@@ -182,6 +158,46 @@ static ColorspaceType magick_parse_colorspace_type(const char *colorspace)
     return UndefinedColorspace;
 }
 
+static const char *set_magick_colorspace(cmd_parms *cmd, void *dconf, const char *arg)
+{
+    magick_conf *conf = dconf;
+    const char *expr_err = NULL;
+
+    conf->colorspace = NULL;
+    conf->colorspace_type = UndefinedColorspace;
+
+    if (AP_MAGICK_EXPR_IS_CONSTANT(arg)) {
+        conf->colorspace_type = magick_parse_colorspace_type(arg);
+        if (conf->colorspace_type == UndefinedColorspace) {
+            return apr_pstrcat(cmd->temp_pool, "Colorspace type '", arg,
+                    "' not recognised, must be one of "
+                    "cmyk|gray|hsl|hwb|ohta|rgb|srgb|transparent|xyz|ycbcr|ycc|yiq|ypbpr|yuv", NULL);
+        }
+    }
+    else {
+        conf->colorspace = ap_expr_parse_cmd(cmd, arg, AP_EXPR_FLAG_STRING_RESULT,
+                &expr_err, NULL);
+
+        if (expr_err) {
+            return apr_pstrcat(cmd->temp_pool,
+                    "Cannot parse expression '", arg, "': ",
+                    expr_err, NULL);
+        }
+    }
+
+    conf->colorspace_set = 1;
+
+    return NULL;
+}
+
+static const command_rec magick_cmds[] = {
+    AP_INIT_TAKE1("MagickColorspace", set_magick_colorspace, NULL, ACCESS_CONF | OR_ALL,
+        "Set the colorspace type used to render the image. Must be one of "
+        "cmyk|gray|hsl|hwb|ohta|rgb|srgb|transparent|xyz|ycbcr|ycc|yiq|ypbpr|yuv. "
+    	"Default is 'srgb'."
+        ), { NULL },
+};
+
 static apr_status_t magick_colorspace_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
 {
     apr_bucket *e;
@@ -203,11 +219,14 @@ static apr_status_t magick_colorspace_out_filter(ap_filter_t *f, apr_bucket_brig
             magick_conf *conf = ap_get_module_config(f->r->per_dir_config,
                     &magick_colorspace_module);
 
-            ap_bucket_magick *m = e->data;
+            ap_magick_op *op;
 
             ColorspaceType colorspace = DEFAULT_COLORSPACE_TYPE;
 
-            if (conf->colorspace) {
+            if (conf->colorspace_type) {
+                colorspace = conf->colorspace_type;
+            }
+            else if (conf->colorspace) {
                 const char *err = NULL, *str;
 
                 str = ap_expr_str_exec(f->r, conf->colorspace, &err);
@@ -227,18 +246,8 @@ static apr_status_t magick_colorspace_out_filter(ap_filter_t *f, apr_bucket_brig
                 }
             }
 
-            if (!MagickSetImageColorspace(m->wand, colorspace)) {
-                char *description;
-                ExceptionType severity;
-
-                description = MagickGetException(m->wand, &severity);
-                ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_EGENERAL, f->r,
-                        "MagickSetImageColorspace: %s (severity %d)", description,
-                        severity);
-                MagickRelinquishMemory(description);
-
-                return APR_EGENERAL;
-            }
+            op = ap_bucket_magick_op_add(e, AP_MAGICK_OP_COLORSPACE);
+            op->u.colorspace = colorspace;
 
         }
 
@@ -32,8 +32,37 @@
  * The MagickFormat directive sets the output format to be used. The list
  * of supported formats can be found in the manual of the GraphicsMagick
  * 'gm' command.
+ *
+ * When the format is 'auto', mod_magick chooses the format from the content
+ * of the image after it has been resized: palette PNG for images with few
+ * colors, PNG or lossless WEBP for graphics, and JPEG or WEBP for
+ * photographs, or PNG or WEBP when they have an alpha channel. WEBP is
+ * chosen when named in the Accept header of the request, and Accept is added
+ * to the Vary header.
+ *
+ *   MagickFormat auto
+ *
+ * The MagickFormatNegotiate directive chooses the output format from the
+ * Accept header of the request instead. The formats are listed in order of
+ * preference, usually the smallest first, and the first format named by the
+ * client with a non zero quality is used. Wildcards are ignored, as browsers
+ * accept all images by wildcard while only supporting some formats. The
+ * last format is the fallback, and is used when the client names none of
+ * the others. Accept is added to the Vary header. When set, MagickFormat is
+ * ignored.
+ *
+ *   MagickFormatNegotiate AVIF WEBP JPEG
+ *
+ * The MagickFormatNegotiateSmallest directive, when on, encodes the image
+ * in every format accepted by the client, including the fallback, from a
+ * single decode, and sends the smallest. The default is off.
+ *
+ *   MagickFormatNegotiateSmallest on
  */
 
+#include <stdlib.h>
+
+#include <apr_lib.h>
 #include <apr_strings.h>
 
 #include "httpd.h"
@@ -49,13 +78,25 @@ module AP_MODULE_DECLARE_DATA magick_format_module;
 
 typedef struct magick_conf {
     int format_set:1; /* has the format been set */
+    int negotiate_set:1; /* have the negotiated formats been set */
+    int smallest_set:1; /* has smallest been set */
+    int smallest:1; /* encode each accepted format, keeping the smallest */
     ap_expr_info_t *format;  /* set to format */
+    const char *format_value; /* format, if constant */
+    apr_array_header_t *negotiate; /* formats to negotiate, in order */
 } magick_conf;
 
+typedef struct magick_accept {
+    const char *range; /* the media range */
+    double q; /* the quality of the media range */
+} magick_accept;
+
 static void *create_magick_dir_config(apr_pool_t *p, char *dummy)
 {
     magick_conf *new = (magick_conf *) apr_pcalloc(p, sizeof(magick_conf));
 
+    new->negotiate = apr_array_make(p, 4, sizeof(const char *));
+
     return (void *) new;
 }
 
@@ -66,8 +107,16 @@ static void *merge_magick_dir_config(apr_pool_t *p, void *basev, void *addv)
     magick_conf *base = (magick_conf *) basev;
 
     new->format = (add->format_set == 0) ? base->format : add->format;
+    new->format_value = (add->format_set == 0) ?
+            base->format_value : add->format_value;
     new->format_set = add->format_set || base->format_set;
 
+    new->negotiate = (add->negotiate_set == 0) ? base->negotiate : add->negotiate;
+    new->negotiate_set = add->negotiate_set || base->negotiate_set;
+
+    new->smallest = (add->smallest_set == 0) ? base->smallest : add->smallest;
+    new->smallest_set = add->smallest_set || base->smallest_set;
+
     return new;
 }
 
@@ -76,13 +125,21 @@ static const char *set_magick_format(cmd_parms *cmd, void *dconf, const char *ar
     magick_conf *conf = dconf;
     const char *expr_err = NULL;
 
-    conf->format = ap_expr_parse_cmd(cmd, arg, AP_EXPR_FLAG_STRING_RESULT,
-            &expr_err, NULL);
+    conf->format = NULL;
+    conf->format_value = NULL;
 
-    if (expr_err) {
-        return apr_pstrcat(cmd->temp_pool,
-                "Cannot parse expression '", arg, "': ",
-                expr_err, NULL);
+    if (AP_MAGICK_EXPR_IS_CONSTANT(arg)) {
+        conf->format_value = arg;
+    }
+    else {
+        conf->format = ap_expr_parse_cmd(cmd, arg, AP_EXPR_FLAG_STRING_RESULT,
+                &expr_err, NULL);
+
+        if (expr_err) {
+            return apr_pstrcat(cmd->temp_pool,
+                    "Cannot parse expression '", arg, "': ",
+                    expr_err, NULL);
+        }
     }
 
     conf->format_set = 1;
@@ -90,11 +147,144 @@ static const char *set_magick_format(cmd_parms *cmd, void *dconf, const char *ar
     return NULL;
 }
 
+static const char *add_magick_negotiate(cmd_parms *cmd, void *dconf,
+        const char *arg)
+{
+    magick_conf *conf = dconf;
+
+    APR_ARRAY_PUSH(conf->negotiate, const char *) = arg;
+
+    conf->negotiate_set = 1;
+
+    return NULL;
+}
+
+static const char *set_magick_smallest(cmd_parms *cmd, void *dconf, int flag)
+{
+    magick_conf *conf = dconf;
+
+    conf->smallest = flag;
+    conf->smallest_set = 1;
+
+    return NULL;
+}
+
 static const command_rec magick_cmds[] = {
     AP_INIT_TAKE1("MagickFormat", set_magick_format, NULL, ACCESS_CONF | OR_ALL,
-        "Set the format of the output image"), { NULL },
+        "Set the format of the output image"),
+    AP_INIT_ITERATE("MagickFormatNegotiate", add_magick_negotiate, NULL, ACCESS_CONF | OR_ALL,
+        "Formats to choose from using the Accept header, in order of preference. "
+        "The last format is used when none are accepted."),
+    AP_INIT_FLAG("MagickFormatNegotiateSmallest", set_magick_smallest, NULL, ACCESS_CONF | OR_ALL,
+        "Encode the image in every accepted format, and send the smallest. "
+        "Default is off."),
+    { NULL },
 };
 
+/*
+ * Parse the Accept header into media ranges and their quality.
+ */
+static apr_array_header_t *magick_accept_parse(request_rec *r,
+        const char *header)
+{
+    apr_array_header_t *accepts = apr_array_make(r->pool, 8,
+            sizeof(magick_accept));
+    char *line = apr_pstrdup(r->pool, header);
+    char *range, *last;
+
+    for (range = apr_strtok(line, ",", &last); range;
+            range = apr_strtok(NULL, ",", &last)) {
+        magick_accept *accept;
+        char *param, *plast, *end;
+        double q = 1.0;
+
+        range = apr_strtok(range, ";", &plast);
+        if (!range) {
+            continue;
+        }
+
+        while ((param = apr_strtok(NULL, ";", &plast))) {
+            while (apr_isspace(*param)) {
+                param++;
+            }
+            if ((param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+                q = atof(param + 2);
+            }
+        }
+
+        while (apr_isspace(*range)) {
+            range++;
+        }
+        end = range + strlen(range);
+        while (end > range && apr_isspace(end[-1])) {
+            *--end = 0;
+        }
+
+        accept = apr_array_push(accepts);
+        accept->range = range;
+        accept->q = q;
+    }
+
+    return accepts;
+}
+
+/*
+ * Return the quality the client gives the media type, or zero if the client
+ * does not name it. Wildcards are ignored, browsers accept all images by
+ * wildcard while only supporting some formats.
+ */
+static double magick_accept_quality(const apr_array_header_t *accepts,
+        const char *type)
+{
+    int i;
+
+    for (i = 0; i < accepts->nelts; i++) {
+        const magick_accept *accept = &APR_ARRAY_IDX(accepts, i, magick_accept);
+
+        if (!strcasecmp(accept->range, type)) {
+            return accept->q;
+        }
+    }
+
+    return 0.0;
+}
+
+/*
+ * Choose the format from the Accept header. The formats named by the client
+ * are returned in order of preference, followed by the last configured
+ * format which every client is assumed to accept, and the format to use is
+ * the first of these.
+ */
+static const char *magick_negotiate(request_rec *r, magick_conf *conf,
+        apr_array_header_t **accepted)
+{
+    const char *header = apr_table_get(r->headers_in, "Accept");
+    const char *fallback = APR_ARRAY_IDX(conf->negotiate,
+            conf->negotiate->nelts - 1, const char *);
+    int i;
+
+    *accepted = apr_array_make(r->pool, conf->negotiate->nelts,
+            sizeof(const char *));
+
+    if (header) {
+        apr_array_header_t *accepts = magick_accept_parse(r, header);
+
+        for (i = 0; i < conf->negotiate->nelts - 1; i++) {
+            const char *format = APR_ARRAY_IDX(conf->negotiate, i, const char *);
+            char *mime = MagickToMime(format);
+
+            if (mime && magick_accept_quality(accepts, mime) > 0.0) {
+                APR_ARRAY_PUSH(*accepted, const char *) = format;
+            }
+            MagickRelinquishMemory(mime);
+        }
+    }
+
+    APR_ARRAY_PUSH(*accepted, const char *) = fallback;
+
+    return APR_ARRAY_IDX(*accepted, 0, const char *);
+}
+
 static apr_status_t magick_format_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
 {
     apr_bucket *e;
@@ -118,10 +308,29 @@ static apr_status_t magick_format_out_filter(ap_filter_t *f, apr_bucket_brigade
 
             ap_bucket_magick *m = e->data;
 
+            ap_magick_op *op;
+            apr_array_header_t *accepted = NULL;
             const char *format;
+            const char *current;
             char *mime;
+            int i;
+
+            if (conf->negotiate->nelts) {
+                format = magick_negotiate(f->r, conf, &accepted);
+                apr_table_mergen(f->r->headers_out, "Vary", "Accept");
 
-            if (conf->format) {
+                ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, f->r,
+                        "mod_magick: negotiated format %s for '%s' from %d "
+                        "accepted formats", format, f->r->uri, accepted->nelts);
+
+                if (!conf->smallest || accepted->nelts < 2) {
+                    accepted = NULL;
+                }
+            }
+            else if (conf->format_value) {
+                format = conf->format_value;
+            }
+            else if (conf->format) {
                 const char *err = NULL;
 
                 format = ap_expr_str_exec(f->r, conf->format, &err);
@@ -139,17 +348,43 @@ static apr_status_t magick_format_out_filter(ap_filter_t *f, apr_bucket_brigade
                 continue;
             }
 
-            if (!MagickSetImageFormat(m->wand, format)) {
-                char *description;
-                ExceptionType severity;
+            if (!strcasecmp(format, "auto")) {
+                const char *header = apr_table_get(f->r->headers_in, "Accept");
+
+                op = ap_bucket_magick_op_add(e, AP_MAGICK_OP_FORMAT_AUTO);
+                op->u.format_auto.webp = header && magick_accept_quality(
+                        magick_accept_parse(f->r, header), "image/webp") > 0.0;
+                apr_table_mergen(f->r->headers_out, "Vary", "Accept");
+
+                /* the content type is set once the format is chosen */
+                continue;
+            }
+
+            /* the format after the operations so far */
+            current = m->source_format;
+            for (i = m->ops->nelts; i > 0;) {
+                ap_magick_op *prev = &APR_ARRAY_IDX(m->ops, --i, ap_magick_op);
+
+                if (prev->type == AP_MAGICK_OP_FORMAT) {
+                    current = prev->u.format;
+                    break;
+                }
+                if (prev->type == AP_MAGICK_OP_FORMAT_AUTO) {
+                    current = NULL;
+                    break;
+                }
+            }
+            if (current && !strcasecmp(current, format) && !accepted) {
+                /* already in the right format, do nothing */
+                continue;
+            }
 
-                description = MagickGetException(m->wand, &severity);
-                ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_EGENERAL, f->r,
-                        "MagickSetImageFormat: %s (severity %d)", description,
-                        severity);
-                MagickRelinquishMemory(description);
+            op = ap_bucket_magick_op_add(e, AP_MAGICK_OP_FORMAT);
+            op->u.format = format;
 
-                return APR_EGENERAL;
+            if (accepted) {
+                op = ap_bucket_magick_op_add(e, AP_MAGICK_OP_FORMAT_SMALLEST);
+                op->u.formats = accepted;
             }
 
             mime = MagickToMime(format);
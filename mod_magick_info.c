@@ -0,0 +1,203 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The Apache mod_magick_info module provides a filter that replaces an
+ * image read by mod_magick with a description of the image in JSON.
+ *
+ *  Author: Graham Leggett
+ *
+ * Basic configuration:
+ *
+ * <Location />
+ *   <If "%{QUERY_STRING} =~ /info/">
+ *     SetOutputFilter MAGICK;MAGICK_RESIZE;MAGICK_INFO
+ *     MagickResizeColumns 320
+ *   </If>
+ * </Location>
+ *
+ * The description is taken from the ping made by mod_magick when the image
+ * is read, so that only the headers of the image are parsed and the pixels
+ * are never decoded. The response looks like this:
+ *
+ *   {"width":1024,"height":768,"format":"JPEG","frames":1,
+ *    "colorspace":"rgb","alpha":false,"orientation":1,
+ *    "output":{"width":320,"height":240}}
+ *
+ * The width, height, format, frames, colorspace and alpha describe the
+ * source image. The orientation is the EXIF orientation from 1 to 8, or 0
+ * when unknown. The output width and height are the size the image would be
+ * after the magick filters placed before MAGICK_INFO, such as MAGICK_RESIZE.
+ *
+ * The Last-Modified and ETag headers of the image are kept unchanged, so
+ * that the description can be cached and revalidated with the same
+ * validators as the image. The description is expected to be served on a
+ * URL of its own, such as with a query string as above.
+ */
+
+#include <apr_strings.h>
+
+#include "httpd.h"
+#include "http_config.h"
+#include "http_log.h"
+#include "http_protocol.h"
+#include "util_filter.h"
+
+#include "mod_magick.h"
+
+module AP_MODULE_DECLARE_DATA magick_info_module;
+
+static const char *magick_info_colorspace(ColorspaceType colorspace)
+{
+    switch (colorspace) {
+    case CMYKColorspace:
+        return "cmyk";
+    case GRAYColorspace:
+        return "gray";
+    case HSLColorspace:
+        return "hsl";
+    case HWBColorspace:
+        return "hwb";
+    case OHTAColorspace:
+        return "ohta";
+    case RGBColorspace:
+        return "rgb";
+    case sRGBColorspace:
+        return "srgb";
+    case TransparentColorspace:
+        return "transparent";
+    case XYZColorspace:
+        return "xyz";
+    case YCbCrColorspace:
+        return "ycbcr";
+    case YCCColorspace:
+        return "ycc";
+    case YIQColorspace:
+        return "yiq";
+    case YPbPrColorspace:
+        return "ypbpr";
+    case YUVColorspace:
+        return "yuv";
+    default:
+        return "undefined";
+    }
+}
+
+/*
+ * Escape a string for use within a JSON string.
+ */
+static const char *magick_info_escape(apr_pool_t *p, const char *str)
+{
+    char *out, *o;
+    const char *s;
+
+    o = out = apr_palloc(p, strlen(str) * 6 + 1);
+
+    for (s = str; *s; s++) {
+        unsigned char c = *s;
+
+        if (c == '"' || c == '\\') {
+            *o++ = '\\';
+            *o++ = c;
+        }
+        else if (c < 0x20) {
+            o += apr_snprintf(o, 7, "\\u%04x", c);
+        }
+        else {
+            *o++ = c;
+        }
+    }
+    *o = 0;
+
+    return out;
+}
+
+static apr_status_t magick_info_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
+{
+    apr_bucket *e;
+
+    for (e = APR_BRIGADE_FIRST(bb);
+         e != APR_BRIGADE_SENTINEL(bb);
+         e = APR_BUCKET_NEXT(e))
+    {
+
+        /* EOS means we are done. */
+        if (APR_BUCKET_IS_EOS(e)) {
+            ap_remove_output_filter(f);
+            break;
+        }
+
+        /* Magick bucket? */
+        if (AP_BUCKET_IS_MAGICK(e)) {
+
+            ap_bucket_magick *m = e->data;
+            request_rec *r = f->r;
+
+            apr_bucket *b;
+            char *json;
+
+            json = apr_psprintf(r->pool,
+                    "{\"width\":%lu,\"height\":%lu,\"format\":\"%s\","
+                    "\"frames\":%lu,\"colorspace\":\"%s\",\"alpha\":%s,"
+                    "\"orientation\":%d,"
+                    "\"output\":{\"width\":%lu,\"height\":%lu}}\n",
+                    m->source_columns, m->source_rows,
+                    magick_info_escape(r->pool,
+                            m->source_format ? m->source_format : ""),
+                    m->source_frames,
+                    magick_info_colorspace(m->source_colorspace),
+                    m->source_matte ? "true" : "false",
+                    (int)m->source_orientation, m->columns, m->rows);
+
+            ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+                    "mod_magick: described %s image of %lux%lu for '%s'",
+                    m->source_format, m->source_columns, m->source_rows,
+                    r->uri);
+
+            /* the image is never read, and so never rendered */
+            b = apr_bucket_pool_create(json, strlen(json), r->pool,
+                    r->connection->bucket_alloc);
+            APR_BUCKET_INSERT_BEFORE(e, b);
+            apr_bucket_delete(e);
+            e = b;
+
+            ap_set_content_type(r, "application/json");
+            ap_set_content_length(r, strlen(json));
+
+        }
+
+    }
+
+    return ap_pass_brigade(f->next, bb);
+}
+
+
+static void register_hooks(apr_pool_t *p)
+{
+    ap_register_output_filter("MAGICK_INFO", magick_info_out_filter, NULL,
+            AP_FTYPE_CONTENT_SET);
+}
+
+AP_DECLARE_MODULE(magick_info) =
+{
+    STANDARD20_MODULE_STUFF,
+    NULL,                     /* dir config creater */
+    NULL,                     /* dir merger --- default is to override */
+    NULL,                     /* server config */
+    NULL,                     /* merge server config */
+    NULL,                     /* command apr_table_t */
+    register_hooks            /* register hooks */
+};
@@ -31,6 +31,11 @@
  *
  * The MagickInterlace directive takes an expression containing the interlace
  * type to be used. Possible options are: none|line|plane|partition
+ *
+ * If no other filter changes the pixels or the encoding settings of a JPEG
+ * image, the image is transcoded losslessly from the original DCT
+ * coefficients instead of being decoded and encoded again, with any
+ * interlace type other than none giving a progressive JPEG.
  */
 
 #include <apr_strings.h>
@@ -50,6 +55,7 @@ module AP_MODULE_DECLARE_DATA magick_interlace_module;
 typedef struct magick_conf {
     int interlace_set:1; /* have the interlace been set */
     ap_expr_info_t *interlace;  /* resize to interlace */
+    InterlaceType interlace_type; /* interlace, if constant */
 } magick_conf;
 
 static void *create_magick_dir_config(apr_pool_t *p, char *dummy)
@@ -66,36 +72,13 @@ static void *merge_magick_dir_config(apr_pool_t *p, void *basev, void *addv)
     magick_conf *base = (magick_conf *) basev;
 
     new->interlace = (add->interlace_set == 0) ? base->interlace : add->interlace;
+    new->interlace_type = (add->interlace_set == 0) ?
+            base->interlace_type : add->interlace_type;
     new->interlace_set = add->interlace_set || base->interlace_set;
 
     return new;
 }
 
-static const char *set_magick_interlace(cmd_parms *cmd, void *dconf, const char *arg)
-{
-    magick_conf *conf = dconf;
-    const char *expr_err = NULL;
-
-    conf->interlace = ap_expr_parse_cmd(cmd, arg, AP_EXPR_FLAG_STRING_RESULT,
-            &expr_err, NULL);
-
-    if (expr_err) {
-        return apr_pstrcat(cmd->temp_pool,
-                "Cannot parse expression '", arg, "': ",
-                expr_err, NULL);
-    }
-
-    conf->interlace_set = 1;
-
-    return NULL;
-}
-
-static const command_rec magick_cmds[] = {
-    AP_INIT_TAKE1("MagickInterlace", set_magick_interlace, NULL, ACCESS_CONF | OR_ALL,
-        "Set the interlace type used to render the image. Must be one of none|line|plane|partition"
-        ), { NULL },
-};
-
 static InterlaceType magick_parse_interlace_type(const char *interlace_type)
 {
 
@@ -126,6 +109,44 @@ static InterlaceType magick_parse_interlace_type(const char *interlace_type)
     return UndefinedInterlace;
 }
 
+static const char *set_magick_interlace(cmd_parms *cmd, void *dconf, const char *arg)
+{
+    magick_conf *conf = dconf;
+    const char *expr_err = NULL;
+
+    conf->interlace = NULL;
+    conf->interlace_type = UndefinedInterlace;
+
+    if (AP_MAGICK_EXPR_IS_CONSTANT(arg)) {
+        conf->interlace_type = magick_parse_interlace_type(arg);
+        if (conf->interlace_type == UndefinedInterlace) {
+            return apr_pstrcat(cmd->temp_pool, "Interlace type '", arg,
+                    "' not recognised, must be one of "
+                    "none|line|plane|partition", NULL);
+        }
+    }
+    else {
+        conf->interlace = ap_expr_parse_cmd(cmd, arg, AP_EXPR_FLAG_STRING_RESULT,
+                &expr_err, NULL);
+
+        if (expr_err) {
+            return apr_pstrcat(cmd->temp_pool,
+                    "Cannot parse expression '", arg, "': ",
+                    expr_err, NULL);
+        }
+    }
+
+    conf->interlace_set = 1;
+
+    return NULL;
+}
+
+static const command_rec magick_cmds[] = {
+    AP_INIT_TAKE1("MagickInterlace", set_magick_interlace, NULL, ACCESS_CONF | OR_ALL,
+        "Set the interlace type used to render the image. Must be one of none|line|plane|partition"
+        ), { NULL },
+};
+
 static apr_status_t magick_interlace_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
 {
     apr_bucket *e;
@@ -147,11 +168,14 @@ static apr_status_t magick_interlace_out_filter(ap_filter_t *f, apr_bucket_briga
             magick_conf *conf = ap_get_module_config(f->r->per_dir_config,
                     &magick_interlace_module);
 
-            ap_bucket_magick *m = e->data;
+            ap_magick_op *op;
 
             InterlaceType interlace = DEFAULT_INTERLACE_TYPE;
 
-            if (conf->interlace) {
+            if (conf->interlace_type) {
+                interlace = conf->interlace_type;
+            }
+            else if (conf->interlace) {
                 const char *err = NULL, *str;
 
                 str = ap_expr_str_exec(f->r, conf->interlace, &err);
@@ -167,22 +191,17 @@ static apr_status_t magick_interlace_out_filter(ap_filter_t *f, apr_bucket_briga
                                       "Interlace type for '%s' of '%s' not recognised, "
                                       "must be one of none|line|plane|partition"
                                       ", using 'plane'", f->r->uri, str);
+                        interlace = DEFAULT_INTERLACE_TYPE;
                     }
                 }
             }
 
-            if (!MagickSetInterlaceScheme(m->wand, interlace)) {
-                char *description;
-                ExceptionType severity;
-
-                description = MagickGetException(m->wand, &severity);
-                ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_EGENERAL, f->r,
-                        "MagickSetInterlaceScheme: %s (severity %d)", description,
-                        severity);
-                MagickRelinquishMemory(description);
-
-                return APR_EGENERAL;
-            }
+            /* the interlace scheme is applied when the image is rendered,
+             * so that JPEG images can be transcoded losslessly if nothing
+             * else changes.
+             */
+            op = ap_bucket_magick_op_add(e, AP_MAGICK_OP_INTERLACE);
+            op->u.interlace = interlace;
 
         }
 
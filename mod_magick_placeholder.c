@@ -0,0 +1,509 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The Apache mod_magick_placeholder module provides a filter that replaces
+ * an image read by mod_magick with placeholders to show while the image
+ * loads.
+ *
+ *  Author: Graham Leggett
+ *
+ * Basic configuration:
+ *
+ * <Location />
+ *   <If "%{QUERY_STRING} =~ /placeholder/">
+ *     SetOutputFilter MAGICK;MAGICK_PLACEHOLDER
+ *     MagickPlaceholder blurhash color image
+ *   </If>
+ * </Location>
+ *
+ * The image is decoded as small as possible, JPEG images at an eighth of
+ * their size by the decoder, and reduced to at most 32 pixels on the long
+ * side before the placeholders are made. The response looks like this:
+ *
+ *   {"blurhash":"LEHV6nWB2yk8pyo0adR*.7kCMdnj",
+ *    "color":"#8a6e4b",
+ *    "image":"data:image/webp;base64,..."}
+ *
+ * The MagickPlaceholder directive lists the placeholders to make, any of
+ * 'blurhash' for a BlurHash string, 'color' for the dominant color of the
+ * image, and 'image' for a tiny WEBP image as a data URI. The default is all
+ * three.
+ *
+ * The MagickPlaceholderComponents directive sets the number of horizontal
+ * and vertical components of the BlurHash, each from 1 to 9. The default
+ * is 4 by 3.
+ *
+ *   MagickPlaceholderComponents 4 3
+ *
+ * The MagickPlaceholderSize directive sets the size in pixels of the long
+ * side of the tiny image, from 1 to 32. The default is 16.
+ *
+ * The MagickPlaceholderHeaders directive, when on, adds the placeholders to
+ * the response headers Placeholder-BlurHash, Placeholder-Color and
+ * Placeholder-Image instead, and the image is sent as usual. The default is
+ * off.
+ *
+ * When MagickFailureCache is configured, the placeholders are remembered for
+ * each source image, so that the image is decoded once. The Last-Modified
+ * and ETag headers of the image are kept unchanged, so that the placeholders
+ * can be cached and revalidated with the same validators as the image. The
+ * placeholders are expected to be served on a URL of their own, such as with
+ * a query string as above.
+ */
+
+#include <apr_base64.h>
+#include <apr_strings.h>
+
+#include "httpd.h"
+#include "http_config.h"
+#include "http_log.h"
+#include "http_protocol.h"
+#include "util_filter.h"
+
+#include "mod_magick.h"
+#include "magick_blurhash.h"
+
+module AP_MODULE_DECLARE_DATA magick_placeholder_module;
+
+#define MAGICK_PLACEHOLDER_BLURHASH 1
+#define MAGICK_PLACEHOLDER_COLOR 2
+#define MAGICK_PLACEHOLDER_IMAGE 4
+#define MAGICK_PLACEHOLDER_ALL 7
+
+#define MAGICK_PLACEHOLDER_SAMPLE 32
+#define MAGICK_PLACEHOLDER_QUALITY 40
+
+#define DEFAULT_PLACEHOLDER_COMPONENTS_X 4
+#define DEFAULT_PLACEHOLDER_COMPONENTS_Y 3
+#define DEFAULT_PLACEHOLDER_SIZE 16
+
+typedef struct magick_conf {
+    int kinds_set:1; /* have the placeholders been set */
+    int components_set:1; /* have the components been set */
+    int size_set:1; /* has the size been set */
+    int headers_set:1; /* has headers been set */
+    int kinds; /* placeholders to make */
+    int components_x; /* horizontal blurhash components */
+    int components_y; /* vertical blurhash components */
+    int size; /* long side of the tiny image */
+    int headers; /* add to the headers instead of the body */
+} magick_conf;
+
+static void *create_magick_dir_config(apr_pool_t *p, char *dummy)
+{
+    magick_conf *new = (magick_conf *) apr_pcalloc(p, sizeof(magick_conf));
+
+    new->kinds = MAGICK_PLACEHOLDER_ALL;
+    new->components_x = DEFAULT_PLACEHOLDER_COMPONENTS_X;
+    new->components_y = DEFAULT_PLACEHOLDER_COMPONENTS_Y;
+    new->size = DEFAULT_PLACEHOLDER_SIZE;
+
+    return (void *) new;
+}
+
+static void *merge_magick_dir_config(apr_pool_t *p, void *basev, void *addv)
+{
+    magick_conf *new = (magick_conf *) apr_pcalloc(p, sizeof(magick_conf));
+    magick_conf *add = (magick_conf *) addv;
+    magick_conf *base = (magick_conf *) basev;
+
+    new->kinds = (add->kinds_set == 0) ? base->kinds : add->kinds;
+    new->kinds_set = add->kinds_set || base->kinds_set;
+
+    new->components_x = (add->components_set == 0) ?
+            base->components_x : add->components_x;
+    new->components_y = (add->components_set == 0) ?
+            base->components_y : add->components_y;
+    new->components_set = add->components_set || base->components_set;
+
+    new->size = (add->size_set == 0) ? base->size : add->size;
+    new->size_set = add->size_set || base->size_set;
+
+    new->headers = (add->headers_set == 0) ? base->headers : add->headers;
+    new->headers_set = add->headers_set || base->headers_set;
+
+    return new;
+}
+
+static const char *add_magick_placeholder(cmd_parms *cmd, void *dconf,
+        const char *arg)
+{
+    magick_conf *conf = dconf;
+
+    /* the first placeholder listed replaces the default */
+    if (!conf->kinds_set) {
+        conf->kinds = 0;
+        conf->kinds_set = 1;
+    }
+
+    if (!strcasecmp(arg, "blurhash")) {
+        conf->kinds |= MAGICK_PLACEHOLDER_BLURHASH;
+    }
+    else if (!strcasecmp(arg, "color")) {
+        conf->kinds |= MAGICK_PLACEHOLDER_COLOR;
+    }
+    else if (!strcasecmp(arg, "image")) {
+        conf->kinds |= MAGICK_PLACEHOLDER_IMAGE;
+    }
+    else {
+        return "MagickPlaceholder must be one or more of blurhash|color|image";
+    }
+
+    return NULL;
+}
+
+static const char *set_magick_placeholder_components(cmd_parms *cmd,
+        void *dconf, const char *x, const char *y)
+{
+    magick_conf *conf = dconf;
+
+    conf->components_x = atoi(x);
+    conf->components_y = atoi(y);
+    if (conf->components_x < 1
+            || conf->components_x > MAGICK_BLURHASH_COMPONENTS_MAX
+            || conf->components_y < 1
+            || conf->components_y > MAGICK_BLURHASH_COMPONENTS_MAX) {
+        return "MagickPlaceholderComponents must be two numbers from 1 to 9";
+    }
+    conf->components_set = 1;
+
+    return NULL;
+}
+
+static const char *set_magick_placeholder_size(cmd_parms *cmd, void *dconf,
+        const char *arg)
+{
+    magick_conf *conf = dconf;
+
+    conf->size = atoi(arg);
+    if (conf->size < 1 || conf->size > MAGICK_PLACEHOLDER_SAMPLE) {
+        return "MagickPlaceholderSize must be a number of pixels from 1 to 32";
+    }
+    conf->size_set = 1;
+
+    return NULL;
+}
+
+static const char *set_magick_placeholder_headers(cmd_parms *cmd,
+        void *dconf, int flag)
+{
+    magick_conf *conf = dconf;
+
+    conf->headers = flag;
+    conf->headers_set = 1;
+
+    return NULL;
+}
+
+static const command_rec magick_cmds[] = {
+    AP_INIT_ITERATE("MagickPlaceholder", add_magick_placeholder, NULL, ACCESS_CONF | OR_ALL,
+        "Placeholders to make, one or more of blurhash|color|image. Default is "
+        "all three."),
+    AP_INIT_TAKE2("MagickPlaceholderComponents", set_magick_placeholder_components, NULL, ACCESS_CONF | OR_ALL,
+        "Horizontal and vertical components of the BlurHash, from 1 to 9. "
+        "Default is 4 by 3."),
+    AP_INIT_TAKE1("MagickPlaceholderSize", set_magick_placeholder_size, NULL, ACCESS_CONF | OR_ALL,
+        "Size in pixels of the long side of the tiny image, from 1 to 32. "
+        "Default is 16."),
+    AP_INIT_FLAG("MagickPlaceholderHeaders", set_magick_placeholder_headers, NULL, ACCESS_CONF | OR_ALL,
+        "Add the placeholders to the response headers, and send the image as "
+        "usual. Default is off."),
+    { NULL },
+};
+
+static void magick_placeholder_exception(request_rec *r, MagickWand *wand,
+        const char *func)
+{
+    char *description;
+    ExceptionType severity;
+
+    description = MagickGetException(wand, &severity);
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_EGENERAL, r,
+            "%s: %s (severity %d)", func, description, severity);
+    MagickRelinquishMemory(description);
+}
+
+/*
+ * Scale the size so that the long side is at most the given size.
+ */
+static void magick_placeholder_fit(unsigned long columns, unsigned long rows,
+        unsigned long size, unsigned long *width, unsigned long *height)
+{
+    if (columns <= size && rows <= size) {
+        *width = columns;
+        *height = rows;
+    }
+    else if (columns >= rows) {
+        *width = size;
+        *height = (rows * size + columns / 2) / columns;
+    }
+    else {
+        *width = (columns * size + rows / 2) / rows;
+        *height = size;
+    }
+
+    if (!*width) {
+        *width = 1;
+    }
+    if (!*height) {
+        *height = 1;
+    }
+}
+
+/*
+ * Encode the image as a tiny WEBP image in a data URI.
+ */
+static const char *magick_placeholder_image(request_rec *r, MagickWand *wand,
+        unsigned long size)
+{
+    unsigned long width, height;
+    unsigned char *blob;
+    size_t len;
+    char *uri;
+    int prefix = sizeof("data:image/webp;base64,") - 1;
+
+    magick_placeholder_fit(MagickGetImageWidth(wand),
+            MagickGetImageHeight(wand), size, &width, &height);
+
+    if (!MagickResizeImage(wand, width, height, TriangleFilter, 1.0)
+            || !MagickStripImage(wand)
+            || !MagickSetImageFormat(wand, "WEBP")
+            || !MagickSetCompressionQuality(wand, MAGICK_PLACEHOLDER_QUALITY)
+            || !(blob = MagickWriteImageBlob(wand, &len))) {
+        magick_placeholder_exception(r, wand, "MagickWriteImageBlob");
+        return NULL;
+    }
+
+    uri = apr_palloc(r->pool, prefix + apr_base64_encode_len((int)len));
+    memcpy(uri, "data:image/webp;base64,", prefix);
+    apr_base64_encode(uri + prefix, (const char *)blob, (int)len);
+    MagickRelinquishMemory(blob);
+
+    return uri;
+}
+
+/*
+ * Decode the source as small as the decoder allows, reduce it to the sample
+ * size, and make the missing placeholders. Each placeholder stands alone, a
+ * placeholder that cannot be made is left NULL and the others are kept.
+ */
+static apr_status_t magick_placeholder_make(request_rec *r, magick_conf *conf,
+        ap_bucket_magick *m, int missing, const char **values)
+{
+    MagickWand *wand = NewMagickWand();
+    unsigned long width, height;
+    unsigned char *rgb;
+
+    /* the JPEG decoder scales down by up to eight while decoding */
+    if (m->source_format && !strcasecmp(m->source_format, "JPEG")
+            && m->source_columns >= 8 && m->source_rows >= 8) {
+        MagickSetSize(wand, m->source_columns / 8, m->source_rows / 8);
+    }
+
+    if (!MagickReadImageBlob(wand, m->source, m->source_len)) {
+        magick_placeholder_exception(r, wand, "MagickReadImageBlob");
+        DestroyMagickWand(wand);
+        return APR_EGENERAL;
+    }
+
+    /* only the first frame of an animation is wanted */
+    if (MagickGetNumberImages(wand) > 1) {
+        MagickWand *first;
+
+        MagickSetImageIndex(wand, 0);
+        first = MagickGetImage(wand);
+        DestroyMagickWand(wand);
+        if (!first) {
+            return APR_EGENERAL;
+        }
+        wand = first;
+    }
+
+    magick_placeholder_fit(MagickGetImageWidth(wand),
+            MagickGetImageHeight(wand), MAGICK_PLACEHOLDER_SAMPLE, &width,
+            &height);
+
+    rgb = apr_palloc(r->pool, width * height * 3);
+    if (!MagickResizeImage(wand, width, height, TriangleFilter, 1.0)
+            || !MagickGetImagePixels(wand, 0, 0, width, height, "RGB",
+                    CharPixel, rgb)) {
+        magick_placeholder_exception(r, wand, "MagickGetImagePixels");
+        DestroyMagickWand(wand);
+        return APR_EGENERAL;
+    }
+
+    if (missing & MAGICK_PLACEHOLDER_BLURHASH) {
+        char *hash = apr_palloc(r->pool, MAGICK_BLURHASH_LEN(
+                conf->components_x, conf->components_y) + 1);
+
+        magick_blurhash(hash, rgb, width, height, conf->components_x,
+                conf->components_y);
+        values[0] = hash;
+    }
+    if (missing & MAGICK_PLACEHOLDER_COLOR) {
+        unsigned char color[3];
+
+        if (magick_blurhash_color(color, rgb, width, height)) {
+            values[1] = apr_psprintf(r->pool, "#%02x%02x%02x", color[0],
+                    color[1], color[2]);
+        }
+        else {
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, APR_ENOMEM, r,
+                    "Could not find the dominant color of '%s', color "
+                    "placeholder ignored", r->uri);
+        }
+    }
+    if (missing & MAGICK_PLACEHOLDER_IMAGE) {
+        values[2] = magick_placeholder_image(r, wand, conf->size);
+        if (!values[2]) {
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
+                    "Could not make the placeholder image for '%s', "
+                    "image placeholder ignored", r->uri);
+        }
+    }
+
+    DestroyMagickWand(wand);
+
+    ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+            "mod_magick: made placeholders for %s image of %lux%lu from "
+            "%lux%lu", m->source_format, m->source_columns, m->source_rows,
+            width, height);
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t magick_placeholder_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
+{
+    apr_bucket *e;
+
+    for (e = APR_BRIGADE_FIRST(bb);
+         e != APR_BRIGADE_SENTINEL(bb);
+         e = APR_BUCKET_NEXT(e))
+    {
+
+        /* EOS means we are done. */
+        if (APR_BUCKET_IS_EOS(e)) {
+            ap_remove_output_filter(f);
+            break;
+        }
+
+        /* Magick bucket? */
+        if (AP_BUCKET_IS_MAGICK(e)) {
+
+            magick_conf *conf = ap_get_module_config(f->r->per_dir_config,
+                    &magick_placeholder_module);
+
+            static const char * const headers[] = { "Placeholder-BlurHash",
+                    "Placeholder-Color", "Placeholder-Image" };
+            static const char * const fields[] = { "blurhash", "color",
+                    "image" };
+
+            ap_bucket_magick *m = e->data;
+            request_rec *r = f->r;
+
+            const char *values[3] = { NULL, NULL, NULL };
+            const char *names[3];
+            int i, missing = 0;
+
+            if (!m->source) {
+                continue;
+            }
+
+            names[0] = apr_psprintf(r->pool, "placeholder:blurhash:%dx%d",
+                    conf->components_x, conf->components_y);
+            names[1] = "placeholder:color";
+            names[2] = apr_psprintf(r->pool, "placeholder:image:%d",
+                    conf->size);
+
+            for (i = 0; i < 3; i++) {
+                if ((conf->kinds & (1 << i))
+                        && ap_magick_cache_get(r, names[i], &values[i])
+                                != APR_SUCCESS) {
+                    missing |= 1 << i;
+                }
+            }
+
+            if (missing) {
+                if (magick_placeholder_make(r, conf, m, missing, values)
+                        != APR_SUCCESS) {
+                    ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
+                            "Could not make the placeholders for '%s', "
+                            "placeholders ignored", r->uri);
+                    continue;
+                }
+                for (i = 0; i < 3; i++) {
+                    if ((missing & (1 << i)) && values[i]) {
+                        ap_magick_cache_set(r, names[i], values[i]);
+                    }
+                }
+            }
+
+            if (conf->headers) {
+                for (i = 0; i < 3; i++) {
+                    if (values[i]) {
+                        apr_table_setn(r->headers_out, headers[i], values[i]);
+                    }
+                }
+            }
+            else {
+                apr_bucket *b;
+                char *json = "{";
+
+                for (i = 0; i < 3; i++) {
+                    if (values[i]) {
+                        json = apr_pstrcat(r->pool, json, json[1] ? "," : "",
+                                "\"", fields[i], "\":\"", values[i], "\"",
+                                NULL);
+                    }
+                }
+                json = apr_pstrcat(r->pool, json, "}\n", NULL);
+
+                /* the image is never read, and so never rendered */
+                b = apr_bucket_pool_create(json, strlen(json), r->pool,
+                        r->connection->bucket_alloc);
+                APR_BUCKET_INSERT_BEFORE(e, b);
+                apr_bucket_delete(e);
+                e = b;
+
+                ap_set_content_type(r, "application/json");
+                ap_set_content_length(r, strlen(json));
+            }
+
+        }
+
+    }
+
+    return ap_pass_brigade(f->next, bb);
+}
+
+
+static void register_hooks(apr_pool_t *p)
+{
+    ap_register_output_filter("MAGICK_PLACEHOLDER",
+            magick_placeholder_out_filter, NULL, AP_FTYPE_CONTENT_SET);
+}
+
+AP_DECLARE_MODULE(magick_placeholder) =
+{
+    STANDARD20_MODULE_STUFF,
+    create_magick_dir_config, /* dir config creater */
+    merge_magick_dir_config,  /* dir merger --- default is to override */
+    NULL,                     /* server config */
+    NULL,                     /* merge server config */
+    magick_cmds,              /* command apr_table_t */
+    register_hooks            /* register hooks */
+};
@@ -37,8 +37,36 @@
  *
  *   AddMagickOption jpeg:preserve-settings true
  *
+ * The MagickQualityCap directive caps the quality of images whose source is
+ * a JPEG at the quality the source was saved with, estimated from the
+ * quantization tables of the source, so that an image already compressed
+ * harder than MagickQuality does not grow for no visible gain. This works
+ * whatever the output format. The MagickQualityCapOffset directive adds an
+ * offset to the estimate, defaulting to 0.
+ *
+ *   MagickQuality 85
+ *   MagickQualityCap on
+ *   MagickQualityCapOffset 5
+ *
+ * The MagickTargetBytes directive provides an expression that sets the
+ * largest size in bytes of the output image. For JPEG, WEBP and JP2 output,
+ * the highest quality that encodes within the size is searched for, starting
+ * from a quality predicted from the size per pixel and halving the range of
+ * qualities after each trial encode, for at most six encodes. The quality set
+ * by MagickQuality, or 90 if unset, is the highest quality tried, and 10 the
+ * lowest. If nothing fits, the smallest encode is sent. Images already within
+ * the size and otherwise unchanged are passed through untouched. The target
+ * is ignored when MagickFormatNegotiateSmallest chooses between formats.
+ *
+ *   MagickTargetBytes 50000
+ *
+ * When MagickFailureCache is configured, the chosen quality is remembered
+ * per source image and variant, so that later renders encode only once.
+ *
  */
 
+#include <stdlib.h>
+
 #include <apr_strings.h>
 
 #include "httpd.h"
@@ -54,7 +82,17 @@ module AP_MODULE_DECLARE_DATA magick_quality_module;
 
 typedef struct magick_conf {
     int quality_set:1; /* has the format been set */
+    int quality_constant:1; /* is the quality constant */
     ap_expr_info_t *quality;  /* set to format */
+    unsigned long quality_value; /* quality, if constant */
+    int target_set:1; /* has the target been set */
+    int target_constant:1; /* is the target constant */
+    ap_expr_info_t *target; /* set to target size */
+    apr_int64_t target_value; /* target size, if constant */
+    int cap; /* cap the quality at the source quality */
+    int cap_offset; /* offset added to the source quality */
+    int cap_set:1; /* has the cap been set */
+    int cap_offset_set:1; /* has the cap offset been set */
 } magick_conf;
 
 static void *create_magick_dir_config(apr_pool_t *p, char *dummy)
@@ -71,8 +109,26 @@ static void *merge_magick_dir_config(apr_pool_t *p, void *basev, void *addv)
     magick_conf *base = (magick_conf *) basev;
 
     new->quality = (add->quality_set == 0) ? base->quality : add->quality;
+    new->quality_constant = (add->quality_set == 0) ?
+            base->quality_constant : add->quality_constant;
+    new->quality_value = (add->quality_set == 0) ?
+            base->quality_value : add->quality_value;
     new->quality_set = add->quality_set || base->quality_set;
 
+    new->target = (add->target_set == 0) ? base->target : add->target;
+    new->target_constant = (add->target_set == 0) ?
+            base->target_constant : add->target_constant;
+    new->target_value = (add->target_set == 0) ?
+            base->target_value : add->target_value;
+    new->target_set = add->target_set || base->target_set;
+
+    new->cap = (add->cap_set == 0) ? base->cap : add->cap;
+    new->cap_set = add->cap_set || base->cap_set;
+
+    new->cap_offset = (add->cap_offset_set == 0) ?
+            base->cap_offset : add->cap_offset;
+    new->cap_offset_set = add->cap_offset_set || base->cap_offset_set;
+
     return new;
 }
 
@@ -81,13 +137,27 @@ static const char *set_magick_quality(cmd_parms *cmd, void *dconf, const char *a
     magick_conf *conf = dconf;
     const char *expr_err = NULL;
 
-    conf->quality = ap_expr_parse_cmd(cmd, arg, AP_EXPR_FLAG_STRING_RESULT,
-            &expr_err, NULL);
+    conf->quality = NULL;
+    conf->quality_constant = 0;
 
-    if (expr_err) {
-        return apr_pstrcat(cmd->temp_pool,
-                "Cannot parse expression '", arg, "': ",
-                expr_err, NULL);
+    if (AP_MAGICK_EXPR_IS_CONSTANT(arg)) {
+        errno = 0;
+        conf->quality_value = apr_atoi64(arg);
+        if (errno == ERANGE) {
+            return apr_pstrcat(cmd->temp_pool, "Quality '", arg,
+                    "' out of range", NULL);
+        }
+        conf->quality_constant = 1;
+    }
+    else {
+        conf->quality = ap_expr_parse_cmd(cmd, arg, AP_EXPR_FLAG_STRING_RESULT,
+                &expr_err, NULL);
+
+        if (expr_err) {
+            return apr_pstrcat(cmd->temp_pool,
+                    "Cannot parse expression '", arg, "': ",
+                    expr_err, NULL);
+        }
     }
 
     conf->quality_set = 1;
@@ -95,11 +165,153 @@ static const char *set_magick_quality(cmd_parms *cmd, void *dconf, const char *a
     return NULL;
 }
 
+static const char *set_magick_target_bytes(cmd_parms *cmd, void *dconf,
+        const char *arg)
+{
+    magick_conf *conf = dconf;
+    const char *expr_err = NULL;
+
+    conf->target = NULL;
+    conf->target_constant = 0;
+
+    if (AP_MAGICK_EXPR_IS_CONSTANT(arg)) {
+        errno = 0;
+        conf->target_value = apr_atoi64(arg);
+        if (errno == ERANGE || conf->target_value <= 0) {
+            return apr_pstrcat(cmd->temp_pool, "Target bytes '", arg,
+                    "' must be greater than zero", NULL);
+        }
+        conf->target_constant = 1;
+    }
+    else {
+        conf->target = ap_expr_parse_cmd(cmd, arg, AP_EXPR_FLAG_STRING_RESULT,
+                &expr_err, NULL);
+
+        if (expr_err) {
+            return apr_pstrcat(cmd->temp_pool,
+                    "Cannot parse expression '", arg, "': ",
+                    expr_err, NULL);
+        }
+    }
+
+    conf->target_set = 1;
+
+    return NULL;
+}
+
+static const char *set_magick_quality_cap(cmd_parms *cmd, void *dconf,
+        int flag)
+{
+    magick_conf *conf = dconf;
+
+    conf->cap = flag;
+    conf->cap_set = 1;
+
+    return NULL;
+}
+
+static const char *set_magick_quality_cap_offset(cmd_parms *cmd,
+        void *dconf, const char *arg)
+{
+    magick_conf *conf = dconf;
+    char *end;
+    long offset = strtol(arg, &end, 10);
+
+    if (!*arg || *end || offset < -100 || offset > 100) {
+        return "MagickQualityCapOffset must be a number from -100 to 100";
+    }
+
+    conf->cap_offset = (int)offset;
+    conf->cap_offset_set = 1;
+
+    return NULL;
+}
+
 static const command_rec magick_cmds[] = {
     AP_INIT_TAKE1("MagickQuality", set_magick_quality, NULL, ACCESS_CONF | OR_ALL,
-        "Set the compression quality of the output image"), { NULL },
+        "Set the compression quality of the output image"),
+    AP_INIT_TAKE1("MagickTargetBytes", set_magick_target_bytes, NULL, ACCESS_CONF | OR_ALL,
+        "Set the largest size in bytes of the output image"),
+    AP_INIT_FLAG("MagickQualityCap", set_magick_quality_cap, NULL, ACCESS_CONF | OR_ALL,
+        "Cap the quality at the estimated quality of a JPEG source"),
+    AP_INIT_TAKE1("MagickQualityCapOffset", set_magick_quality_cap_offset, NULL, ACCESS_CONF | OR_ALL,
+        "Offset added to the estimated quality of a JPEG source. Default is 0."), { NULL },
 };
 
+static void magick_quality_add(request_rec *r, magick_conf *conf,
+        apr_bucket *e)
+{
+    ap_magick_op *op;
+
+    const char *str;
+    unsigned long quality;
+
+    if (conf->quality_constant) {
+        quality = conf->quality_value;
+    }
+    else {
+        const char *err = NULL;
+
+        str = ap_expr_str_exec(r, conf->quality, &err);
+        if (err) {
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
+                            "Failure while evaluating the quality expression for '%s', "
+                            "quality ignored: %s", r->uri, err);
+            return;
+        }
+        else {
+            errno = 0;
+            quality = apr_atoi64(str);
+            if (errno == ERANGE) {
+                ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
+                              "Quality expression for '%s' out of range, "
+                              "quality ignored: %s", r->uri, str);
+                return;
+            }
+        }
+    }
+
+    op = ap_bucket_magick_op_add(e, AP_MAGICK_OP_QUALITY);
+    op->u.quality = quality;
+}
+
+static void magick_target_add(request_rec *r, magick_conf *conf,
+        apr_bucket *e)
+{
+    ap_magick_op *op;
+
+    const char *str;
+    apr_int64_t target;
+
+    if (conf->target_constant) {
+        target = conf->target_value;
+    }
+    else {
+        const char *err = NULL;
+
+        str = ap_expr_str_exec(r, conf->target, &err);
+        if (err) {
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
+                            "Failure while evaluating the target bytes expression for '%s', "
+                            "target ignored: %s", r->uri, err);
+            return;
+        }
+        else {
+            errno = 0;
+            target = apr_atoi64(str);
+            if (errno == ERANGE || target <= 0) {
+                ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
+                              "Target bytes expression for '%s' out of range, "
+                              "target ignored: %s", r->uri, str);
+                return;
+            }
+        }
+    }
+
+    op = ap_bucket_magick_op_add(e, AP_MAGICK_OP_TARGET_BYTES);
+    op->u.target_bytes = (apr_size_t)target;
+}
+
 static apr_status_t magick_quality_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
 {
     apr_bucket *e;
@@ -121,49 +333,25 @@ static apr_status_t magick_quality_out_filter(ap_filter_t *f, apr_bucket_brigade
             magick_conf *conf = ap_get_module_config(f->r->per_dir_config,
                     &magick_quality_module);
 
-            ap_bucket_magick *m = e->data;
-
-            const char *str;
-            unsigned long quality;
-
-            if (conf->quality) {
-                const char *err = NULL;
-
-                str = ap_expr_str_exec(f->r, conf->quality, &err);
-                if (err) {
-                    ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, f->r,
-                                    "Failure while evaluating the quality expression for '%s', "
-                                    "quality ignored: %s", f->r->uri, err);
-                    continue;
-                }
-                else {
-                    quality = apr_atoi64(str);
-                    if (errno == ERANGE) {
-                        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, f->r,
-                                      "Quality expression for '%s' out of range, "
-                                      "quality ignored: %s", f->r->uri, str);
-                        continue;
-                    }
-                }
-            }
-            else {
+            if (!conf->quality_set && !conf->target_set) {
                 ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, f->r,
                                 "No quality expression for '%s', "
                                 "quality ignored", f->r->uri);
                 continue;
             }
 
-            if (!MagickSetCompressionQuality(m->wand, quality)) {
-                char *description;
-                ExceptionType severity;
+            if (conf->quality_set) {
+                magick_quality_add(f->r, conf, e);
+            }
 
-                description = MagickGetException(m->wand, &severity);
-                ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_EGENERAL, f->r,
-                        "MagickSetCompressionQuality: %s (severity %d)", description,
-                        severity);
-                MagickRelinquishMemory(description);
+            if (conf->cap) {
+                ap_magick_op *op = ap_bucket_magick_op_add(e,
+                        AP_MAGICK_OP_QUALITY_CAP);
+                op->u.quality_cap = conf->cap_offset;
+            }
 
-                return APR_EGENERAL;
+            if (conf->target_set) {
+                magick_target_add(f->r, conf, e);
             }
 
         }
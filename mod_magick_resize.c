@@ -106,6 +106,25 @@
  *   # Resulting width will be 300
  *   MagickResizeWidth 201
  *   MagickResizeModulus 100
+ *
+ * The MagickResizeEngine directive selects the engine used to resize. The
+ * fast engine resizes single frame 8 bit RGB and RGBA images with a fixed
+ * point separable filter, using SSE4.1, AVX2 or NEON where available. Only
+ * the box, triangle, hermite, cubic, catrom, mitchell and lanczos filters
+ * are supported, anything else falls back to GraphicsMagick.
+ *
+ * The output of the fast engine is checked against MagickResizeImage by
+ * 'make check', which allows a difference of up to three per channel.
+ *
+ *   MagickResizeEngine fast
+ *
+ * The MagickResizeStrategy directive controls how large reductions are
+ * made. With auto, an image being reduced by four times or more is first
+ * box reduced by an integer factor to between two and three times the
+ * target size, and then resized to the target with the configured filter.
+ * Smaller reductions use the filter directly. The default is direct.
+ *
+ *   MagickResizeStrategy auto
  */
 
 #include <apr_strings.h>
@@ -122,7 +141,19 @@ module AP_MODULE_DECLARE_DATA magick_resize_module;
 
 #define DEFAULT_FILTER_TYPE CubicFilter
 
+typedef struct magick_value {
+    int constant:1; /* is the value known at config time */
+    ap_expr_info_t *expr; /* the expression */
+    union {
+        unsigned long number; /* columns or rows, if constant */
+        double real; /* blur or factor, if constant */
+        FilterTypes filter_type; /* filter type, if constant */
+    } u;
+} magick_value;
+
 typedef struct magick_conf {
+    int engine_set:1; /* has the engine been set */
+    int strategy_set:1; /* has the strategy been set */
     int modulus_set:1; /* has the modulus been set */
     apr_array_header_t *columns;  /* resize to columns */
     apr_array_header_t *rows; /* resize to rows */
@@ -130,17 +161,19 @@ typedef struct magick_conf {
     apr_array_header_t *blur; /* resize blur */
     apr_array_header_t *factor; /* resize scaling factor */
     apr_off_t modulus; /* the modulus to set */
+    ap_magick_resize_engine_e engine; /* the engine to resize with */
+    ap_magick_resize_strategy_e strategy; /* the strategy to resize with */
 } magick_conf;
 
 static void *create_magick_dir_config(apr_pool_t *p, char *dummy)
 {
     magick_conf *new = (magick_conf *) apr_pcalloc(p, sizeof(magick_conf));
 
-    new->columns = apr_array_make(p, 2, sizeof(ap_expr_info_t *));
-    new->rows = apr_array_make(p, 2, sizeof(ap_expr_info_t *));
-    new->filter_type = apr_array_make(p, 2, sizeof(ap_expr_info_t *));
-    new->blur = apr_array_make(p, 2, sizeof(ap_expr_info_t *));
-    new->factor = apr_array_make(p, 2, sizeof(ap_expr_info_t *));
+    new->columns = apr_array_make(p, 2, sizeof(magick_value));
+    new->rows = apr_array_make(p, 2, sizeof(magick_value));
+    new->filter_type = apr_array_make(p, 2, sizeof(magick_value));
+    new->blur = apr_array_make(p, 2, sizeof(magick_value));
+    new->factor = apr_array_make(p, 2, sizeof(magick_value));
     new->modulus = 1;
 
     return (void *) new;
@@ -161,136 +194,15 @@ static void *merge_magick_dir_config(apr_pool_t *p, void *basev, void *addv)
     new->modulus = (add->modulus_set == 0) ? base->modulus : add->modulus;
     new->modulus_set = add->modulus_set || base->modulus_set;
 
-    return new;
-}
-
-static const char *set_magick_columns(cmd_parms *cmd, void *dconf, const char *arg)
-{
-    magick_conf *conf = dconf;
-    const char *expr_err = NULL;
-
-    ap_expr_info_t **columns = apr_array_push(conf->columns);
-
-    *columns = ap_expr_parse_cmd(cmd, arg, AP_EXPR_FLAG_STRING_RESULT,
-            &expr_err, NULL);
+    new->engine = (add->engine_set == 0) ? base->engine : add->engine;
+    new->engine_set = add->engine_set || base->engine_set;
 
-    if (expr_err) {
-        return apr_pstrcat(cmd->temp_pool,
-                "Cannot parse expression '", arg, "': ",
-                expr_err, NULL);
-    }
-
-    return NULL;
-}
+    new->strategy = (add->strategy_set == 0) ? base->strategy : add->strategy;
+    new->strategy_set = add->strategy_set || base->strategy_set;
 
-static const char *set_magick_rows(cmd_parms *cmd, void *dconf, const char *arg)
-{
-    magick_conf *conf = dconf;
-    const char *expr_err = NULL;
-
-    ap_expr_info_t **rows = apr_array_push(conf->rows);
-
-    *rows = ap_expr_parse_cmd(cmd, arg, AP_EXPR_FLAG_STRING_RESULT,
-            &expr_err, NULL);
-
-    if (expr_err) {
-        return apr_pstrcat(cmd->temp_pool,
-                "Cannot parse expression '", arg, "': ",
-                expr_err, NULL);
-    }
-
-    return NULL;
-}
-
-static const char *set_magick_filter_type(cmd_parms *cmd, void *dconf, const char *arg)
-{
-    magick_conf *conf = dconf;
-    const char *expr_err = NULL;
-
-    ap_expr_info_t **filter_type = apr_array_push(conf->filter_type);
-
-    *filter_type = ap_expr_parse_cmd(cmd, arg, AP_EXPR_FLAG_STRING_RESULT,
-            &expr_err, NULL);
-
-    if (expr_err) {
-        return apr_pstrcat(cmd->temp_pool,
-                "Cannot parse expression '", arg, "': ",
-                expr_err, NULL);
-    }
-
-    return NULL;
-}
-
-static const char *set_magick_blur(cmd_parms *cmd, void *dconf, const char *arg)
-{
-    magick_conf *conf = dconf;
-    const char *expr_err = NULL;
-
-    ap_expr_info_t **blur = apr_array_push(conf->blur);
-
-    *blur = ap_expr_parse_cmd(cmd, arg, AP_EXPR_FLAG_STRING_RESULT,
-            &expr_err, NULL);
-
-    if (expr_err) {
-        return apr_pstrcat(cmd->temp_pool,
-                "Cannot parse expression '", arg, "': ",
-                expr_err, NULL);
-    }
-
-    return NULL;
-}
-
-static const char *set_magick_factor(cmd_parms *cmd, void *dconf, const char *arg)
-{
-    magick_conf *conf = dconf;
-    const char *expr_err = NULL;
-
-    ap_expr_info_t **factor = apr_array_push(conf->factor);
-
-    *factor = ap_expr_parse_cmd(cmd, arg, AP_EXPR_FLAG_STRING_RESULT,
-            &expr_err, NULL);
-
-    if (expr_err) {
-        return apr_pstrcat(cmd->temp_pool,
-                "Cannot parse expression '", arg, "': ",
-                expr_err, NULL);
-    }
-
-    return NULL;
-}
-
-static const char *set_magick_modulus(cmd_parms *cmd, void *dconf, const char *arg)
-{
-    magick_conf *conf = dconf;
-
-    if (APR_SUCCESS != apr_strtoff(&(conf->modulus), arg, NULL, 10) || conf->modulus
-            <= 0) {
-        return "MagickResizeModulus must be greater than zero";
-    }
-
-    conf->modulus_set = 1;
-
-    return NULL;
+    return new;
 }
 
-static const command_rec magick_cmds[] = {
-    AP_INIT_ITERATE("MagickResizeColumns", set_magick_columns, NULL, ACCESS_CONF | OR_ALL,
-        "Set the number of columns in the resized image"),
-    AP_INIT_ITERATE("MagickResizeRows", set_magick_rows, NULL, ACCESS_CONF | OR_ALL,
-        "Set the number of rows in the resized image"),
-    AP_INIT_ITERATE("MagickResizeFilterType", set_magick_filter_type, NULL, ACCESS_CONF | OR_ALL,
-        "Set the filter type used to resize the image. Must be one of bessel|blackman|box|catrom|"
-        "cubic|gaussian|hamming|hanning|hermite|lanczos|mitchell|point|"
-        "quadratic|sinc|triangle"),
-    AP_INIT_ITERATE("MagickResizeBlur", set_magick_blur, NULL, ACCESS_CONF | OR_ALL,
-        "Set the blur used to resize the image"),
-    AP_INIT_ITERATE("MagickResizeFactor", set_magick_factor, NULL, ACCESS_CONF | OR_ALL,
-        "Set the factor to multiply rows and columns by, such as the Device Pixel Ratio (DPR)"),
-    AP_INIT_TAKE1("MagickResizeModulus", set_magick_modulus, NULL, ACCESS_CONF | OR_ALL,
-        "Set the modulus to apply to the width and height."),
-    { NULL },
-};
-
 static FilterTypes magick_parse_filter_type(const char *filter_type)
 {
 
@@ -375,6 +287,216 @@ static FilterTypes magick_parse_filter_type(const char *filter_type)
     return UndefinedFilter;
 }
 
+static const char *magick_push_value(cmd_parms *cmd,
+        apr_array_header_t *values, const char *arg, magick_value **value,
+        const char **str)
+{
+    const char *expr_err = NULL;
+
+    magick_value *v = apr_array_push(values);
+
+    v->constant = 0;
+    v->expr = NULL;
+    *str = NULL;
+
+    /* empty values are parsed, and skipped when the request is handled */
+    if (AP_MAGICK_EXPR_IS_CONSTANT(arg) && arg[strspn(arg, " \t\r\n")]) {
+        *str = arg;
+    }
+    else {
+        v->expr = ap_expr_parse_cmd(cmd, arg, AP_EXPR_FLAG_STRING_RESULT,
+                &expr_err, NULL);
+
+        if (expr_err) {
+            return apr_pstrcat(cmd->temp_pool,
+                    "Cannot parse expression '", arg, "': ",
+                    expr_err, NULL);
+        }
+    }
+
+    *value = v;
+
+    return NULL;
+}
+
+static const char *set_magick_number(cmd_parms *cmd,
+        apr_array_header_t *values, const char *arg)
+{
+    magick_value *value;
+    const char *err, *str;
+
+    err = magick_push_value(cmd, values, arg, &value, &str);
+    if (err) {
+        return err;
+    }
+
+    if (str) {
+        errno = 0;
+        value->u.number = apr_atoi64(str);
+        if (errno == ERANGE) {
+            return apr_pstrcat(cmd->temp_pool, cmd->cmd->name, " '", str,
+                    "' out of range", NULL);
+        }
+        value->constant = 1;
+    }
+
+    return NULL;
+}
+
+static const char *set_magick_real(cmd_parms *cmd,
+        apr_array_header_t *values, const char *arg)
+{
+    magick_value *value;
+    const char *err, *str;
+    char *end;
+
+    err = magick_push_value(cmd, values, arg, &value, &str);
+    if (err) {
+        return err;
+    }
+
+    if (str) {
+        errno = 0;
+        value->u.real = strtod(str, &end);
+        if (errno == ERANGE) {
+            return apr_pstrcat(cmd->temp_pool, cmd->cmd->name, " '", str,
+                    "' out of range", NULL);
+        }
+        value->constant = 1;
+    }
+
+    return NULL;
+}
+
+static const char *set_magick_columns(cmd_parms *cmd, void *dconf, const char *arg)
+{
+    magick_conf *conf = dconf;
+
+    return set_magick_number(cmd, conf->columns, arg);
+}
+
+static const char *set_magick_rows(cmd_parms *cmd, void *dconf, const char *arg)
+{
+    magick_conf *conf = dconf;
+
+    return set_magick_number(cmd, conf->rows, arg);
+}
+
+static const char *set_magick_filter_type(cmd_parms *cmd, void *dconf, const char *arg)
+{
+    magick_conf *conf = dconf;
+    magick_value *value;
+    const char *err, *str;
+
+    err = magick_push_value(cmd, conf->filter_type, arg, &value, &str);
+    if (err) {
+        return err;
+    }
+
+    if (str) {
+        value->u.filter_type = magick_parse_filter_type(str);
+        if (value->u.filter_type == UndefinedFilter) {
+            return apr_pstrcat(cmd->temp_pool, "Filter type '", str,
+                    "' not recognised, must be one of bessel|blackman|box|"
+                    "catrom|cubic|gaussian|hamming|hanning|hermite|lanczos|"
+                    "mitchell|point|quadratic|sinc|triangle", NULL);
+        }
+        value->constant = 1;
+    }
+
+    return NULL;
+}
+
+static const char *set_magick_blur(cmd_parms *cmd, void *dconf, const char *arg)
+{
+    magick_conf *conf = dconf;
+
+    return set_magick_real(cmd, conf->blur, arg);
+}
+
+static const char *set_magick_factor(cmd_parms *cmd, void *dconf, const char *arg)
+{
+    magick_conf *conf = dconf;
+
+    return set_magick_real(cmd, conf->factor, arg);
+}
+
+static const char *set_magick_modulus(cmd_parms *cmd, void *dconf, const char *arg)
+{
+    magick_conf *conf = dconf;
+
+    if (APR_SUCCESS != apr_strtoff(&(conf->modulus), arg, NULL, 10) || conf->modulus
+            <= 0) {
+        return "MagickResizeModulus must be greater than zero";
+    }
+
+    conf->modulus_set = 1;
+
+    return NULL;
+}
+
+static const char *set_magick_engine(cmd_parms *cmd, void *dconf, const char *arg)
+{
+    magick_conf *conf = dconf;
+
+    if (!strcasecmp(arg, "graphicsmagick")) {
+        conf->engine = AP_MAGICK_RESIZE_ENGINE_MAGICK;
+    }
+    else if (!strcasecmp(arg, "fast")) {
+        conf->engine = AP_MAGICK_RESIZE_ENGINE_FAST;
+    }
+    else {
+        return "MagickResizeEngine must be one of graphicsmagick|fast";
+    }
+
+    conf->engine_set = 1;
+
+    return NULL;
+}
+
+static const char *set_magick_strategy(cmd_parms *cmd, void *dconf, const char *arg)
+{
+    magick_conf *conf = dconf;
+
+    if (!strcasecmp(arg, "direct")) {
+        conf->strategy = AP_MAGICK_RESIZE_STRATEGY_DIRECT;
+    }
+    else if (!strcasecmp(arg, "auto")) {
+        conf->strategy = AP_MAGICK_RESIZE_STRATEGY_AUTO;
+    }
+    else {
+        return "MagickResizeStrategy must be one of direct|auto";
+    }
+
+    conf->strategy_set = 1;
+
+    return NULL;
+}
+
+static const command_rec magick_cmds[] = {
+    AP_INIT_ITERATE("MagickResizeColumns", set_magick_columns, NULL, ACCESS_CONF | OR_ALL,
+        "Set the number of columns in the resized image"),
+    AP_INIT_ITERATE("MagickResizeRows", set_magick_rows, NULL, ACCESS_CONF | OR_ALL,
+        "Set the number of rows in the resized image"),
+    AP_INIT_ITERATE("MagickResizeFilterType", set_magick_filter_type, NULL, ACCESS_CONF | OR_ALL,
+        "Set the filter type used to resize the image. Must be one of bessel|blackman|box|catrom|"
+        "cubic|gaussian|hamming|hanning|hermite|lanczos|mitchell|point|"
+        "quadratic|sinc|triangle"),
+    AP_INIT_ITERATE("MagickResizeBlur", set_magick_blur, NULL, ACCESS_CONF | OR_ALL,
+        "Set the blur used to resize the image"),
+    AP_INIT_ITERATE("MagickResizeFactor", set_magick_factor, NULL, ACCESS_CONF | OR_ALL,
+        "Set the factor to multiply rows and columns by, such as the Device Pixel Ratio (DPR)"),
+    AP_INIT_TAKE1("MagickResizeModulus", set_magick_modulus, NULL, ACCESS_CONF | OR_ALL,
+        "Set the modulus to apply to the width and height."),
+    AP_INIT_TAKE1("MagickResizeEngine", set_magick_engine, NULL, ACCESS_CONF | OR_ALL,
+        "Set the engine used to resize the image. Must be one of "
+        "graphicsmagick|fast. Default is 'graphicsmagick'."),
+    AP_INIT_TAKE1("MagickResizeStrategy", set_magick_strategy, NULL, ACCESS_CONF | OR_ALL,
+        "Set the strategy used to resize the image. Must be one of "
+        "direct|auto. Default is 'direct'."),
+    { NULL },
+};
+
 static apr_status_t magick_resize_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
 {
     apr_bucket *e;
@@ -397,6 +519,7 @@ static apr_status_t magick_resize_out_filter(ap_filter_t *f, apr_bucket_brigade
                     &magick_resize_module);
 
             ap_bucket_magick *m = e->data;
+            ap_magick_op *op;
 
             unsigned long columns = 0;
             unsigned long rows = 0;
@@ -409,10 +532,15 @@ static apr_status_t magick_resize_out_filter(ap_filter_t *f, apr_bucket_brigade
                 int i;
 
                 for (i = conf->columns->nelts; i > 0;) {
-                    ap_expr_info_t *expr = APR_ARRAY_IDX(conf->columns, --i,
-                            ap_expr_info_t *);
+                    magick_value *value = &APR_ARRAY_IDX(conf->columns, --i,
+                            magick_value);
+
+                    if (value->constant) {
+                        columns = value->u.number;
+                        break;
+                    }
 
-                    str = ap_expr_str_exec(f->r, expr, &err);
+                    str = ap_expr_str_exec(f->r, value->expr, &err);
                     if (err) {
                         ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, f->r,
                                 "Failure while evaluating the columns expression for '%s', "
@@ -444,10 +572,15 @@ static apr_status_t magick_resize_out_filter(ap_filter_t *f, apr_bucket_brigade
                 int i;
 
                 for (i = conf->rows->nelts; i > 0;) {
-                    ap_expr_info_t *expr = APR_ARRAY_IDX(conf->rows, --i,
-                            ap_expr_info_t *);
+                    magick_value *value = &APR_ARRAY_IDX(conf->rows, --i,
+                            magick_value);
 
-                    str = ap_expr_str_exec(f->r, expr, &err);
+                    if (value->constant) {
+                        rows = value->u.number;
+                        break;
+                    }
+
+                    str = ap_expr_str_exec(f->r, value->expr, &err);
                     if (err) {
                         ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, f->r,
                                 "Failure while evaluating the rows expression for '%s', "
@@ -479,10 +612,15 @@ static apr_status_t magick_resize_out_filter(ap_filter_t *f, apr_bucket_brigade
                 int i;
 
                 for (i = conf->filter_type->nelts; i > 0;) {
-                    ap_expr_info_t *expr = APR_ARRAY_IDX(conf->filter_type, --i,
-                            ap_expr_info_t *);
+                    magick_value *value = &APR_ARRAY_IDX(conf->filter_type, --i,
+                            magick_value);
+
+                    if (value->constant) {
+                        filter_type = value->u.filter_type;
+                        break;
+                    }
 
-                    str = ap_expr_str_exec(f->r, expr, &err);
+                    str = ap_expr_str_exec(f->r, value->expr, &err);
                     if (err) {
                         ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, f->r,
                                 "Failure while evaluating the filtertype expression for '%s', "
@@ -517,10 +655,15 @@ static apr_status_t magick_resize_out_filter(ap_filter_t *f, apr_bucket_brigade
                 int i;
 
                 for (i = conf->blur->nelts; i > 0;) {
-                    ap_expr_info_t *expr = APR_ARRAY_IDX(conf->blur, --i,
-                            ap_expr_info_t *);
+                    magick_value *value = &APR_ARRAY_IDX(conf->blur, --i,
+                            magick_value);
 
-                    str = ap_expr_str_exec(f->r, expr, &err);
+                    if (value->constant) {
+                        blur = value->u.real;
+                        break;
+                    }
+
+                    str = ap_expr_str_exec(f->r, value->expr, &err);
                     if (err) {
                         ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, f->r,
                                 "Failure while evaluating the blur expression for '%s', "
@@ -553,10 +696,15 @@ static apr_status_t magick_resize_out_filter(ap_filter_t *f, apr_bucket_brigade
                 int i;
 
                 for (i = conf->factor->nelts; i > 0;) {
-                    ap_expr_info_t *expr = APR_ARRAY_IDX(conf->factor, --i,
-                            ap_expr_info_t *);
+                    magick_value *value = &APR_ARRAY_IDX(conf->factor, --i,
+                            magick_value);
+
+                    if (value->constant) {
+                        factor = value->u.real;
+                        break;
+                    }
 
-                    str = ap_expr_str_exec(f->r, expr, &err);
+                    str = ap_expr_str_exec(f->r, value->expr, &err);
                     if (err) {
                         ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, f->r,
                                 "Failure while evaluating the factor expression for '%s', "
@@ -600,35 +748,35 @@ static apr_status_t magick_resize_out_filter(ap_filter_t *f, apr_bucket_brigade
             }
             if (columns == 0) {
                 columns = ((unsigned long long) (rows
-                        * MagickGetImageWidth(m->wand))) / MagickGetImageHeight(
-                                m->wand);
+                        * m->columns)) / m->rows;
             }
             else if (rows == 0) {
                 rows = ((unsigned long long) (columns
-                        * MagickGetImageHeight(m->wand))) / MagickGetImageWidth(
-                                m->wand);
+                        * m->rows)) / m->columns;
             }
 
-            if (columns > MagickGetImageWidth(m->wand)) {
-                columns = MagickGetImageWidth(m->wand);
+            if (columns > m->columns) {
+                columns = m->columns;
             }
-            if (rows > MagickGetImageHeight(m->wand)) {
-                rows = MagickGetImageHeight(m->wand);
+            if (rows > m->rows) {
+                rows = m->rows;
             }
 
-            if (!MagickResizeImage(m->wand, columns, rows,
-                    filter_type, blur)) {
-                char *description;
-                ExceptionType severity;
+            if (columns == m->columns && rows == m->rows) {
+                /* already the right size, do nothing */
+                continue;
+            }
 
-                description = MagickGetException(m->wand, &severity);
-                ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_EGENERAL, f->r,
-                        "MagickResizeImage: %s (severity %d)", description,
-                        severity);
-                MagickRelinquishMemory(description);
+            op = ap_bucket_magick_op_add(e, AP_MAGICK_OP_RESIZE);
+            op->u.resize.columns = columns;
+            op->u.resize.rows = rows;
+            op->u.resize.filter_type = filter_type;
+            op->u.resize.blur = blur;
+            op->u.resize.engine = conf->engine;
+            op->u.resize.strategy = conf->strategy;
 
-                return APR_EGENERAL;
-            }
+            m->columns = columns;
+            m->rows = rows;
 
         }
 
@@ -28,8 +28,13 @@
  *   </If>
  * </Location>
  *
- * The magick strip filter has no directives, when present metadata is
- * stripped.
+ * When present, metadata is stripped. If no other filter changes the
+ * image, JPEG and PNG images are stripped directly without decoding the
+ * image, removing APPn and COM segments from JPEG images and ancillary
+ * chunks from PNG images, leaving the image data untouched.
+ *
+ * The MagickStripKeepICC directive, when on, keeps the ICC colour profile
+ * of the image while stripping the remaining metadata. Default is off.
  */
 
 #include <apr_strings.h>
@@ -44,6 +49,46 @@
 
 module AP_MODULE_DECLARE_DATA magick_strip_module;
 
+typedef struct magick_conf {
+    int keep_icc_set:1; /* has keep icc been set */
+    int keep_icc; /* keep the icc profile */
+} magick_conf;
+
+static void *create_magick_dir_config(apr_pool_t *p, char *dummy)
+{
+    magick_conf *new = (magick_conf *) apr_pcalloc(p, sizeof(magick_conf));
+
+    return (void *) new;
+}
+
+static void *merge_magick_dir_config(apr_pool_t *p, void *basev, void *addv)
+{
+    magick_conf *new = (magick_conf *) apr_pcalloc(p, sizeof(magick_conf));
+    magick_conf *add = (magick_conf *) addv;
+    magick_conf *base = (magick_conf *) basev;
+
+    new->keep_icc = (add->keep_icc_set == 0) ? base->keep_icc : add->keep_icc;
+    new->keep_icc_set = add->keep_icc_set || base->keep_icc_set;
+
+    return new;
+}
+
+static const char *set_magick_keep_icc(cmd_parms *cmd, void *dconf, int flag)
+{
+    magick_conf *conf = dconf;
+
+    conf->keep_icc = flag;
+    conf->keep_icc_set = 1;
+
+    return NULL;
+}
+
+static const command_rec magick_cmds[] = {
+    AP_INIT_FLAG("MagickStripKeepICC", set_magick_keep_icc, NULL, ACCESS_CONF | OR_ALL,
+        "Keep the ICC colour profile while stripping metadata. Default is off."),
+    { NULL },
+};
+
 static apr_status_t magick_strip_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
 {
     apr_bucket *e;
@@ -62,20 +107,16 @@ static apr_status_t magick_strip_out_filter(ap_filter_t *f, apr_bucket_brigade *
         /* Magick bucket? */
         if (AP_BUCKET_IS_MAGICK(e)) {
 
-            ap_bucket_magick *m = e->data;
-
-            if (!MagickStripImage(m->wand)) {
-                char *description;
-                ExceptionType severity;
+            magick_conf *conf = ap_get_module_config(f->r->per_dir_config,
+                    &magick_strip_module);
 
-                description = MagickGetException(m->wand, &severity);
-                ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_EGENERAL, f->r,
-                        "MagickStripImage: %s (severity %d)", description,
-                        severity);
-                MagickRelinquishMemory(description);
+            ap_magick_op *op;
 
-                return APR_EGENERAL;
-            }
+            /* stripping is deferred until the image is rendered, so that
+             * we can strip without decoding if nothing else changes.
+             */
+            op = ap_bucket_magick_op_add(e, AP_MAGICK_OP_STRIP);
+            op->u.strip.keep_icc = conf->keep_icc;
 
         }
 
@@ -94,10 +135,10 @@ static void register_hooks(apr_pool_t *p)
 AP_DECLARE_MODULE(magick_strip) =
 {
     STANDARD20_MODULE_STUFF,
-    NULL,                     /* dir config creater */
-    NULL,                     /* dir merger --- default is to override */
+    create_magick_dir_config, /* dir config creater */
+    merge_magick_dir_config,  /* dir merger --- default is to override */
     NULL,                     /* server config */
     NULL,                     /* merge server config */
-    NULL,                     /* command apr_table_t */
+    magick_cmds,              /* command apr_table_t */
     register_hooks            /* register hooks */
 };
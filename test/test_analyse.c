@@ -0,0 +1,448 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Test the analysis of source images and pixels used by mod_magick, on
+ * images and pixels made up by the test, without httpd or GraphicsMagick.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "magick_analyse.h"
+
+static const unsigned char luminance[64] = {
+        16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55,
+        14, 13, 16, 24, 40, 57, 69, 56, 14, 17, 22, 29, 51, 87, 80, 62,
+        18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92,
+        49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103,
+        99 };
+
+/*
+ * Write the quantization table the IJG encoder uses for the quality, as a
+ * table of the given id and precision. Returns the length written.
+ */
+static apr_size_t test_dqt_table(unsigned char *out, int quality, int id,
+        int precision)
+{
+    long scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+    apr_size_t len = 0;
+    int i;
+
+    out[len++] = (precision << 4) | id;
+    for (i = 0; i < 64; i++) {
+        long value = (luminance[i] * scale + 50) / 100;
+
+        value = value < 1 ? 1 : value > 255 ? 255 : value;
+        if (precision) {
+            out[len++] = 0;
+        }
+        out[len++] = (unsigned char)value;
+    }
+
+    return len;
+}
+
+/*
+ * Make the headers of a JPEG image up to the start of scan, with an APP0
+ * segment, and one DQT segment holding the tables given.
+ */
+static apr_size_t test_jpeg(unsigned char *out, int quality, int chroma_first,
+        int precision)
+{
+    static const unsigned char app0[] = {
+            0xFF, 0xE0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1,
+            0, 0 };
+    apr_size_t len = 0, seg;
+
+    out[len++] = 0xFF;
+    out[len++] = 0xD8;
+    memcpy(out + len, app0, sizeof(app0));
+    len += sizeof(app0);
+
+    out[len++] = 0xFF;
+    out[len++] = 0xDB;
+    seg = len;
+    len += 2;
+    if (chroma_first) {
+        len += test_dqt_table(out + len, quality, 1, precision);
+    }
+    len += test_dqt_table(out + len, quality, 0, precision);
+    out[seg] = (unsigned char)((len - seg) >> 8);
+    out[seg + 1] = (unsigned char)(len - seg);
+
+    out[len++] = 0xFF;
+    out[len++] = 0xDA;
+    out[len++] = 0x00;
+    out[len++] = 0x02;
+
+    return len;
+}
+
+static int test_jpeg_quality(void)
+{
+    static const int qualities[] = { 1, 10, 25, 50, 60, 75, 85, 90, 95, 100 };
+    unsigned char jpeg[512];
+    apr_size_t len;
+    unsigned int i;
+    int failed = 0;
+
+    for (i = 0; i < sizeof(qualities) / sizeof(qualities[0]); i++) {
+        int precision, chroma_first;
+
+        for (precision = 0; precision <= 1; precision++) {
+            for (chroma_first = 0; chroma_first <= 1; chroma_first++) {
+                int estimate;
+
+                len = test_jpeg(jpeg, qualities[i], chroma_first, precision);
+                estimate = magick_jpeg_quality(jpeg, len);
+                if (estimate < qualities[i] - 1
+                        || estimate > qualities[i] + 1) {
+                    printf("FAIL: jpeg quality %d estimated as %d, %d bit, "
+                            "%s\n", qualities[i], estimate,
+                            precision ? 16 : 8,
+                            chroma_first ? "chroma first" : "luma first");
+                    failed++;
+                }
+            }
+        }
+    }
+
+    /* not a JPEG */
+    if (magick_jpeg_quality((const unsigned char *)"GIF89a", 6)) {
+        printf("FAIL: jpeg quality of a GIF\n");
+        failed++;
+    }
+
+    /* the scan starts before any table */
+    len = test_jpeg(jpeg, 75, 0, 0);
+    memmove(jpeg + 2, jpeg + len - 4, 4);
+    if (magick_jpeg_quality(jpeg, 6)) {
+        printf("FAIL: jpeg quality without tables\n");
+        failed++;
+    }
+
+    /* every truncation is rejected or estimated, never read beyond */
+    len = test_jpeg(jpeg, 75, 1, 1);
+    while (--len) {
+        unsigned char *copy = malloc(len);
+        int estimate;
+
+        memcpy(copy, jpeg, len);
+        estimate = magick_jpeg_quality(copy, len);
+        free(copy);
+        if (estimate && (estimate < 74 || estimate > 76)) {
+            printf("FAIL: jpeg quality of %lu bytes estimated as %d\n",
+                    (unsigned long)len, estimate);
+            failed++;
+        }
+    }
+
+    printf("%s: jpeg quality\n", failed ? "FAIL" : "ok");
+
+    return failed;
+}
+
+/*
+ * Count the distinct RGBA values of the pixels the slow way, as the
+ * quantizer sees them.
+ */
+static unsigned long test_distinct(const unsigned char *px, unsigned long n)
+{
+    unsigned long i, j, count = 0;
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < i; j++) {
+            if (!memcmp(px + j * 4, px + i * 4, 4)) {
+                break;
+            }
+        }
+        if (j == i) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+static unsigned long test_count(const unsigned char *px, unsigned long columns,
+        unsigned long rows, unsigned long limit, int *alpha)
+{
+    magick_colors c;
+    unsigned long count = 0, y;
+
+    if (!magick_colors_make(&c, limit)) {
+        return 0;
+    }
+    for (y = 0; y < rows && count <= limit; y++) {
+        count = magick_colors_add(&c, px + y * columns * 4, columns);
+    }
+    *alpha = c.alpha;
+    magick_colors_free(&c);
+
+    return count;
+}
+
+static int test_colors(void)
+{
+    static const unsigned long opaque[] = { 1, 2, 255, 256, 257, 1000 };
+    unsigned long columns = 64, rows = 64, n = columns * rows, i, count;
+    unsigned char *px = malloc(n * 4);
+    unsigned int t;
+    int alpha, failed = 0;
+
+    /* opaque colors, each repeated, either side of the limit */
+    for (t = 0; t < sizeof(opaque) / sizeof(opaque[0]); t++) {
+        unsigned long expected = opaque[t] > 256 ? 257 : opaque[t];
+
+        for (i = 0; i < n; i++) {
+            unsigned long color = (i * 7) % opaque[t];
+            px[i * 4] = (unsigned char)color;
+            px[i * 4 + 1] = (unsigned char)(color >> 8);
+            px[i * 4 + 2] = 0x55;
+            px[i * 4 + 3] = 255;
+        }
+        count = test_count(px, columns, rows, 256, &alpha);
+        if (count != expected || alpha) {
+            printf("FAIL: %lu opaque colors counted as %lu, alpha %d\n",
+                    opaque[t], count, alpha);
+            failed++;
+        }
+    }
+
+    /* every pixel a different hidden color under full transparency, but
+     * for one opaque and one translucent red */
+    for (i = 0; i < n; i++) {
+        px[i * 4] = (unsigned char)i;
+        px[i * 4 + 1] = (unsigned char)(i >> 8);
+        px[i * 4 + 2] = (unsigned char)(i * 3);
+        px[i * 4 + 3] = 0;
+    }
+    memcpy(px + 10 * 4, "\xff\0\0\xff", 4);
+    memcpy(px + 20 * 4, "\xff\0\0\x80", 4);
+
+    count = test_count(px, columns, rows, 256, &alpha);
+    if (count != 3 || !alpha) {
+        printf("FAIL: transparent pixels counted as %lu colors, alpha %d\n",
+                count, alpha);
+        failed++;
+    }
+
+    /* once cleared, the quantizer sees the colors that were counted */
+    for (i = 0; i < rows; i++) {
+        magick_colors_clear(px + i * columns * 4, columns);
+    }
+    if (test_distinct(px, n) != count) {
+        printf("FAIL: %lu colors after clearing, %lu counted\n",
+                test_distinct(px, n), count);
+        failed++;
+    }
+    if (memcmp(px + 10 * 4, "\xff\0\0\xff", 4)
+            || memcmp(px + 20 * 4, "\xff\0\0\x80", 4)) {
+        printf("FAIL: clearing changed a visible pixel\n");
+        failed++;
+    }
+    if (magick_colors_clear(px, columns)) {
+        printf("FAIL: clearing a cleared row changed it\n");
+        failed++;
+    }
+
+    /* a lossy limit larger than a palette */
+    for (i = 0; i < n; i++) {
+        px[i * 4] = (unsigned char)i;
+        px[i * 4 + 1] = (unsigned char)(i >> 8);
+        px[i * 4 + 2] = 0;
+        px[i * 4 + 3] = 255;
+    }
+    count = test_count(px, columns, rows, 4000, &alpha);
+    if (count != 4001) {
+        printf("FAIL: %lu colors counted as %lu with limit 4000\n", n, count);
+        failed++;
+    }
+    count = test_count(px, columns, rows, 5000, &alpha);
+    if (count != n) {
+        printf("FAIL: %lu colors counted as %lu with limit 5000\n", n, count);
+        failed++;
+    }
+
+    free(px);
+
+    printf("%s: colors\n", failed ? "FAIL" : "ok");
+
+    return failed;
+}
+
+/*
+ * Classify the RGB pixels made by the pattern, row by row as mod_magick does.
+ */
+static magick_content_e test_classify(int pattern, int alpha,
+        magick_content_stats *stats)
+{
+    unsigned char row[3 * 200];
+    unsigned long x, y;
+    unsigned int seed = 1;
+
+    memset(stats, 0, sizeof(*stats));
+
+    for (y = 0; y < 100; y++) {
+        for (x = 0; x < 200; x++) {
+            unsigned char *p = row + x * 3;
+
+            switch (pattern) {
+            case 0:
+                /* flat bands with hard edges, like a chart or a logo */
+                p[0] = (x / 25) % 2 ? 230 : 20;
+                p[1] = (y / 20) % 2 ? 40 : 200;
+                p[2] = 90;
+                break;
+            case 1:
+                /* a steep gradient, smooth but never flat */
+                p[0] = p[1] = p[2] = (unsigned char)(x * 3 + y);
+                break;
+            default:
+                /* noise, like the texture of a photograph */
+                seed = seed * 1103515245 + 12345;
+                p[0] = p[1] = p[2] = (unsigned char)(128
+                        + (int)((seed >> 16) % 41) - 20);
+                break;
+            }
+        }
+        magick_content_add(stats, row, 200);
+    }
+
+    return magick_content_choose(stats, alpha);
+}
+
+static int test_content(void)
+{
+    static const struct {
+        int pattern;
+        int alpha;
+        magick_content_e expected;
+    } cases[] = {
+        { 0, 0, MAGICK_CONTENT_GRAPHIC },
+        { 0, 1, MAGICK_CONTENT_GRAPHIC },
+        { 1, 0, MAGICK_CONTENT_PHOTO },
+        { 1, 1, MAGICK_CONTENT_PHOTO_ALPHA },
+        { 2, 0, MAGICK_CONTENT_PHOTO },
+        { 2, 1, MAGICK_CONTENT_PHOTO_ALPHA }
+    };
+    magick_content_stats stats;
+    unsigned int i;
+    int failed = 0;
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        magick_content_e content = test_classify(cases[i].pattern,
+                cases[i].alpha, &stats);
+
+        if (content != cases[i].expected) {
+            printf("FAIL: pattern %d, alpha %d, classified as %d, %lu of %lu "
+                    "pairs flat and %lu edges\n", cases[i].pattern,
+                    cases[i].alpha, content, (unsigned long)stats.flat,
+                    (unsigned long)stats.pairs, (unsigned long)stats.edges);
+            failed++;
+        }
+    }
+
+    /* pairs do not span rows */
+    memset(&stats, 0, sizeof(stats));
+    magick_content_add(&stats, (const unsigned char *)"\0\0\0", 1);
+    magick_content_add(&stats, (const unsigned char *)"\xff\xff\xff", 1);
+    if (stats.pairs) {
+        printf("FAIL: %lu pairs across rows of one pixel\n",
+                (unsigned long)stats.pairs);
+        failed++;
+    }
+
+    /* nothing to go on */
+    if (magick_content_choose(&stats, 0) != MAGICK_CONTENT_PHOTO) {
+        printf("FAIL: no pairs not classified as a photo\n");
+        failed++;
+    }
+
+    printf("%s: content\n", failed ? "FAIL" : "ok");
+
+    return failed;
+}
+
+static int test_frames(void)
+{
+    /* a sprite moving right over a transparent background */
+    static const unsigned char frame1[] = {
+        0xff, 0, 0, 0xff,  0, 0, 0, 0,  0, 0, 0, 0
+    };
+    static const unsigned char frame2[] = {
+        0, 0, 0, 0,  0xff, 0, 0, 0xff,  0, 0, 0, 0
+    };
+    /* the sprite changing color where it is */
+    static const unsigned char frame3[] = {
+        0, 0, 0, 0,  0, 0xff, 0, 0xff,  0, 0, 0, 0
+    };
+    /* the same, half transparent */
+    static const unsigned char frame4[] = {
+        0, 0, 0, 0,  0, 0xff, 0, 0x80,  0, 0, 0, 0
+    };
+    /* fully opaque everywhere */
+    static const unsigned char frame5[] = {
+        0, 0, 0xff, 0xff,  0, 0, 0xff, 0xff,  0, 0, 0xff, 0xff
+    };
+    int failed = 0;
+
+    if (magick_frames_overlay(frame1, frame2, 3)) {
+        printf("FAIL: an opaque pixel turned transparent drawn over\n");
+        failed++;
+    }
+    if (!magick_frames_overlay(frame2, frame3, 3)) {
+        printf("FAIL: an opaque pixel changing color not drawn over\n");
+        failed++;
+    }
+    if (magick_frames_overlay(frame3, frame4, 3)) {
+        printf("FAIL: a half transparent pixel drawn over\n");
+        failed++;
+    }
+    if (!magick_frames_overlay(frame4, frame5, 3)
+            || !magick_frames_overlay(frame1, frame5, 3)) {
+        printf("FAIL: an opaque frame not drawn over\n");
+        failed++;
+    }
+    if (magick_frames_overlay(frame5, frame1, 3)) {
+        printf("FAIL: a transparent frame drawn over an opaque one\n");
+        failed++;
+    }
+    if (!magick_frames_overlay(frame5, frame1, 1)) {
+        printf("FAIL: an opaque pixel not drawn over\n");
+        failed++;
+    }
+
+    printf("%s: frames\n", failed ? "FAIL" : "ok");
+
+    return failed;
+}
+
+int main(void)
+{
+    int failed = 0;
+
+    failed += test_jpeg_quality();
+    failed += test_colors();
+    failed += test_content();
+    failed += test_frames();
+
+    printf("%d failed\n", failed);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,314 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Test the BlurHash and dominant color of the placeholders made by
+ * mod_magick_placeholder, by decoding the hashes of images made up by the
+ * test, without httpd or GraphicsMagick.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "magick_blurhash.h"
+
+#define SIZE 32
+
+/*
+ * The basis of BlurHash samples a half period of each cosine, which leaks
+ * about 2 / SIZE of the average into every component, on top of the error
+ * of quantizing.
+ */
+#define TOLERANCE 0.06
+
+static const char digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+        "abcdefghijklmnopqrstuvwxyz#$%*+,-.:;=?@[]^_{|}~";
+
+/*
+ * Decode base83 digits, or return -1 for a character outside the alphabet.
+ */
+static long test_base83(const char *in, int length)
+{
+    long value = 0;
+    int i;
+
+    for (i = 0; i < length; i++) {
+        const char *d = in[i] ? strchr(digits, in[i]) : NULL;
+
+        if (!d) {
+            return -1;
+        }
+        value = value * 83 + (d - digits);
+    }
+
+    return value;
+}
+
+static double test_linear(int value)
+{
+    double v = value / 255.0;
+
+    return v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+}
+
+static unsigned char test_srgb(double value)
+{
+    double v = value < 0 ? 0 : value > 1 ? 1 : value;
+
+    return (unsigned char)(v <= 0.0031308 ? v * 12.92 * 255 + 0.5
+            : (1.055 * pow(v, 1 / 2.4) - 0.055) * 255 + 0.5);
+}
+
+/*
+ * Decode a BlurHash into the sRGB average color and the linear AC factors.
+ * Returns the number of components, or zero if the hash is malformed.
+ */
+static int test_decode(const char *hash, int *nx, int *ny, int dc[3],
+        double factors[][3])
+{
+    long size, quantised, value;
+    double max;
+    int k, c;
+
+    size = test_base83(hash, 1);
+    if (size < 0) {
+        return 0;
+    }
+    *nx = size % 9 + 1;
+    *ny = size / 9 + 1;
+    if (strlen(hash) != (apr_size_t)MAGICK_BLURHASH_LEN(*nx, *ny)) {
+        return 0;
+    }
+
+    quantised = test_base83(hash + 1, 1);
+    max = (quantised + 1) / 166.0;
+
+    value = test_base83(hash + 2, 4);
+    if (quantised < 0 || value < 0) {
+        return 0;
+    }
+    dc[0] = (int)(value >> 16);
+    dc[1] = (int)((value >> 8) & 255);
+    dc[2] = (int)(value & 255);
+
+    for (k = 1; k < *nx * *ny; k++) {
+        value = test_base83(hash + 4 + k * 2, 2);
+        if (value < 0 || value >= 19 * 19 * 19) {
+            return 0;
+        }
+        for (c = 2; c >= 0; c--) {
+            double q = (value % 19 - 9) / 9.0;
+
+            factors[k][c] = (q < 0 ? -q * q : q * q) * max;
+            value /= 19;
+        }
+    }
+
+    return *nx * *ny;
+}
+
+static int test_solid(void)
+{
+    unsigned char rgb[SIZE * SIZE * 3];
+    char hash[MAGICK_BLURHASH_LEN(4, 3) + 1];
+    double factors[9 * 9][3];
+    int i, k, c, nx, ny, dc[3], failed = 0;
+
+    for (i = 0; i < SIZE * SIZE; i++) {
+        rgb[i * 3] = 200;
+        rgb[i * 3 + 1] = 100;
+        rgb[i * 3 + 2] = 50;
+    }
+
+    magick_blurhash(hash, rgb, SIZE, SIZE, 4, 3);
+    if (!test_decode(hash, &nx, &ny, dc, factors) || nx != 4 || ny != 3) {
+        printf("FAIL: solid color hashed as malformed %s\n", hash);
+        return 1;
+    }
+
+    /* the average is exact, C8 64 32 in base83 */
+    if (strncmp(hash, "L", 1) || strncmp(hash + 2, "M|T9", 4)) {
+        printf("FAIL: solid color hashed as %s\n", hash);
+        failed++;
+    }
+
+    for (k = 1; k < nx * ny; k++) {
+        for (c = 0; c < 3; c++) {
+            if (fabs(factors[k][c]) > TOLERANCE) {
+                printf("FAIL: solid color component %d channel %d is %.3f, "
+                        "hash %s\n", k, c, factors[k][c], hash);
+                failed++;
+            }
+        }
+    }
+
+    printf("%s: blurhash of a solid color\n", failed ? "FAIL" : "ok");
+
+    return failed;
+}
+
+/*
+ * An image whose linear light follows one cosine along the axis, which
+ * must decode to one strong component and no others.
+ */
+static int test_cosine(int vertical)
+{
+    unsigned char rgb[SIZE * SIZE * 3];
+    char hash[MAGICK_BLURHASH_LEN(4, 3) + 1];
+    double factors[9 * 9][3], mean[3] = { 0, 0, 0 };
+    int x, y, nx, ny, k, c, dc[3], failed = 0;
+
+    for (y = 0; y < SIZE; y++) {
+        for (x = 0; x < SIZE; x++) {
+            double v = cos(M_PI * (vertical ? y : x) / SIZE);
+            unsigned char *px = rgb + (y * SIZE + x) * 3;
+
+            px[0] = test_srgb(0.5 + 0.4 * v);
+            px[1] = test_srgb(0.3 - 0.2 * v);
+            px[2] = test_srgb(0.2);
+            for (c = 0; c < 3; c++) {
+                mean[c] += test_linear(px[c]) / (SIZE * SIZE);
+            }
+        }
+    }
+
+    magick_blurhash(hash, rgb, SIZE, SIZE, 4, 3);
+    if (!test_decode(hash, &nx, &ny, dc, factors) || nx != 4 || ny != 3) {
+        printf("FAIL: %s cosine hashed as malformed %s\n",
+                vertical ? "vertical" : "horizontal", hash);
+        return 1;
+    }
+
+    for (c = 0; c < 3; c++) {
+        if (abs(dc[c] - test_srgb(mean[c])) > 1) {
+            printf("FAIL: average %d of channel %d, expected %d\n", dc[c], c,
+                    test_srgb(mean[c]));
+            failed++;
+        }
+    }
+
+    for (k = 1; k < nx * ny; k++) {
+        int strong = k == (vertical ? nx : 1);
+        static const double expected[3] = { 0.4, -0.2, 0 };
+
+        for (c = 0; c < 3; c++) {
+            double want = strong ? expected[c] : 0;
+
+            if (fabs(factors[k][c] - want) > TOLERANCE) {
+                printf("FAIL: %s cosine component %d channel %d is %.3f, "
+                        "expected %.3f, hash %s\n",
+                        vertical ? "vertical" : "horizontal", k, c,
+                        factors[k][c], want, hash);
+                failed++;
+            }
+        }
+    }
+
+    printf("%s: blurhash of a %s cosine\n", failed ? "FAIL" : "ok",
+            vertical ? "vertical" : "horizontal");
+
+    return failed;
+}
+
+static int test_components(void)
+{
+    unsigned char rgb[SIZE * SIZE * 3];
+    char hash[MAGICK_BLURHASH_LEN(9, 9) + 1];
+    double factors[9 * 9][3];
+    int cx, cy, nx, ny, dc[3], i, failed = 0;
+    unsigned int seed = 1;
+
+    for (i = 0; i < SIZE * SIZE * 3; i++) {
+        seed = seed * 1103515245 + 12345;
+        rgb[i] = (unsigned char)(seed >> 16);
+    }
+
+    for (cy = 1; cy <= MAGICK_BLURHASH_COMPONENTS_MAX; cy++) {
+        for (cx = 1; cx <= MAGICK_BLURHASH_COMPONENTS_MAX; cx++) {
+            memset(hash, 'X', sizeof(hash));
+            magick_blurhash(hash, rgb, SIZE, SIZE, cx, cy);
+            if (!test_decode(hash, &nx, &ny, dc, factors) || nx != cx
+                    || ny != cy) {
+                printf("FAIL: %dx%d components hashed as %s\n", cx, cy,
+                        hash);
+                failed++;
+            }
+        }
+    }
+
+    printf("%s: blurhash components\n", failed ? "FAIL" : "ok");
+
+    return failed;
+}
+
+static int test_color(void)
+{
+    unsigned char rgb[SIZE * SIZE * 3], color[3];
+    int i, failed = 0;
+
+    /* three fifths are two shades, as many of each, that reduce to the same
+     * color */
+    for (i = 0; i < SIZE * SIZE; i++) {
+        unsigned char *px = rgb + i * 3;
+
+        if (i % 10 < 6) {
+            px[0] = i % 2 ? 10 : 12;
+            px[1] = i % 2 ? 20 : 22;
+            px[2] = i % 2 ? 30 : 28;
+        }
+        else {
+            px[0] = 200;
+            px[1] = px[2] = 0;
+        }
+    }
+
+    if (!magick_blurhash_color(color, rgb, SIZE, SIZE)) {
+        printf("FAIL: no dominant color\n");
+        failed++;
+    }
+    else if (color[0] != 11 || color[1] != 21 || color[2] != 29) {
+        printf("FAIL: dominant color %d,%d,%d, expected 11,21,29\n",
+                color[0], color[1], color[2]);
+        failed++;
+    }
+
+    if (!magick_blurhash_color(color, rgb, 0, 0) || color[0] || color[1]
+            || color[2]) {
+        printf("FAIL: dominant color of an empty image is not black\n");
+        failed++;
+    }
+
+    printf("%s: dominant color\n", failed ? "FAIL" : "ok");
+
+    return failed;
+}
+
+int main(void)
+{
+    int failed = 0;
+
+    failed += test_solid();
+    failed += test_cosine(0);
+    failed += test_cosine(1);
+    failed += test_components();
+    failed += test_color();
+
+    printf("%d failed\n", failed);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,250 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Compare the fixed point resize engine used by MagickResizeEngine fast
+ * with MagickResizeImage, allowing a small error per channel, compare
+ * the SIMD kernels chosen for this CPU with the scalar kernels, and compare
+ * the resize made one row at a time while streaming with the resize of the
+ * whole image. The last two must agree exactly.
+ *
+ * The tolerance can be changed with the MAGICK_TEST_TOLERANCE environment
+ * variable.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <wand/wand_api.h>
+
+#include "magick_resample.h"
+
+#define DEFAULT_TOLERANCE 3
+
+typedef struct test_size {
+    unsigned long in_columns;
+    unsigned long in_rows;
+    unsigned long columns;
+    unsigned long rows;
+} test_size;
+
+static const test_size sizes[] = {
+    { 640, 480, 200, 150 },
+    { 333, 517, 101, 37 },
+    { 64, 48, 109, 83 },
+    { 1000, 10, 7, 10 },
+    { 97, 89, 96, 88 }
+};
+
+static const FilterTypes filters[] = {
+    BoxFilter, TriangleFilter, HermiteFilter, CubicFilter, CatromFilter,
+    MitchellFilter, LanczosFilter
+};
+
+/*
+ * A smooth pattern with some detail, so that every tap of the filters
+ * contributes, without the hard edges where rounding differences are
+ * amplified by ringing.
+ */
+static void test_pattern(unsigned char *px, unsigned long columns,
+        unsigned long rows, int channels)
+{
+    unsigned long x, y;
+    int ch;
+
+    for (y = 0; y < rows; y++) {
+        for (x = 0; x < columns; x++) {
+            for (ch = 0; ch < channels; ch++) {
+                double v = 127.5 + 60.0 * sin((x * (ch + 1)) / 7.0)
+                        + 60.0 * cos((y * (ch + 2)) / 11.0);
+
+                if (ch == 3) {
+                    v = 255.0 * (x + y) / (columns + rows);
+                }
+                *px++ = (unsigned char)(v < 0 ? 0 : v > 255 ? 255 : v + 0.5);
+            }
+        }
+    }
+}
+
+static int test_against_magick(const test_size *size, FilterTypes filter,
+        int channels, int tolerance)
+{
+    const char *map = channels == 4 ? "RGBA" : "RGB";
+    apr_size_t in_len = (apr_size_t)size->in_columns * size->in_rows
+            * channels;
+    apr_size_t len = (apr_size_t)size->columns * size->rows * channels;
+    unsigned char *in = malloc(in_len);
+    unsigned char *out = malloc(len);
+    unsigned char *expected = malloc(len);
+    MagickWand *wand = NewMagickWand();
+    apr_size_t i;
+    int worst = 0, rv = 0;
+
+    test_pattern(in, size->in_columns, size->in_rows, channels);
+
+    if (!MagickSetSize(wand, size->in_columns, size->in_rows)
+            || !MagickReadImage(wand, "xc:black")
+            || !MagickSetImageMatte(wand, channels == 4)
+            || !MagickSetImagePixels(wand, 0, 0, size->in_columns,
+                    size->in_rows, map, CharPixel, in)
+            || !MagickResizeImage(wand, size->columns, size->rows, filter, 1.0)
+            || !MagickGetImagePixels(wand, 0, 0, size->columns, size->rows,
+                    map, CharPixel, expected)) {
+        printf("FAIL: GraphicsMagick could not resize the image\n");
+        rv = 1;
+    }
+    else if (!magick_resample(in, size->in_columns, size->in_rows, out,
+            size->columns, size->rows, channels, filter, 1.0)) {
+        printf("FAIL: filter %d not supported\n", filter);
+        rv = 1;
+    }
+    else {
+        for (i = 0; i < len; i++) {
+            int diff = abs(out[i] - expected[i]);
+            if (diff > worst) {
+                worst = diff;
+            }
+        }
+        rv = worst > tolerance;
+    }
+
+    printf("%s: filter %d, %s, %lux%lu to %lux%lu, largest error %d\n",
+            rv ? "FAIL" : "ok", filter, map, size->in_columns, size->in_rows,
+            size->columns, size->rows, worst);
+
+    DestroyMagickWand(wand);
+    free(in);
+    free(out);
+    free(expected);
+
+    return rv;
+}
+
+static int test_kernels(const test_size *size, FilterTypes filter,
+        int channels)
+{
+    magick_resample_horiz_fn horiz4 = magick_resample_horiz4;
+    magick_resample_vert_fn vert = magick_resample_vert;
+    apr_size_t len = (apr_size_t)size->columns * size->rows * channels;
+    unsigned char *in = malloc((apr_size_t)size->in_columns * size->in_rows
+            * channels);
+    unsigned char *out = malloc(len);
+    unsigned char *expected = malloc(len);
+    int rv;
+
+    test_pattern(in, size->in_columns, size->in_rows, channels);
+
+    magick_resample(in, size->in_columns, size->in_rows, out, size->columns,
+            size->rows, channels, filter, 1.0);
+
+    magick_resample_horiz4 = magick_resample_horiz_scalar;
+    magick_resample_vert = magick_resample_vert_scalar;
+    magick_resample(in, size->in_columns, size->in_rows, expected,
+            size->columns, size->rows, channels, filter, 1.0);
+    magick_resample_horiz4 = horiz4;
+    magick_resample_vert = vert;
+
+    rv = memcmp(out, expected, len) != 0;
+    if (rv) {
+        printf("FAIL: kernels differ from scalar, filter %d, %d channels, "
+                "%lux%lu to %lux%lu\n", filter, channels, size->in_columns,
+                size->in_rows, size->columns, size->rows);
+    }
+
+    free(in);
+    free(out);
+    free(expected);
+
+    return rv;
+}
+
+static int test_stream(const test_size *size, FilterTypes filter)
+{
+    apr_size_t len = (apr_size_t)size->columns * size->rows * 4;
+    unsigned char *in = malloc((apr_size_t)size->in_columns * size->in_rows
+            * 4);
+    unsigned char *out = malloc(len);
+    unsigned char *expected = malloc(len);
+    magick_resample_stream stream;
+    unsigned long y;
+    int rv;
+
+    test_pattern(in, size->in_columns, size->in_rows, 4);
+    memset(out, 0, len);
+
+    magick_resample(in, size->in_columns, size->in_rows, expected,
+            size->columns, size->rows, 4, filter, 1.0);
+
+    if (!magick_resample_stream_make(&stream, size->in_columns,
+            size->in_rows, out, size->columns, size->rows, filter, 1.0)) {
+        printf("FAIL: could not stream, filter %d\n", filter);
+        rv = 1;
+    }
+    else {
+        for (y = 0; y < size->in_rows; y++) {
+            magick_resample_stream_row(&stream,
+                    in + (apr_size_t)y * size->in_columns * 4);
+        }
+
+        rv = stream.out_y != size->rows || memcmp(out, expected, len) != 0;
+        if (rv) {
+            printf("FAIL: streamed %lu of %lu rows differ from the whole "
+                    "image, filter %d, %lux%lu to %lux%lu\n", stream.out_y,
+                    size->rows, filter, size->in_columns, size->in_rows,
+                    size->columns, size->rows);
+        }
+
+        magick_resample_stream_free(&stream);
+    }
+
+    free(in);
+    free(out);
+    free(expected);
+
+    return rv;
+}
+
+int main(void)
+{
+    const char *env = getenv("MAGICK_TEST_TOLERANCE");
+    int tolerance = env ? atoi(env) : DEFAULT_TOLERANCE;
+    int failed = 0;
+    unsigned int s, f;
+    int channels;
+
+    InitializeMagick(NULL);
+    magick_resample_init();
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (f = 0; f < sizeof(filters) / sizeof(filters[0]); f++) {
+            for (channels = 3; channels <= 4; channels++) {
+                failed += test_against_magick(&sizes[s], filters[f],
+                        channels, tolerance);
+                failed += test_kernels(&sizes[s], filters[f], channels);
+            }
+            failed += test_stream(&sizes[s], filters[f]);
+        }
+    }
+
+    DestroyMagick();
+
+    printf("%d failed\n", failed);
+
+    return failed ? 1 : 0;
+}
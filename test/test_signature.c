@@ -0,0 +1,114 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Test the data covered by default by the signature, so that no URL other
+ * than the one signed carries the same data.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "magick_signature.h"
+
+#define SIG "0123456789abcdef0123456789abcdef01234567"
+
+typedef struct test_case {
+    const char *uri;
+    const char *expires_name;
+    const char *expected; /* the data, or NULL if the URI is rejected */
+} test_case;
+
+static const test_case cases[] = {
+    /* the signed URL, and the same URL without the parameters */
+    { "/img.jpg?w=100&e=1700000000&s=" SIG, "e", "/img.jpg?w=100" },
+    { "/img.jpg?s=" SIG "&w=100&e=1700000000", "e", "/img.jpg?w=100" },
+    { "/img.jpg?w=100", "e", "/img.jpg?w=100" },
+    { "/img.jpg", "e", "/img.jpg" },
+    { "/img.jpg?s=" SIG, "e", "/img.jpg" },
+
+    /* pairs carrying the signature or the expiry are covered */
+    { "/img.jpg?w=100&e=1700000000&s=" SIG "&a=" SIG, "e",
+            "/img.jpg?w=100&a=" SIG },
+    { "/img.jpg?w=100&e=1700000000&s=" SIG "&h=1700000000", "e",
+            "/img.jpg?w=100&h=1700000000" },
+    { "/img.jpg?w=100&ss=" SIG "&s=" SIG, "e", "/img.jpg?w=100&ss=" SIG },
+    { "/img.jpg?w=100&%73=" SIG "&s=" SIG, "e", "/img.jpg?w=100&%73=" SIG },
+
+    /* the parameters may appear only once */
+    { "/img.jpg?w=100&s=" SIG "&s=" SIG, "e", NULL },
+    { "/img.jpg?w=100&s=" SIG "&s", "e", NULL },
+    { "/img.jpg?w=100&e=1&e=2&s=" SIG, "e", NULL },
+
+    /* without an expiry time its parameter is an ordinary parameter */
+    { "/img.jpg?w=100&e=1&e=2&s=" SIG, NULL, "/img.jpg?w=100&e=1&e=2" },
+
+    /* empty pairs are dropped */
+    { "/img.jpg?&w=100&&s=" SIG "&", "e", "/img.jpg?w=100" }
+};
+
+/*
+ * URLs made from the signed URL by adding pairs, which must not verify with
+ * its signature, and so must be rejected or carry other data.
+ */
+static const char * const tampered[] = {
+    "/img.jpg?w=100&e=1700000000&s=" SIG "&a=" SIG,
+    "/img.jpg?w=100&e=1700000000&s=" SIG "&a=" SIG "&b=" SIG,
+    "/img.jpg?w=100&e=1700000000&s=" SIG "&w=1700000000",
+    "/img.jpg?w=100&e=1700000000&s=" SIG "&s=" SIG,
+    "/img.jpg?w=100&e=1700000000&s=" SIG "&e=1700000000",
+    "/img.jpg?w=100&e=1700000000&s=" SIG "&x"
+};
+
+int main(void)
+{
+    const char *signed_data = "/img.jpg?w=100";
+    unsigned int i;
+    int failed = 0;
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        char *data = malloc(strlen(cases[i].uri) + 1);
+        int rv = magick_signature_data(data, cases[i].uri, "s",
+                cases[i].expires_name);
+
+        if (!cases[i].expected ? rv : !rv || strcmp(data, cases[i].expected)) {
+            printf("FAIL: %s gave %s, expected %s\n", cases[i].uri,
+                    rv ? data : "rejected",
+                    cases[i].expected ? cases[i].expected : "rejected");
+            failed++;
+        }
+
+        free(data);
+    }
+
+    for (i = 0; i < sizeof(tampered) / sizeof(tampered[0]); i++) {
+        char *data = malloc(strlen(tampered[i]) + 1);
+
+        if (magick_signature_data(data, tampered[i], "s", "e")
+                && !strcmp(data, signed_data)) {
+            printf("FAIL: %s verifies with the signature of %s\n",
+                    tampered[i], signed_data);
+            failed++;
+        }
+
+        free(data);
+    }
+
+    printf("%d failed\n", failed);
+
+    return failed ? 1 : 0;
+}